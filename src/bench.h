@@ -0,0 +1,145 @@
+#ifndef INDEX_BENCH_H_INCLUDED
+#define INDEX_BENCH_H_INCLUDED
+
+#include "groundtruth.h"
+#include "search.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// One point of a parameter sweep
+struct BenchRow
+{
+    std::string config;// index configuration, see params.h
+    int checks;
+    double build_seconds;
+    uint64_t index_bytes;// size of the saved index
+    double recall;// mean recall@n against exact neighbors
+    double qps;
+    double p50, p99;// query latency in seconds
+    bool pareto = false;// no other row has both higher recall and higher qps
+};
+
+// Searches queries one row at a time on threads workers, collects per query latencies
+// - returns the wall time of the whole search
+double timed_search(Engine & engine, cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists,
+    Query const & query, unsigned threads, std::vector<double> & latencies)
+{
+    using Clock = std::chrono::steady_clock;
+
+    indices.create(queries.rows, query.n);
+    dists.create(queries.rows, query.n);
+    latencies.assign(queries.rows, 0.0);
+
+    std::atomic<int> next{0};
+    auto const worker = [&]()
+    {
+        for(int i; (i = next.fetch_add(1)) < queries.rows;)
+        {
+            cv::Mat_<int> row_indices = indices.rowRange(i, i+1);
+            cv::Mat_<float> row_dists = dists.rowRange(i, i+1);
+            auto const begin = Clock::now();
+            engine.search(queries.rowRange(i, i+1), row_indices, row_dists, query);
+            latencies[i] = std::chrono::duration<double>(Clock::now() - begin).count();
+        }
+    };
+
+    auto const begin = Clock::now();
+    std::vector<std::thread> workers;
+    for(unsigned i = 1; i < threads; ++i)
+        workers.emplace_back(worker);
+    worker();
+    for(auto & w : workers)
+        w.join();
+    return std::chrono::duration<double>(Clock::now() - begin).count();
+}
+
+// Mean fraction of the exact neighbors found in each result row
+double recall(cv::Mat_<int> const & found, cv::Mat_<int> const & exact, int rows)
+{
+    if(rows == 0)
+        return 0;
+    double sum = 0;
+    for(int i = 0; i < rows; ++i)
+        sum += row_recall(found[i], found.cols, exact[i], exact.cols);
+    return sum/rows;
+}
+
+// Nearest rank percentile, p in [0,1]
+inline double percentile(std::vector<double> values, double p)
+{
+    if(values.empty())
+        return 0;
+    size_t const rank = std::min(values.size()-1, size_t(p*values.size()));
+    std::nth_element(values.begin(), values.begin()+rank, values.end());
+    return values[rank];
+}
+
+// Size of the index as cv::flann::Index::save writes it, the features are not included
+uint64_t index_bytes(cv::flann::Index const & index)
+{
+    char const * dir = getenv("TMPDIR");
+    std::string path = std::string(dir ? dir : "/tmp") + "/flann-bench-XXXXXX";
+    int const fd = mkstemp(&path[0]);
+    if(fd < 0)
+        return 0;
+    close(fd);
+
+    index.save(path);
+    struct stat info;
+    uint64_t const size = (stat(path.c_str(), &info) == 0) ? info.st_size : 0;
+    unlink(path.c_str());
+    return size;
+}
+
+void mark_pareto(std::vector<BenchRow> & rows)
+{
+    for(auto & row : rows)
+    {
+        row.pareto = std::none_of(rows.begin(), rows.end(), [&row](BenchRow const & other)
+        {
+            return (other.recall >= row.recall) && (other.qps >= row.qps)
+                && ((other.recall > row.recall) || (other.qps > row.qps));
+        });
+    }
+}
+
+void write_csv(std::ostream & out, std::vector<BenchRow> const & rows)
+{
+    out << "config,checks,build_seconds,index_bytes,recall,qps,p50_seconds,p99_seconds,pareto\n";
+    for(auto const & row : rows)
+    {
+        out << '"' << row.config << "\"," << row.checks << ',' << row.build_seconds << ',' << row.index_bytes << ','
+            << row.recall << ',' << row.qps << ',' << row.p50 << ',' << row.p99 << ',' << (row.pareto ? 1 : 0) << '\n';
+    }
+}
+
+void write_json(std::ostream & out, std::vector<BenchRow> const & rows)
+{
+    out << "[\n";
+    for(size_t i = 0; i < rows.size(); ++i)
+    {
+        auto const & row = rows[i];
+        out << "  {\"config\": \"" << row.config << "\", \"checks\": " << row.checks
+            << ", \"build_seconds\": " << row.build_seconds << ", \"index_bytes\": " << row.index_bytes
+            << ", \"recall\": " << row.recall << ", \"qps\": " << row.qps
+            << ", \"p50_seconds\": " << row.p50 << ", \"p99_seconds\": " << row.p99
+            << ", \"pareto\": " << (row.pareto ? "true" : "false") << '}' << ((i+1 < rows.size()) ? ",\n" : "\n");
+    }
+    out << "]\n";
+}
+
+#endif//INDEX_BENCH_H_INCLUDED
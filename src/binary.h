@@ -0,0 +1,86 @@
+#ifndef BINARY_FEATURES_H_INCLUDED
+#define BINARY_FEATURES_H_INCLUDED
+
+#include "search.h"
+
+#include <cstdint>
+
+#include <algorithm>
+
+#include <opencv2/flann/flann.hpp>
+
+// -- Binary descriptors --
+//
+// HAMMING distance works on 0/1 features packed 8 per byte into CV_8U rows, nonzero features are ones.
+// Rows are padded with zero bytes to a multiple of 8 bytes so flann's Hamming distance counts bits with
+// 64-bit popcounts. A packed row is 32x smaller than the float row.
+
+inline bool is_binary(int distance)
+{
+    return distance == cvflann::FLANN_DIST_HAMMING;
+}
+
+inline int packed_cols(int dim)
+{
+    return (dim + 63)/64*8;
+}
+
+inline void pack_row(float const * row, int dim, uint8_t * packed)
+{
+    std::fill(packed, packed + packed_cols(dim), uint8_t(0));
+    for(int j = 0; j < dim; ++j)
+        if(row[j] != 0)
+            packed[j/8] |= uint8_t(1 << (j%8));
+}
+
+cv::Mat pack_bits(cv::Mat_<float> const & mat)
+{
+    cv::Mat packed(mat.rows, packed_cols(mat.cols), CV_8U);
+    for(int i = 0; i < mat.rows; ++i)
+        pack_row(mat[i], mat.cols, packed.ptr(i));
+    return packed;
+}
+
+// Engine over a cv::flann::Index of packed rows (linear or LSH), float queries are packed per batch
+// - flann reports Hamming distances as integers, they are returned as floats
+class BinaryEngine : public Engine
+{
+public:
+    explicit BinaryEngine(cv::flann::Index & index)
+        : m_index(index)
+    {
+    }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        cv::Mat packed(queries.rows, packed_cols(queries.cols), CV_8U);
+        for(int i = 0; i < queries.rows; ++i)
+            pack_row(queries[i], queries.cols, packed.ptr(i));
+
+        cv::flann::SearchParams const params{query.checks};
+        cv::Mat bits;
+        indices.setTo(-1);
+        if(query.radius >= 0)
+        {
+            for(int i = 0; i < queries.rows; ++i)
+            {
+                cv::Mat_<int> row_indices = indices.row(i);
+                m_index.radiusSearch(packed.row(i), row_indices, bits, query.radius, query.n, params);
+                for(int j = 0; j < query.n; ++j)
+                    dists(i, j) = (row_indices(0, j) >= 0) ? bits.at<int>(0, j) : 0.0f;
+            }
+        }
+        else
+        {
+            m_index.knnSearch(packed, indices, bits, query.n, params);
+            for(int i = 0; i < queries.rows; ++i)
+                for(int j = 0; j < query.n; ++j)
+                    dists(i, j) = bits.at<int>(i, j);
+        }
+    }
+
+private:
+    cv::flann::Index & m_index;
+};
+
+#endif//BINARY_FEATURES_H_INCLUDED
@@ -0,0 +1,215 @@
+#ifndef INDEX_BUNDLE_H_INCLUDED
+#define INDEX_BUNDLE_H_INCLUDED
+
+#include "data.h"
+#include "mapping.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+// -- Index bundle --
+//
+// One file with everything a search needs, native endian :
+//  index   : cv::flann::Index::save output, Index::load ignores what follows it, or a flat index (flat.h)
+//  dataset : dense binary dataset (data.h) at a multiple of 64 bytes
+//  params  : build parameters, "name=value" lines
+//  footer  : BundleFooter, the last bytes of the file
+// Every write of a bundle gets a new random generation, index deltas record it. Version 1 footers have
+// no generation, the fields after it end the file the same way.
+// A bundle is still a plain index file, so "-f features -x bundle" works too.
+// A bundle with a flat index is only read by the tools of this repository.
+
+char const bundle_magic[8] = {'F','L','A','N','N','B','N','D'};
+
+struct BundleFooter
+{
+    uint64_t generation;// from version 2
+    uint64_t dataset;// offsets from the start of the file
+    uint64_t params;
+    uint64_t params_size;
+    uint32_t version;
+    uint32_t distance;
+    char magic[8];
+};
+
+struct Bundle
+{
+    Data train;// labels and the mapped dense features
+    std::string params;
+    int distance = 0;
+};
+
+// Bytes of the footer at the end of the file
+inline size_t footer_size(BundleFooter const & footer)
+{
+    return (footer.version >= 2) ? sizeof(footer) : sizeof(footer) - sizeof(footer.generation);
+}
+
+inline bool read_footer(char const * filename, BundleFooter & footer)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if(file.seekg(-std::streamoff(sizeof(footer)), std::ios::end))
+        file.read(reinterpret_cast<char *>(&footer), sizeof(footer));
+    if(footer.version < 2)
+        footer.generation = 0;
+    return file && (memcmp(footer.magic, bundle_magic, sizeof(bundle_magic)) == 0);
+}
+
+// Generation of a bundle, 0 for other index files and version 1 bundles
+inline uint64_t bundle_generation(char const * filename)
+{
+    BundleFooter footer{};
+    return read_footer(filename, footer) ? footer.generation : 0;
+}
+
+inline uint64_t new_generation()
+{
+    std::random_device random;
+    uint64_t const time = std::chrono::steady_clock::now().time_since_epoch().count();
+    return ((uint64_t(random()) << 32) ^ random() ^ time) | 1;
+}
+
+inline bool is_bundle(char const * filename)
+{
+    BundleFooter footer{};
+    return read_footer(filename, footer);
+}
+
+// Distance a bundle was built with, fallback for other index files
+inline int index_distance(char const * filename, int fallback)
+{
+    BundleFooter footer{};
+    return read_footer(filename, footer) ? int(footer.distance) : fallback;
+}
+
+// Maps a bundle, the features are used in place
+Bundle load_bundle(char const * filename)
+{
+    auto mapping = std::make_shared<Mapping const>(filename);
+    BundleFooter footer{};
+    if(mapping->size() >= sizeof(footer))
+        memcpy(&footer, mapping->data()+mapping->size()-sizeof(footer), sizeof(footer));
+    // the parameters end before the footer, checked without overflowing
+    uint64_t const available = mapping->size() - std::min<uint64_t>(mapping->size(), footer_size(footer));
+    if((memcmp(footer.magic, bundle_magic, sizeof(bundle_magic)) != 0) || (footer.version < 1) || (footer.version > 2)
+        || (footer.dataset % 64 != 0) || (footer.dataset > footer.params)
+        || (footer.params > available) || (footer.params_size > available - footer.params))
+    {
+        std::cerr << "Invalid index bundle '" << filename << "'\n";
+        throw std::runtime_error("");
+    }
+
+    Bundle bundle;
+    bundle.params.assign(mapping->data()+footer.params, footer.params_size);
+    bundle.distance = footer.distance;
+    bundle.train = load_dataset(std::move(mapping), footer.dataset);
+    if(!bundle.train.dense)
+    {
+        std::cerr << "Invalid index bundle '" << filename << "'\n";
+        throw std::runtime_error("");
+    }
+    return bundle;
+}
+
+// Training data of an index, from the index bundle or else from the features file
+// - params receives the build parameters of a bundle
+Data load_train(char const * features, char const * index, unsigned threads, std::string * params = nullptr)
+{
+    if(is_bundle(index))
+    {
+        auto bundle = load_bundle(index);
+        if(params)
+            *params = std::move(bundle.params);
+        return std::move(bundle.train);
+    }
+    if(!features)
+    {
+        std::cerr << "Index '" << index << "' is not a bundle, the training features are required\n";
+        throw std::runtime_error("");
+    }
+    return load(features, threads);
+}
+
+// Build parameters as "name=value" lines
+inline std::string describe(cv::flann::IndexParams const & params)
+{
+    std::vector<cv::String> names, strings;
+    std::vector<cv::flann::FlannIndexType> types;
+    std::vector<double> numbers;
+    params.getAll(names, types, strings, numbers);
+
+    std::ostringstream out;
+    for(size_t i = 0; i < names.size(); ++i)
+    {
+        out << names[i] << '=';
+        if(types[i] == cv::flann::FLANN_INDEX_TYPE_STRING)
+            out << strings[i];
+        else
+            out << numbers[i];
+        out << '\n';
+    }
+    return out.str();
+}
+
+// Appends the features, labels and build parameters to the index in filename
+void append_bundle(cv::Mat_<float> const & features, std::vector<double> const & labels,
+    std::string const & params, int distance, char const * filename)
+{
+    std::fstream file(filename, std::ios::in | std::ios::out | std::ios::binary | std::ios::ate);
+    if(!file)
+    {
+        std::cerr << "Can't open '" << filename << "'\n";
+        throw std::runtime_error("");
+    }
+
+    BundleFooter footer{};
+    footer.dataset = dataset_align(file.tellp());
+    static char const zeros[64] = {};
+    file.write(zeros, footer.dataset - file.tellp());
+
+    // dense view of the feature matrix
+    Data data;
+    data.labels = labels;
+    data.offsets.clear();
+    data.dim = features.cols;
+    data.dense = features.ptr<float>();
+    write_dataset(file, data, false);
+
+    footer.params = file.tellp();
+    footer.params_size = params.size();
+    file.write(params.data(), params.size());
+
+    footer.generation = new_generation();
+    footer.version = 2;
+    footer.distance = distance;
+    memcpy(footer.magic, bundle_magic, sizeof(bundle_magic));
+    file.write(reinterpret_cast<char const *>(&footer), sizeof(footer));
+    if(!file.flush())
+    {
+        std::cerr << "Can't write '" << filename << "'\n";
+        throw std::runtime_error("");
+    }
+}
+
+// Saves the index followed by the features, labels and build parameters
+void save_bundle(cv::flann::Index const & index, cv::Mat_<float> const & features, std::vector<double> const & labels,
+    std::string const & params, char const * filename)
+{
+    index.save(filename);
+    append_bundle(features, labels, params, index.getDistance(), filename);
+}
+
+#endif//INDEX_BUNDLE_H_INCLUDED
@@ -0,0 +1,257 @@
+#ifndef RESULT_CACHE_H_INCLUDED
+#define RESULT_CACHE_H_INCLUDED
+
+#include "groundtruth.h"
+#include "search.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+// -- Result cache --
+//
+// Search results of recent queries, keyed by a hash of the dense query row and the search parameters
+// (n, radius, checks), equal keys are confirmed by comparing the rows. Entries are evicted least recently
+// used once they take more than the memory budget.
+// Repeated rows are searched once : equal rows of a block share one search, and a row another block is
+// searching waits for its result instead of searching it again.
+
+class CacheEngine : public Engine
+{
+public:
+    // budget in bytes, 0 keeps no results and only collapses rows searched at the same time
+    CacheEngine(Engine & inner, size_t budget)
+        : m_inner(inner)
+        , m_budget(budget)
+    {
+    }
+
+    uint64_t hits() const { return m_hits; }// found in the cache or being searched
+    uint64_t misses() const { return m_misses; }
+    uint64_t duplicates() const { return m_duplicates; }// equal to an earlier row of the same block
+    uint64_t evictions() const { return m_evictions; }
+    size_t bytes() const { return m_bytes; }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        int const rows = queries.rows;
+        uint64_t const seed = query_seed(query);
+        std::vector<uint64_t> hashes(rows);
+        for(int i = 0; i < rows; ++i)
+            hashes[i] = hash_floats(queries[i], queries.cols, seed);
+
+        std::vector<int> source(rows, -1);// earlier equal row of the block
+        std::vector<std::shared_ptr<Entry>> entries(rows);
+        std::vector<int> missing;
+        std::vector<int> waiting;
+        std::unordered_map<uint64_t, int> first;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for(int i = 0; i < rows; ++i)
+            {
+                auto const inserted = first.emplace(hashes[i], i);
+                if(!inserted.second && same_row(queries[inserted.first->second], queries[i], queries.cols))
+                {
+                    source[i] = inserted.first->second;
+                    ++m_duplicates;
+                    continue;
+                }
+                auto entry = find(hashes[i], queries[i], queries.cols, query);
+                if(entry)
+                {
+                    ++m_hits;
+                    entries[i] = entry;
+                    if(entry->ready)
+                    {
+                        copy(*entry, indices[i], dists[i]);
+                        m_lru.splice(m_lru.begin(), m_lru, entry->lru);
+                    }
+                    else
+                        waiting.push_back(i);
+                    continue;
+                }
+                ++m_misses;
+                entry = std::make_shared<Entry>();
+                entry->hash = hashes[i];
+                entry->query = query;
+                entry->row.assign(queries[i], queries[i] + queries.cols);
+                m_entries.emplace(entry->hash, entry);
+                entries[i] = entry;
+                missing.push_back(i);
+            }
+        }
+
+        if(!missing.empty())
+        {
+            cv::Mat_<float> batch(int(missing.size()), queries.cols);
+            for(size_t k = 0; k < missing.size(); ++k)
+                std::copy(queries[missing[k]], queries[missing[k]] + queries.cols, batch[k]);
+            cv::Mat_<int> found(batch.rows, query.n);
+            cv::Mat_<float> found_dists(batch.rows, query.n);
+            try
+            {
+                m_inner.search(batch, found, found_dists, query);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for(int i : missing)
+                {
+                    entries[i]->failed = true;
+                    erase(entries[i]);
+                }
+                m_ready.notify_all();
+                throw;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for(size_t k = 0; k < missing.size(); ++k)
+            {
+                Entry & entry = *entries[missing[k]];
+                entry.indices.assign(found[k], found[k] + query.n);
+                entry.dists.assign(found_dists[k], found_dists[k] + query.n);
+                entry.ready = true;
+                copy(entry, indices[missing[k]], dists[missing[k]]);
+                if(m_budget > 0)
+                {
+                    m_lru.push_front(entries[missing[k]]);
+                    entry.lru = m_lru.begin();
+                    m_bytes += entry_bytes(entry);
+                }
+                else
+                    erase(entries[missing[k]]);
+            }
+            evict();
+            m_ready.notify_all();
+        }
+
+        for(int i : waiting)
+        {
+            Entry const & entry = *entries[i];
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_ready.wait(lock, [&]() { return entry.ready || entry.failed; });
+                if(entry.ready)
+                {
+                    copy(entry, indices[i], dists[i]);
+                    continue;
+                }
+            }
+            // the block searching it failed
+            cv::Mat_<int> row_indices = indices.row(i);
+            cv::Mat_<float> row_dists = dists.row(i);
+            m_inner.search(queries.row(i), row_indices, row_dists, query);
+        }
+
+        for(int i = 0; i < rows; ++i)
+        {
+            if(source[i] < 0)
+                continue;
+            std::copy(indices[source[i]], indices[source[i]] + query.n, indices[i]);
+            std::copy(dists[source[i]], dists[source[i]] + query.n, dists[i]);
+        }
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t hash;
+        Query query;
+        std::vector<float> row;
+        std::vector<int> indices;
+        std::vector<float> dists;
+        bool ready = false;
+        bool failed = false;
+        std::list<std::shared_ptr<Entry>>::iterator lru;// valid when cached
+    };
+
+    // Hash of the search parameters, the rows are hashed on from it
+    static uint64_t query_seed(Query const & query)
+    {
+        float words[4];
+        memcpy(words, &query.radius, sizeof(query.radius));
+        memcpy(words+2, &query.n, sizeof(query.n));
+        memcpy(words+3, &query.checks, sizeof(query.checks));
+        return hash_floats(words, 4);
+    }
+
+    static bool same_row(float const * a, float const * b, int cols)
+    {
+        return memcmp(a, b, cols*sizeof(float)) == 0;
+    }
+
+    static size_t entry_bytes(Entry const & entry)
+    {
+        // the entry, its list and map nodes and the vectors
+        return sizeof(Entry) + 64 + entry.row.size()*sizeof(float) + entry.indices.size()*(sizeof(int)+sizeof(float));
+    }
+
+    static void copy(Entry const & entry, int * indices, float * dists)
+    {
+        std::copy(entry.indices.begin(), entry.indices.end(), indices);
+        std::copy(entry.dists.begin(), entry.dists.end(), dists);
+    }
+
+    std::shared_ptr<Entry> find(uint64_t hash, float const * row, int cols, Query const & query) const
+    {
+        auto const range = m_entries.equal_range(hash);
+        for(auto it = range.first; it != range.second; ++it)
+        {
+            Entry const & entry = *it->second;
+            if((entry.query.n == query.n) && (entry.query.checks == query.checks)
+                && (memcmp(&entry.query.radius, &query.radius, sizeof(query.radius)) == 0)
+                && (entry.row.size() == size_t(cols)) && same_row(entry.row.data(), row, cols))
+                return it->second;
+        }
+        return nullptr;
+    }
+
+    void erase(std::shared_ptr<Entry> const & entry)
+    {
+        auto const range = m_entries.equal_range(entry->hash);
+        for(auto it = range.first; it != range.second; ++it)
+        {
+            if(it->second == entry)
+            {
+                m_entries.erase(it);
+                return;
+            }
+        }
+    }
+
+    void evict()
+    {
+        while((m_bytes > m_budget) && !m_lru.empty())
+        {
+            std::shared_ptr<Entry> const entry = m_lru.back();
+            m_lru.pop_back();
+            m_bytes -= entry_bytes(*entry);
+            erase(entry);
+            ++m_evictions;
+        }
+    }
+
+    Engine & m_inner;
+    size_t const m_budget;
+    size_t m_bytes = 0;
+
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::unordered_multimap<uint64_t, std::shared_ptr<Entry>> m_entries;// cached and being searched
+    std::list<std::shared_ptr<Entry>> m_lru;// cached, most recently used first
+
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+    uint64_t m_duplicates = 0;
+    uint64_t m_evictions = 0;
+};
+
+#endif//RESULT_CACHE_H_INCLUDED
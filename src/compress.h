@@ -0,0 +1,333 @@
+#ifndef COMPRESSED_INPUT_H_INCLUDED
+#define COMPRESSED_INPUT_H_INCLUDED
+
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+
+// -- Compressed input --
+//
+// gzip and zstd input is recognized by its magic bytes and decompressed in the process.
+// Concatenated gzip members and zstd frames are read as one stream. Independent zstd frames
+// (pzstd, zstd --block-size, concatenated files) can be decompressed in parallel, see zstd_frames.
+
+enum Compression
+{
+    compression_none,
+    compression_gzip,
+    compression_zstd,
+};
+
+inline Compression detect_compression(char const * p, size_t size)
+{
+    if((size >= 2) && (p[0] == '\x1f') && (p[1] == '\x8b'))
+        return compression_gzip;
+    if((size >= 4) && (p[0] == '\x28') && (p[1] == '\xb5') && (p[2] == '\x2f') && (p[3] == '\xfd'))
+        return compression_zstd;
+    return compression_none;
+}
+
+// Decompresses a whole gzip file in memory
+std::string gunzip(char const * begin, char const * end)
+{
+    z_stream stream{};
+    if(inflateInit2(&stream, 15+16) != Z_OK)
+    {
+        std::cerr << "Can't initialize gzip\n";
+        throw std::runtime_error("");
+    }
+    std::string text;
+    text.resize(std::max<size_t>(1 << 16, 4*(end-begin)));
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(begin));
+    stream.avail_in = end-begin;
+    size_t produced = 0;
+    int ret = Z_OK;
+    for(;;)
+    {
+        if(produced == text.size())
+            text.resize(2*text.size());
+        stream.next_out = reinterpret_cast<Bytef *>(&text[produced]);
+        stream.avail_out = text.size() - produced;
+        ret = inflate(&stream, Z_NO_FLUSH);
+        produced = text.size() - stream.avail_out;
+        if((ret == Z_STREAM_END) && (stream.avail_in > 0))
+            ret = inflateReset(&stream);// next member
+        else if((ret != Z_OK) && (ret != Z_BUF_ERROR))
+            break;
+        else if((stream.avail_in == 0) && (stream.avail_out > 0))
+            break;
+    }
+    inflateEnd(&stream);
+    if(ret != Z_STREAM_END)
+    {
+        std::cerr << ((ret == Z_OK || ret == Z_BUF_ERROR) ? "Truncated gzip input\n" : "Invalid gzip input\n");
+        throw std::runtime_error("");
+    }
+    text.resize(produced);
+    return text;
+}
+
+// Splits zstd input into its frames, skippable frames included
+std::vector<std::pair<char const *, char const *>> zstd_frames(char const * begin, char const * end)
+{
+    std::vector<std::pair<char const *, char const *>> frames;
+    while(begin < end)
+    {
+        size_t const size = ZSTD_findFrameCompressedSize(begin, end-begin);
+        if(ZSTD_isError(size))
+        {
+            std::cerr << "Invalid zstd input : " << ZSTD_getErrorName(size) << '\n';
+            throw std::runtime_error("");
+        }
+        frames.emplace_back(begin, begin+size);
+        begin += size;
+    }
+    return frames;
+}
+
+// Decompresses zstd frames in memory, appends to text
+void unzstd(char const * begin, char const * end, std::string & text)
+{
+    ZSTD_DStream * stream = ZSTD_createDStream();
+    unsigned long long const hint = ZSTD_getFrameContentSize(begin, end-begin);
+    size_t produced = text.size();
+    text.resize(produced + ((hint < ZSTD_CONTENTSIZE_ERROR) ? hint : 4*(end-begin)) + 1);
+    ZSTD_inBuffer in{begin, size_t(end-begin), 0};
+    size_t ret = 0;
+    for(;;)
+    {
+        if(produced == text.size())
+            text.resize(2*text.size());
+        ZSTD_outBuffer out{&text[0], text.size(), produced};
+        ret = ZSTD_decompressStream(stream, &out, &in);
+        produced = out.pos;
+        if(ZSTD_isError(ret) || ((in.pos == in.size) && (out.pos < out.size)))
+            break;
+    }
+    ZSTD_freeDStream(stream);
+    if(ZSTD_isError(ret))
+    {
+        std::cerr << "Invalid zstd input : " << ZSTD_getErrorName(ret) << '\n';
+        throw std::runtime_error("");
+    }
+    if(ret != 0)
+    {
+        std::cerr << "Truncated zstd input\n";
+        throw std::runtime_error("");
+    }
+    text.resize(produced);
+}
+
+// Decompresses input in memory if it is compressed, returns false otherwise
+bool decompress(char const * begin, char const * end, std::string & text)
+{
+    switch(detect_compression(begin, end-begin))
+    {
+    case compression_gzip:
+        text = gunzip(begin, end);
+        return true;
+    case compression_zstd:
+        text.clear();
+        unzstd(begin, end, text);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// -- Streaming --
+
+// Reads a file descriptor, gzip and zstd input is decompressed on the fly
+// - the first bytes are read on construction to recognize the compression
+// - also a stream buffer, for std::istream
+class InputStream : public std::streambuf
+{
+public:
+    explicit InputStream(int fd)
+        : m_fd(fd)
+        , m_in(1 << 18)
+    {
+        while((m_end < 4) && !m_eof)
+            read_input();
+        m_compression = detect_compression(m_in.data(), m_end);
+        if((m_compression == compression_gzip) && (inflateInit2(&m_gzip, 15+16) != Z_OK))
+        {
+            std::cerr << "Can't initialize gzip\n";
+            throw std::runtime_error("");
+        }
+        if(m_compression == compression_zstd)
+            m_zstd = ZSTD_createDStream();
+    }
+
+    InputStream(InputStream const &) = delete;
+    InputStream & operator=(InputStream const &) = delete;
+
+    ~InputStream()
+    {
+        if(m_compression == compression_gzip)
+            inflateEnd(&m_gzip);
+        if(m_zstd)
+            ZSTD_freeDStream(m_zstd);
+    }
+
+    Compression compression() const { return m_compression; }
+
+    // Reads up to size bytes, 0 at the end of input
+    // - returns less only when the input has no more data ready (a pipe) or at its end
+    size_t read(char * out, size_t size)
+    {
+        size_t produced = 0;
+        while(produced < size)
+        {
+            produced += step(out+produced, size-produced);
+            // the input is used up unless the output is full
+            if(produced == size)
+                break;
+            if(m_eof)
+            {
+                check_end();
+                break;
+            }
+            if((produced > 0) && m_short)
+                break;
+            m_begin = m_end = 0;
+            read_input();
+        }
+        return produced;
+    }
+
+protected:
+    int_type underflow() override
+    {
+        if(gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        m_get.resize(1 << 16);
+        size_t const count = read(m_get.data(), m_get.size());
+        if(count == 0)
+            return traits_type::eof();
+        setg(m_get.data(), m_get.data(), m_get.data()+count);
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    void read_input()
+    {
+        size_t const wanted = m_in.size()-m_end;
+        ssize_t count;
+        do
+        {
+            count = ::read(m_fd, m_in.data()+m_end, wanted);
+        }
+        while((count < 0) && (errno == EINTR));
+        if(count < 0)
+        {
+            std::cerr << "Can't read input\n";
+            throw std::runtime_error("");
+        }
+        m_end += count;
+        m_eof = (count == 0);
+        m_short = (size_t(count) < wanted);
+    }
+
+    // Decompresses buffered input, stops when the input is used up or the output is full
+    size_t step(char * out, size_t size)
+    {
+        switch(m_compression)
+        {
+        case compression_gzip:
+        {
+            m_gzip.next_in = reinterpret_cast<Bytef *>(m_in.data()+m_begin);
+            m_gzip.avail_in = m_end-m_begin;
+            m_gzip.next_out = reinterpret_cast<Bytef *>(out);
+            m_gzip.avail_out = size;
+            while(m_gzip.avail_out > 0)
+            {
+                if(m_gzip_end)
+                {
+                    if(m_gzip.avail_in == 0)
+                        break;
+                    inflateReset(&m_gzip);// next member
+                    m_gzip_end = false;
+                }
+                int const ret = inflate(&m_gzip, Z_NO_FLUSH);
+                if(ret == Z_STREAM_END)
+                    m_gzip_end = true;
+                else if((ret != Z_OK) && (ret != Z_BUF_ERROR))
+                {
+                    std::cerr << "Invalid gzip input\n";
+                    throw std::runtime_error("");
+                }
+                else if(m_gzip.avail_in == 0)
+                    break;
+            }
+            m_begin = m_end - m_gzip.avail_in;
+            return size - m_gzip.avail_out;
+        }
+        case compression_zstd:
+        {
+            // a finished frame has nothing left to flush, the decoder would wait for the next one
+            if((m_zstd_left == 0) && (m_begin == m_end))
+                return 0;
+            ZSTD_inBuffer in{m_in.data()+m_begin, m_end-m_begin, 0};
+            ZSTD_outBuffer output{out, size, 0};
+            while(output.pos < output.size)
+            {
+                m_zstd_left = ZSTD_decompressStream(m_zstd, &output, &in);
+                if(ZSTD_isError(m_zstd_left))
+                {
+                    std::cerr << "Invalid zstd input : " << ZSTD_getErrorName(m_zstd_left) << '\n';
+                    throw std::runtime_error("");
+                }
+                if(in.pos == in.size)
+                    break;
+            }
+            m_begin += in.pos;
+            return output.pos;
+        }
+        default:
+        {
+            size_t const count = std::min(size, m_end-m_begin);
+            std::copy(m_in.data()+m_begin, m_in.data()+m_begin+count, out);
+            m_begin += count;
+            return count;
+        }
+        }
+    }
+
+    void check_end() const
+    {
+        if(((m_compression == compression_gzip) && !m_gzip_end) || ((m_compression == compression_zstd) && (m_zstd_left != 0)))
+        {
+            std::cerr << "Truncated " << ((m_compression == compression_gzip) ? "gzip" : "zstd") << " input\n";
+            throw std::runtime_error("");
+        }
+    }
+
+    int const m_fd;
+    Compression m_compression = compression_none;
+    std::vector<char> m_in;// read but not decompressed input is [m_begin, m_end)
+    size_t m_begin = 0;
+    size_t m_end = 0;
+    bool m_eof = false;
+    bool m_short = false;// last read returned less than asked
+
+    z_stream m_gzip{};
+    bool m_gzip_end = false;// at the end of a gzip member
+    ZSTD_DStream * m_zstd = nullptr;
+    size_t m_zstd_left = 1;// 0 at the end of a zstd frame
+
+    std::vector<char> m_get;
+};
+
+#endif//COMPRESSED_INPUT_H_INCLUDED
@@ -1,78 +1,747 @@
 #ifndef LIBSVM_DATA_FILE_H_INCLUDED
 #define LIBSVM_DATA_FILE_H_INCLUDED
 
+#include "compress.h"
+#include "mapping.h"
+
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <exception>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
-using RowVec = std::vector<std::pair<unsigned, double>>;
-using DatVec = std::vector<std::pair<double, RowVec>>;
-
+// Dataset in compressed sparse row form
+// - row i has features [offsets[i], offsets[i+1]) of indices and values
+// - binary dense datasets keep the features in dense instead, offsets are empty then
 struct Data
 {
-    DatVec data;
-    unsigned dim;
+    std::vector<double> labels;
+    std::vector<size_t> offsets{0};
+    std::vector<unsigned> indices;
+    std::vector<float> values;
+    unsigned dim = 0;
+    // Dense size() x dim matrix of a binary dataset
+    float const * dense = nullptr;
+    std::shared_ptr<Mapping const> mapping;
+
+    size_t size() const { return labels.size(); }
+    size_t nonzeros() const { return indices.size(); }
+
+    // Empties the dataset, keeps the allocated memory
+    void clear()
+    {
+        labels.clear();
+        offsets.assign(1, 0);
+        indices.clear();
+        values.clear();
+        dim = 0;
+        dense = nullptr;
+        mapping.reset();
+    }
+
+    // Frees the sparse features once they are not needed, labels and a mapped dense matrix stay
+    void release_features()
+    {
+        std::vector<size_t>{}.swap(offsets);
+        std::vector<unsigned>{}.swap(indices);
+        std::vector<float>{}.swap(values);
+    }
 };
 
-Data load(std::istream & in)
+// Writes row i as dim floats, features past dim are dropped
+void densify(Data const & data, size_t i, float * row, unsigned dim)
 {
-    DatVec data;
-    unsigned dim = 0;
+    std::fill(row, row+dim, 0.0f);
+    if(data.dense)
+    {
+        float const * src = data.dense + i*data.dim;
+        std::copy(src, src+std::min(dim, data.dim), row);
+    }
+    else
+    {
+        for(size_t j = data.offsets[i]; j < data.offsets[i+1]; ++j)
+            if(data.indices[j]-1 < dim)
+                row[data.indices[j]-1] = data.values[j];
+    }
+}
 
-    size_t line_number = 0;
-    std::string line;
-    while(std::getline(in, line))
+// -- Parser --
+
+inline bool is_blank(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\v') || (c == '\f');
+}
+
+inline char const * skip_blank(char const * p, char const * end)
+{
+    while((p != end) && is_blank(*p))
+        ++p;
+    return p;
+}
+
+// Same syntax as "%lf" - leading blanks and an explicit '+' are accepted
+inline char const * parse_number(char const * p, char const * end, double & value)
+{
+    p = skip_blank(p, end);
+    if((p != end) && (*p == '+') && ((p+1) == end || (p[1] != '-' && p[1] != '+')))
+        ++p;
+    auto const r = std::from_chars(p, end, value);
+    return (r.ec == std::errc()) ? r.ptr : nullptr;
+}
+
+// Same syntax as "%u"
+inline char const * parse_number(char const * p, char const * end, unsigned & value)
+{
+    p = skip_blank(p, end);
+    if((p != end) && (*p == '+'))
+        ++p;
+    auto const r = std::from_chars(p, end, value);
+    return (r.ec == std::errc()) ? r.ptr : nullptr;
+}
+
+// Parsed line-aligned part of a file
+struct DataChunk
+{
+    Data data;
+    size_t lines = 0;// lines parsed without error
+    // first error, line is relative to the chunk
+    bool failed = false;
+    bool bad_label = false;
+    size_t error_column = 0;
+};
+
+// Parses whole lines in [begin, end), stops at the first invalid line
+inline void parse_chunk(char const * begin, char const * end, DataChunk & chunk)
+{
+    Data & data = chunk.data;
+    char const * line = begin;
+    while(line != end)
     {
-        ++line_number;
-        char const * p = line.c_str();
+        char const * const eol = std::find(line, end, '\n');
 
         double label;
-        int read;
-        if(sscanf(p, "%lf %n", &label, &read) != 1)
+        char const * p = parse_number(line, eol, label);
+        if(!p)
         {
-            std::cerr << "Line " << line_number << " : Can't read label\n";
-            throw std::runtime_error("");
+            chunk.failed = true;
+            chunk.bad_label = true;
+            return;
         }
-        p += read;
-
-        RowVec row;
+        p = skip_blank(p, eol);
 
-        unsigned index;
-        double value;
-        while(sscanf(p, "%u:%lf %n", &index, &value, &read) == 2)
+        while(p != eol)
         {
-            p += read;
-            row.emplace_back(index, value);
-            dim = std::max(dim, index);
+            unsigned index;
+            double value;
+            char const * q = parse_number(p, eol, index);
+            if(!q || (index == 0) || (q == eol) || (*q != ':'))
+                break;// indices start at 1
+            q = parse_number(q+1, eol, value);
+            if(!q)
+                break;
+            p = skip_blank(q, eol);
+            data.indices.push_back(index);
+            data.values.push_back(value);
+            data.dim = std::max(data.dim, index);
         }
-        if(*p != '\0')
+        if(p != eol)
         {
-            std::cerr << "Line " << line_number << " : Invalid data at char " << (p-line.c_str()) << std::endl;
-            throw std::runtime_error("");
+            chunk.failed = true;
+            chunk.error_column = p-line;
+            return;
         }
-        data.emplace_back(label, std::move(row));
+        data.labels.push_back(label);
+        data.offsets.push_back(data.indices.size());
+        ++chunk.lines;
+
+        line = (eol == end) ? eol : eol+1;
+    }
+}
+
+// Reports a parse error, first_line is the number of lines before the chunk
+inline void check_chunk(DataChunk const & chunk, size_t first_line)
+{
+    if(chunk.failed)
+    {
+        size_t const line_number = first_line + chunk.lines + 1;
+        if(chunk.bad_label)
+            std::cerr << "Line " << line_number << " : Can't read label\n";
+        else
+            std::cerr << "Line " << line_number << " : Invalid data at char " << chunk.error_column << std::endl;
+        throw std::runtime_error("");
     }
-    return Data{data, dim};
 }
 
-Data load(char const * filename)
+// Joins chunks of consecutive lines, the chunks are copied and freed by up to threads workers
+Data concatenate(std::vector<DataChunk> & chunks, unsigned threads)
 {
+    // Report the first error, with the line number in the whole input
+    size_t line_number = 0;
+    for(auto const & chunk : chunks)
+    {
+        check_chunk(chunk, line_number);
+        line_number += chunk.lines;
+    }
+
+    if(chunks.size() == 1)
+        return std::move(chunks[0].data);
+
     Data data;
-    if(filename)
+    size_t nonzeros = 0;
+    for(auto const & chunk : chunks)
+    {
+        nonzeros += chunk.data.nonzeros();
+        data.dim = std::max(data.dim, chunk.data.dim);
+    }
+    data.labels.resize(line_number);
+    data.offsets.resize(line_number+1);
+    data.indices.resize(nonzeros);
+    data.values.resize(nonzeros);
+
+    auto const append = [&data](DataChunk & chunk, size_t row, size_t offset)
+    {
+        Data & part = chunk.data;
+        std::copy(part.labels.begin(), part.labels.end(), data.labels.begin()+row);
+        for(size_t i = 1; i < part.offsets.size(); ++i)
+            data.offsets[row+i] = offset + part.offsets[i];
+        std::copy(part.indices.begin(), part.indices.end(), data.indices.begin()+offset);
+        std::copy(part.values.begin(), part.values.end(), data.values.begin()+offset);
+        part = Data{};
+    };
+
+    // first row and nonzero of every chunk
+    std::vector<std::pair<size_t, size_t>> starts{{0, 0}};
+    for(auto const & chunk : chunks)
+        starts.emplace_back(starts.back().first + chunk.data.size(), starts.back().second + chunk.data.nonzeros());
+
+    std::atomic<size_t> next{0};
+    auto const work = [&]()
+    {
+        for(size_t i = next++; i < chunks.size(); i = next++)
+            append(chunks[i], starts[i].first, starts[i].second);
+    };
+    std::vector<std::thread> workers;
+    for(size_t i = 1; i < std::min<size_t>(threads, chunks.size()); ++i)
+        workers.emplace_back(work);
+    work();
+    for(auto & worker : workers)
+        worker.join();
+    return data;
+}
+
+// Parses libsvm text in memory, chunks are parsed in parallel
+// - threads = 0 uses all cores
+Data load(char const * begin, char const * end, unsigned threads = 0)
+{
+    size_t const min_chunk = 1 << 20;
+    size_t const size = end-begin;
+
+    if(threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t const count = std::max<size_t>(1, std::min<size_t>(threads, size/min_chunk));
+
+    // Split at line boundaries
+    std::vector<char const *> bounds{begin};
+    for(size_t i = 1; i < count; ++i)
+    {
+        char const * p = std::max(bounds.back(), begin + size*i/count);
+        p = std::find(p, end, '\n');
+        bounds.push_back((p == end) ? end : p+1);
+    }
+    bounds.push_back(end);
+
+    std::vector<DataChunk> chunks(count);
+    {
+        std::vector<std::thread> workers;
+        for(size_t i = 1; i < count; ++i)
+            workers.emplace_back(parse_chunk, bounds[i], bounds[i+1], std::ref(chunks[i]));
+        parse_chunk(bounds[0], bounds[1], chunks[0]);
+        for(auto & worker : workers)
+            worker.join();
+    }
+    return concatenate(chunks, threads);
+}
+
+// Parses zstd compressed libsvm text, frames are decompressed and parsed in parallel
+// - the whole lines of a frame are parsed by the thread that decompressed it, lines split
+//   between frames are joined and parsed after, only a frame at a time per thread is kept decompressed
+// - a single frame is decompressed whole, then parsed in parallel
+Data load_zstd(char const * begin, char const * end, unsigned threads = 0)
+{
+    auto const frames = zstd_frames(begin, end);
+    if(threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    if((frames.size() == 1) || (threads == 1))
+    {
+        std::string text;
+        unzstd(begin, end, text);
+        return load(text.data(), text.data()+text.size(), threads);
+    }
+
+    struct Frame
     {
-        std::ifstream file(filename);
-        data = load(file);
+        std::string head;// up to the first newline, the whole frame if it has none
+        std::string tail;// after the last newline
+        bool newline = false;
+        DataChunk chunk;// lines in between
+    };
+    std::vector<Frame> parts(frames.size());
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto const work = [&]()
+    {
+        std::string text;
+        for(size_t i = next++; i < frames.size(); i = next++)
+        {
+            try
+            {
+                text.clear();
+                unzstd(frames[i].first, frames[i].second, text);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if(!error)
+                    error = std::current_exception();
+                return;
+            }
+            Frame & part = parts[i];
+            size_t const first = text.find('\n');
+            part.newline = (first != std::string::npos);
+            if(!part.newline)
+            {
+                part.head = text;
+                continue;
+            }
+            size_t const last = text.rfind('\n');
+            part.head.assign(text, 0, first+1);
+            part.tail.assign(text, last+1, std::string::npos);
+            parse_chunk(text.data()+first+1, text.data()+last+1, part.chunk);
+        }
+    };
+    {
+        std::vector<std::thread> workers;
+        for(size_t i = 1; i < std::min<size_t>(threads, frames.size()); ++i)
+            workers.emplace_back(work);
+        work();
+        for(auto & worker : workers)
+            worker.join();
+    }
+    if(error)
+        std::rethrow_exception(error);
+
+    // Stitch the split lines in between the frame chunks
+    std::vector<DataChunk> chunks;
+    std::string pending;
+    for(auto & part : parts)
+    {
+        pending += part.head;
+        if(!part.newline)
+            continue;
+        chunks.emplace_back();
+        parse_chunk(pending.data(), pending.data()+pending.size(), chunks.back());
+        chunks.push_back(std::move(part.chunk));
+        pending = std::move(part.tail);
+    }
+    chunks.emplace_back();
+    parse_chunk(pending.data(), pending.data()+pending.size(), chunks.back());
+    return concatenate(chunks, threads);
+}
+
+// Parses libsvm text in memory that may be gzip or zstd compressed
+Data load_text(char const * begin, char const * end, unsigned threads = 0)
+{
+    switch(detect_compression(begin, end-begin))
+    {
+    case compression_gzip:
+    {
+        std::string const text = gunzip(begin, end);
+        return load(text.data(), text.data()+text.size(), threads);
     }
+    case compression_zstd:
+        return load_zstd(begin, end, threads);
+    default:
+        return load(begin, end, threads);
+    }
+}
+
+// -- Binary dataset --
+//
+// Native endian, every section starts at a multiple of 64 bytes :
+//  header
+//  labels : rows x double
+//  dense  : rows x dim x float
+//  sparse : (rows+1) x uint64 row offsets, nnz x uint32 indices, nnz x float values
+
+char const dataset_magic[8] = {'F','L','A','N','N','D','A','T'};
+
+struct DatasetHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sparse;
+    uint64_t rows;
+    uint64_t dim;
+    uint64_t nnz;
+    // section offsets from the start of the file
+    uint64_t labels;
+    uint64_t features;// dense values or sparse row offsets
+    uint64_t indices;
+    uint64_t values;
+};
+
+inline uint64_t dataset_align(uint64_t offset)
+{
+    return (offset + 63) & ~uint64_t(63);
+}
+
+inline bool is_dataset(char const * p, size_t size)
+{
+    return (size >= sizeof(DatasetHeader)) && (memcmp(p, dataset_magic, sizeof(dataset_magic)) == 0);
+}
+
+// Dense datasets are used in place, sparse arrays are copied
+// - base is the offset of the dataset in the mapping, a multiple of 64
+Data load_dataset(std::shared_ptr<Mapping const> mapping, uint64_t base = 0)
+{
+    DatasetHeader header;
+    if(!is_dataset(mapping->data()+base, mapping->size()-base))
+    {
+        std::cerr << "Invalid binary dataset\n";
+        throw std::runtime_error("");
+    }
+    memcpy(&header, mapping->data()+base, sizeof(header));
+
+    // every section holds count elements of size bytes within the mapping, at an aligned offset
+    uint64_t const available = mapping->size()-base;
+    auto const fits = [available](uint64_t offset, uint64_t count, uint64_t size)
+    {
+        return (offset % size == 0) && (offset <= available) && (count <= (available - offset)/size);
+    };
+    bool valid = (header.version == 1) && (header.dim <= UINT32_MAX) && (header.rows < UINT64_MAX)
+        && fits(header.labels, header.rows, sizeof(double));
+    if(header.sparse)
+        valid = valid && fits(header.features, header.rows+1, sizeof(uint64_t))
+            && fits(header.indices, header.nnz, sizeof(uint32_t)) && fits(header.values, header.nnz, sizeof(float));
     else
+        valid = valid && ((header.dim == 0) || (header.rows <= UINT64_MAX/header.dim))
+            && fits(header.features, header.rows*header.dim, sizeof(float));
+    if(!valid)
     {
-        data = load(std::cin);
+        std::cerr << "Invalid binary dataset\n";
+        throw std::runtime_error("");
+    }
+
+    auto const section = [&mapping, base](uint64_t offset)
+    {
+        return mapping->data() + base + offset;
+    };
+    auto const labels = reinterpret_cast<double const *>(section(header.labels));
+
+    Data data;
+    data.dim = header.dim;
+    data.labels.assign(labels, labels+header.rows);
+    if(header.sparse)
+    {
+        auto const offsets = reinterpret_cast<uint64_t const *>(section(header.features));
+        auto const indices = reinterpret_cast<uint32_t const *>(section(header.indices));
+        auto const values  = reinterpret_cast<float    const *>(section(header.values));
+        data.offsets.assign(offsets, offsets+header.rows+1);
+        if((data.offsets.front() != 0) || (data.offsets.back() != header.nnz)
+            || !std::is_sorted(data.offsets.begin(), data.offsets.end()))
+        {
+            std::cerr << "Invalid binary dataset, row offsets aren't increasing up to " << header.nnz << '\n';
+            throw std::runtime_error("");
+        }
+        data.indices.assign(indices, indices+header.nnz);
+        data.values .assign(values , values +header.nnz);
+        // indices start at 1
+        for(unsigned index : data.indices)
+        {
+            if((index == 0) || (index > data.dim))
+            {
+                std::cerr << "Invalid binary dataset, feature index " << index << " out of range\n";
+                throw std::runtime_error("");
+            }
+        }
+    }
+    else
+    {
+        data.offsets.clear();
+        data.dense = reinterpret_cast<float const *>(section(header.features));
+        data.mapping = std::move(mapping);
     }
     return data;
 }
 
+// Writes data as a binary dataset at the current position of file, dense or sparse
+// - the position must be a multiple of 64 for the sections to be aligned
+void write_dataset(std::ostream & file, Data const & data, bool sparse)
+{
+    std::streamoff const base = file.tellp();
+
+    DatasetHeader header{};
+    memcpy(header.magic, dataset_magic, sizeof(dataset_magic));
+    header.version = 1;
+    header.sparse = (sparse && !data.dense) ? 1 : 0;
+    header.rows = data.size();
+    header.dim = data.dim;
+    header.nnz = data.nonzeros();
+    header.labels = dataset_align(sizeof(header));
+    header.features = dataset_align(header.labels + header.rows*sizeof(double));
+    if(header.sparse)
+    {
+        header.indices = dataset_align(header.features + (header.rows+1)*sizeof(uint64_t));
+        header.values  = dataset_align(header.indices + header.nnz*sizeof(uint32_t));
+    }
+
+    auto const pad = [&file, base](uint64_t offset)
+    {
+        static char const zeros[64] = {};
+        file.write(zeros, base + offset - file.tellp());
+    };
+    auto const put = [&file](auto const & values)
+    {
+        file.write(reinterpret_cast<char const *>(values.data()), values.size()*sizeof(values[0]));
+    };
+    static_assert(sizeof(size_t) == sizeof(uint64_t), "row offsets are stored as uint64");
+    static_assert(sizeof(unsigned) == sizeof(uint32_t), "indices are stored as uint32");
+
+    file.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    pad(header.labels);
+    put(data.labels);
+    pad(header.features);
+    if(header.sparse)
+    {
+        put(data.offsets);
+        pad(header.indices);
+        put(data.indices);
+        pad(header.values);
+        put(data.values);
+    }
+    else
+    {
+        std::vector<float> row(data.dim);
+        for(size_t i = 0; i < data.size(); ++i)
+        {
+            densify(data, i, row.data(), data.dim);
+            put(row);
+        }
+    }
+}
+
+// Writes data as a binary dataset file, dense or sparse
+void save_dataset(Data const & data, char const * filename, bool sparse)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if(!file)
+    {
+        std::cerr << "Can't open '" << filename << "'\n";
+        throw std::runtime_error("");
+    }
+    write_dataset(file, data, sparse);
+    if(!file.flush())
+    {
+        std::cerr << "Can't write '" << filename << "'\n";
+        throw std::runtime_error("");
+    }
+}
+
+// -- Loading --
+
+Data load(std::istream & in, unsigned threads = 0)
+{
+    std::string const text{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    return load_text(text.data(), text.data()+text.size(), threads);
+}
+
+// Loads a libsvm or binary dataset file, stdin if filename is null
+// - regular files are memory mapped, anything else is read
+// - gzip and zstd compressed libsvm text is decompressed
+Data load(char const * filename, unsigned threads = 0)
+{
+    if(!filename)
+        return load(std::cin, threads);
+
+    auto mapping = std::make_shared<Mapping const>(filename);
+    if(*mapping)
+    {
+        if(is_dataset(mapping->data(), mapping->size()))
+            return load_dataset(std::move(mapping));
+        mapping->advise(MADV_WILLNEED);
+        return load_text(mapping->data(), mapping->data()+mapping->size(), threads);
+    }
+
+    std::ifstream file(filename);
+    if(!file)
+    {
+        std::cerr << "Can't open '" << filename << "'\n";
+        throw std::runtime_error("");
+    }
+    return load(file, threads);
+}
+
+// -- Streaming --
+
+// Reads a dataset in batches of rows, stdin if filename is null
+// - libsvm text is read through a buffer that grows only to fit the longest batch
+// - a batch is returned early when a pipe has no more data ready
+// - binary datasets are mapped, batches of dense ones point into the mapping
+// - gzip and zstd compressed libsvm text is decompressed on the fly
+class DataReader
+{
+public:
+    explicit DataReader(char const * filename)
+    {
+        if(!filename)
+        {
+            m_input = std::make_unique<InputStream>(m_fd);
+            return;
+        }
+        auto mapping = std::make_shared<Mapping const>(filename);
+        if(*mapping && is_dataset(mapping->data(), mapping->size()))
+        {
+            m_dataset = load_dataset(std::move(mapping));
+            m_binary = true;
+            return;
+        }
+        m_fd = open(filename, O_RDONLY);
+        if(m_fd < 0)
+        {
+            std::cerr << "Can't open '" << filename << "'\n";
+            throw std::runtime_error("");
+        }
+        m_input = std::make_unique<InputStream>(m_fd);
+    }
+
+    DataReader(DataReader const &) = delete;
+    DataReader & operator=(DataReader const &) = delete;
+
+    ~DataReader()
+    {
+        if(m_fd > 0)
+            close(m_fd);
+    }
+
+    // Reads up to rows rows into data, returns false at the end of input
+    bool read(Data & data, size_t rows)
+    {
+        data.clear();
+        if(m_binary)
+            slice(data, rows);
+        else
+            parse(data, rows);
+        return data.size() > 0;
+    }
+
+private:
+    void slice(Data & data, size_t rows)
+    {
+        size_t const begin = m_line;
+        size_t const end = std::min(m_dataset.size(), begin+rows);
+        data.dim = m_dataset.dim;
+        data.labels.assign(m_dataset.labels.begin()+begin, m_dataset.labels.begin()+end);
+        if(m_dataset.dense)
+        {
+            data.offsets.clear();
+            data.dense = m_dataset.dense + begin*m_dataset.dim;
+            data.mapping = m_dataset.mapping;
+        }
+        else
+        {
+            size_t const first = m_dataset.offsets[begin];
+            for(size_t i = begin; i < end; ++i)
+                data.offsets.push_back(m_dataset.offsets[i+1] - first);
+            data.indices.assign(m_dataset.indices.begin()+first, m_dataset.indices.begin()+m_dataset.offsets[end]);
+            data.values .assign(m_dataset.values .begin()+first, m_dataset.values .begin()+m_dataset.offsets[end]);
+        }
+        m_line = end;
+    }
+
+    void parse(Data & data, size_t rows)
+    {
+        // Find rows whole lines, the last line may lack the newline at the end of input
+        size_t lines = 0;
+        size_t scan = m_begin;
+        size_t cut = m_begin;
+        while(lines < rows)
+        {
+            char const * const p = std::find(m_buffer.data()+scan, m_buffer.data()+m_end, '\n');
+            scan = p - m_buffer.data();
+            if(scan < m_end)
+            {
+                ++lines;
+                cut = ++scan;
+            }
+            else if(m_eof || ((lines > 0) && m_drained) || !fill(scan, cut))
+            {
+                break;
+            }
+        }
+        if(m_eof && (lines < rows))
+            cut = m_end;
+        if(cut == m_begin)
+            return;
+
+        DataChunk chunk;
+        std::swap(chunk.data, data);
+        parse_chunk(m_buffer.data()+m_begin, m_buffer.data()+cut, chunk);
+        std::swap(chunk.data, data);
+        check_chunk(chunk, m_line);
+
+        m_line += chunk.lines;
+        m_begin = cut;
+    }
+
+    // Reads more input, scan and cut are moved along with the unread data
+    bool fill(size_t & scan, size_t & cut)
+    {
+        size_t const block = 1 << 20;
+        if(m_begin > 0)
+        {
+            std::copy(m_buffer.begin()+m_begin, m_buffer.begin()+m_end, m_buffer.begin());
+            scan -= m_begin;
+            cut -= m_begin;
+            m_end -= m_begin;
+            m_begin = 0;
+        }
+        if(m_buffer.size() < m_end + block)
+            m_buffer.resize(std::max(m_end + block, 2*m_buffer.size()));
+
+        size_t const wanted = m_buffer.size()-m_end;
+        size_t const count = m_input->read(m_buffer.data()+m_end, wanted);
+        m_end += count;
+        m_eof = (count == 0);
+        m_drained = (count < wanted);
+        return !m_eof;
+    }
+
+    int m_fd = 0;// stdin by default
+    std::unique_ptr<InputStream> m_input;
+    std::vector<char> m_buffer;
+    size_t m_begin = 0;
+    size_t m_end = 0;
+    bool m_eof = false;
+    bool m_drained = false;// last read returned less than asked
+    // rows consumed so far
+    size_t m_line = 0;
+
+    bool m_binary = false;
+    Data m_dataset;
+};
+
 #endif//LIBSVM_DATA_FILE_H_INCLUDED
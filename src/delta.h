@@ -0,0 +1,263 @@
+#ifndef INDEX_DELTA_H_INCLUDED
+#define INDEX_DELTA_H_INCLUDED
+
+#include "bundle.h"
+#include "data.h"
+#include "mapping.h"
+#include "reduce.h"
+#include "search.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+#include <sys/stat.h>
+
+// -- Index delta --
+//
+// Rows appended to and rows deleted from an index bundle since it was built,
+// "<index>.delta" next to the bundle, native endian :
+//  header     : DeltaHeader
+//  tombstones : bitmap of deleted rows over the bundle and the appended rows, uint64 words, at a multiple of 64 bytes
+//  dataset    : appended rows as a dense binary dataset (data.h), at a multiple of 64 bytes
+// Appended rows continue the row numbers of the bundle. The delta is valid for the bundle of the recorded
+// generation (bundle.h) and row count, folding it into a new bundle renumbers the rows.
+// Index files without a generation are identified by their size instead.
+
+char const delta_magic[8] = {'F','L','A','N','N','D','L','T'};
+
+struct DeltaHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t base_rows;// rows of the bundle
+    uint64_t base_id;// generation of the bundle, its size without one
+    uint64_t tombstones;// section offsets
+    uint64_t words;
+    uint64_t dataset;
+};
+
+inline std::string delta_path(char const * index)
+{
+    return std::string(index) + ".delta";
+}
+
+inline uint64_t file_size(char const * filename)
+{
+    struct stat info;
+    return (stat(filename, &info) == 0) ? info.st_size : 0;
+}
+
+// Identifies the version of an index file a delta is for
+inline uint64_t index_id(char const * index)
+{
+    uint64_t const generation = bundle_generation(index);
+    return (generation != 0) ? generation : file_size(index);
+}
+
+struct Delta
+{
+    uint64_t base_rows = 0;
+    unsigned dim = 0;
+    std::vector<double> labels;// appended rows
+    std::vector<float> values;// appended rows x dim
+    std::vector<uint64_t> tombstones;
+
+    size_t size() const { return labels.size(); }
+    size_t rows() const { return base_rows + size(); }
+    float const * row(size_t i) const { return &values[i*dim]; }
+
+    bool deleted(size_t id) const
+    {
+        return (id/64 < tombstones.size()) && ((tombstones[id/64] >> (id%64)) & 1);
+    }
+
+    size_t deleted_count() const
+    {
+        size_t count = 0;
+        for(auto word : tombstones)
+            count += __builtin_popcountll(word);
+        return count;
+    }
+
+    // Returns false for ids out of range
+    bool erase(size_t id)
+    {
+        if(id >= rows())
+            return false;
+        if(id/64 >= tombstones.size())
+            tombstones.resize(id/64 + 1, 0);
+        tombstones[id/64] |= uint64_t(1) << (id%64);
+        return true;
+    }
+
+    void append(Data const & data)
+    {
+        size_t const first = values.size();
+        values.resize(first + data.size()*dim);
+        for(size_t i = 0; i < data.size(); ++i)
+            densify(data, i, &values[first + i*dim], dim);
+        labels.insert(labels.end(), data.labels.begin(), data.labels.end());
+    }
+
+    // Appended rows as a matrix view
+    cv::Mat_<float> features() const
+    {
+        return cv::Mat_<float>(size(), dim, const_cast<float *>(values.data()));
+    }
+};
+
+// Training rows followed by the appended rows, deleted rows included
+cv::Mat_<float> with_delta(cv::Mat_<float> const & mat, Delta const & delta)
+{
+    cv::Mat_<float> result(mat.rows + delta.size(), mat.cols);
+    for(int i = 0; i < mat.rows; ++i)
+        std::copy(mat[i], mat[i] + mat.cols, result[i]);
+    if(delta.size() > 0)
+        std::copy(delta.values.begin(), delta.values.end(), result[mat.rows]);
+    return result;
+}
+
+// Returns false if the index has no delta or a stale one
+// - dim is the row length of the bundle
+// - a delta recorded for another version of the bundle is left by a fold that replaced the bundle, it is ignored
+bool load_delta(char const * index, uint64_t base_rows, unsigned dim, Delta & delta)
+{
+    std::string const path = delta_path(index);
+    auto mapping = std::make_shared<Mapping const>(path.c_str());
+    if(!*mapping)
+        return false;
+
+    DeltaHeader header{};
+    if(mapping->size() >= sizeof(header))
+        memcpy(&header, mapping->data(), sizeof(header));
+    if((memcmp(header.magic, delta_magic, sizeof(delta_magic)) != 0) || (header.version != 1)
+        || (header.dataset > mapping->size()) || (header.tombstones > header.dataset)
+        || (header.words > (header.dataset - header.tombstones)/sizeof(uint64_t)))
+    {
+        std::cerr << "Invalid index delta '" << path << "'\n";
+        throw std::runtime_error("");
+    }
+    if((header.base_rows != base_rows) || (header.base_id != index_id(index)))
+    {
+        std::cerr << "Index delta '" << path << "' is for another version of '" << index << "', ignored\n";
+        return false;
+    }
+
+    auto const words = reinterpret_cast<uint64_t const *>(mapping->data() + header.tombstones);
+    delta.base_rows = header.base_rows;
+    delta.tombstones.assign(words, words + header.words);
+    Data const data = load_dataset(mapping, header.dataset);
+    if(!data.dense || ((data.dim != dim) && (data.size() > 0)))
+    {
+        std::cerr << "Invalid index delta '" << path << "', appended rows aren't " << dim << " dense features\n";
+        throw std::runtime_error("");
+    }
+    delta.dim = dim;
+    delta.labels = data.labels;
+    delta.values.assign(data.dense, data.dense + data.size()*data.dim);
+    return true;
+}
+
+void save_delta(char const * index, Delta const & delta)
+{
+    std::string const path = delta_path(index);
+    std::ofstream file(path, std::ios::binary);
+
+    DeltaHeader header{};
+    memcpy(header.magic, delta_magic, sizeof(delta_magic));
+    header.version = 1;
+    header.base_rows = delta.base_rows;
+    header.base_id = index_id(index);
+    header.tombstones = dataset_align(sizeof(header));
+    header.words = delta.tombstones.size();
+    header.dataset = dataset_align(header.tombstones + header.words*sizeof(uint64_t));
+
+    static char const zeros[64] = {};
+    file.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    file.write(zeros, header.tombstones - sizeof(header));
+    file.write(reinterpret_cast<char const *>(delta.tombstones.data()), header.words*sizeof(uint64_t));
+    file.write(zeros, header.dataset - header.tombstones - header.words*sizeof(uint64_t));
+
+    Data data;
+    data.labels = delta.labels;
+    data.offsets.clear();
+    data.dim = delta.dim;
+    data.dense = delta.values.data();
+    write_dataset(file, data, false);
+    if(!file.flush())
+    {
+        std::cerr << "Can't write '" << path << "'\n";
+        throw std::runtime_error("");
+    }
+}
+
+// Searches the index and the appended rows exhaustively, deleted rows are skipped
+// - the index is asked for extra neighbors to make up for deleted rows, up to 3 x n
+class DeltaEngine : public Engine
+{
+public:
+    DeltaEngine(Engine & inner, Delta const & delta, int distance)
+        : m_inner(inner)
+        , m_delta(delta)
+        , m_distance(distance)
+        , m_deleted(delta.deleted_count())
+    {
+        if(!rerank_supported(distance))
+        {
+            std::cerr << "Index deltas support distances 1, 2 and 4 only\n";
+            throw std::runtime_error("");
+        }
+    }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        Query inner = query;
+        inner.n = query.n + int(std::min<size_t>(m_deleted, 3*query.n));
+        cv::Mat_<int> found(queries.rows, inner.n);
+        cv::Mat_<float> found_dists(queries.rows, inner.n);
+        m_inner.search(queries, found, found_dists, inner);
+
+        std::vector<std::pair<float, int>> merged;
+        for(int i = 0; i < queries.rows; ++i)
+        {
+            merged.clear();
+            for(int j = 0; j < inner.n; ++j)
+                if((found(i, j) >= 0) && !m_delta.deleted(found(i, j)))
+                    merged.emplace_back(found_dists(i, j), found(i, j));
+            for(size_t r = 0; r < m_delta.size(); ++r)
+            {
+                size_t const id = m_delta.base_rows + r;
+                float d;
+                full_distance(m_distance, queries[i], m_delta.row(r), m_delta.dim, d);
+                if(!m_delta.deleted(id) && ((query.radius < 0) || (d <= query.radius)))
+                    merged.emplace_back(d, id);
+            }
+            size_t const count = std::min<size_t>(merged.size(), query.n);
+            std::partial_sort(merged.begin(), merged.begin()+count, merged.end());
+            for(int j = 0; j < query.n; ++j)
+            {
+                indices(i, j) = (size_t(j) < count) ? merged[j].second : -1;
+                dists(i, j) = (size_t(j) < count) ? merged[j].first : 0.0f;
+            }
+        }
+    }
+
+private:
+    Engine & m_inner;
+    Delta const & m_delta;
+    int const m_distance;
+    size_t const m_deleted;
+};
+
+#endif//INDEX_DELTA_H_INCLUDED
@@ -0,0 +1,389 @@
+#ifndef EXACT_SEARCH_H_INCLUDED
+#define EXACT_SEARCH_H_INCLUDED
+
+#include "reduce.h"
+#include "search.h"
+
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EXACT_SEARCH_X86
+#endif
+
+// -- Exact search --
+//
+// Blocked brute force for L2 and cosine distance : a block of queries is multiplied with tiles of training
+// rows that stay in cache, distances follow from the dot products and the row norms,
+// |q-x|^2 = |q|^2 + |x|^2 - 2 q.x, and cosine distance is 1 - q.x of normalized rows.
+// The dot product kernel is picked at runtime, AVX-512, AVX2 with FMA or plain C++.
+// The expansion loses precision with the norms, not with the distance, L2 keeps every row whose distance
+// is within the rounding error bound of the n nearest and recomputes their distances directly, the
+// results and distances match a linear index.
+
+int const cosine_distance = 10;
+
+inline bool exact_supported(int distance)
+{
+    return (distance == cvflann::FLANN_DIST_L2) || (distance == cosine_distance);
+}
+
+// out[i*count + j] = queries row i . rows row j, for q queries and count rows of stride floats
+// - stride is a multiple of 16, the padding is zero
+using DotKernel = void (*)(float const * queries, size_t q, float const * rows, size_t count, size_t stride, float * out);
+
+void dots_generic(float const * queries, size_t q, float const * rows, size_t count, size_t stride, float * out)
+{
+    for(size_t i = 0; i < q; ++i)
+    {
+        float const * a = queries + i*stride;
+        for(size_t j = 0; j < count; ++j)
+        {
+            float const * b = rows + j*stride;
+            float sum[4] = {0, 0, 0, 0};
+            for(size_t k = 0; k < stride; k += 4)
+                for(size_t l = 0; l < 4; ++l)
+                    sum[l] += a[k+l]*b[k+l];
+            out[i*count + j] = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+        }
+    }
+}
+
+#ifdef EXACT_SEARCH_X86
+
+__attribute__((target("avx2,fma")))
+inline float hsum_avx2(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+// 4 queries x 2 rows at a time, 8 independent accumulators
+__attribute__((target("avx2,fma")))
+void dots_avx2(float const * queries, size_t q, float const * rows, size_t count, size_t stride, float * out)
+{
+    size_t i = 0;
+    for(; i + 4 <= q; i += 4)
+    {
+        float const * const q0 = queries + i*stride;
+        float const * const q1 = q0 + stride;
+        float const * const q2 = q1 + stride;
+        float const * const q3 = q2 + stride;
+        for(size_t j = 0; j < count; j += 2)
+        {
+            // an odd last row is computed twice
+            float const * const x0 = rows + j*stride;
+            float const * const x1 = (j+1 < count) ? x0 + stride : x0;
+            __m256 a00 = _mm256_setzero_ps(), a01 = _mm256_setzero_ps();
+            __m256 a10 = _mm256_setzero_ps(), a11 = _mm256_setzero_ps();
+            __m256 a20 = _mm256_setzero_ps(), a21 = _mm256_setzero_ps();
+            __m256 a30 = _mm256_setzero_ps(), a31 = _mm256_setzero_ps();
+            for(size_t k = 0; k < stride; k += 8)
+            {
+                __m256 const v0 = _mm256_loadu_ps(x0+k);
+                __m256 const v1 = _mm256_loadu_ps(x1+k);
+                __m256 const w0 = _mm256_loadu_ps(q0+k);
+                __m256 const w1 = _mm256_loadu_ps(q1+k);
+                __m256 const w2 = _mm256_loadu_ps(q2+k);
+                __m256 const w3 = _mm256_loadu_ps(q3+k);
+                a00 = _mm256_fmadd_ps(w0, v0, a00); a01 = _mm256_fmadd_ps(w0, v1, a01);
+                a10 = _mm256_fmadd_ps(w1, v0, a10); a11 = _mm256_fmadd_ps(w1, v1, a11);
+                a20 = _mm256_fmadd_ps(w2, v0, a20); a21 = _mm256_fmadd_ps(w2, v1, a21);
+                a30 = _mm256_fmadd_ps(w3, v0, a30); a31 = _mm256_fmadd_ps(w3, v1, a31);
+            }
+            float * const o = out + i*count + j;
+            o[0] = hsum_avx2(a00);
+            o[count] = hsum_avx2(a10);
+            o[2*count] = hsum_avx2(a20);
+            o[3*count] = hsum_avx2(a30);
+            if(j+1 < count)
+            {
+                o[1] = hsum_avx2(a01);
+                o[count+1] = hsum_avx2(a11);
+                o[2*count+1] = hsum_avx2(a21);
+                o[3*count+1] = hsum_avx2(a31);
+            }
+        }
+    }
+    for(; i < q; ++i)
+    {
+        float const * const a = queries + i*stride;
+        for(size_t j = 0; j < count; ++j)
+        {
+            float const * const b = rows + j*stride;
+            __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+            for(size_t k = 0; k < stride; k += 16)
+            {
+                s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a+k), _mm256_loadu_ps(b+k), s0);
+                s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a+k+8), _mm256_loadu_ps(b+k+8), s1);
+            }
+            out[i*count + j] = hsum_avx2(_mm256_add_ps(s0, s1));
+        }
+    }
+}
+
+// Same blocking as AVX2 with 16 floats per register
+__attribute__((target("avx512f")))
+void dots_avx512(float const * queries, size_t q, float const * rows, size_t count, size_t stride, float * out)
+{
+    size_t i = 0;
+    for(; i + 4 <= q; i += 4)
+    {
+        float const * const q0 = queries + i*stride;
+        float const * const q1 = q0 + stride;
+        float const * const q2 = q1 + stride;
+        float const * const q3 = q2 + stride;
+        for(size_t j = 0; j < count; j += 2)
+        {
+            float const * const x0 = rows + j*stride;
+            float const * const x1 = (j+1 < count) ? x0 + stride : x0;
+            __m512 a00 = _mm512_setzero_ps(), a01 = _mm512_setzero_ps();
+            __m512 a10 = _mm512_setzero_ps(), a11 = _mm512_setzero_ps();
+            __m512 a20 = _mm512_setzero_ps(), a21 = _mm512_setzero_ps();
+            __m512 a30 = _mm512_setzero_ps(), a31 = _mm512_setzero_ps();
+            for(size_t k = 0; k < stride; k += 16)
+            {
+                __m512 const v0 = _mm512_loadu_ps(x0+k);
+                __m512 const v1 = _mm512_loadu_ps(x1+k);
+                __m512 const w0 = _mm512_loadu_ps(q0+k);
+                __m512 const w1 = _mm512_loadu_ps(q1+k);
+                __m512 const w2 = _mm512_loadu_ps(q2+k);
+                __m512 const w3 = _mm512_loadu_ps(q3+k);
+                a00 = _mm512_fmadd_ps(w0, v0, a00); a01 = _mm512_fmadd_ps(w0, v1, a01);
+                a10 = _mm512_fmadd_ps(w1, v0, a10); a11 = _mm512_fmadd_ps(w1, v1, a11);
+                a20 = _mm512_fmadd_ps(w2, v0, a20); a21 = _mm512_fmadd_ps(w2, v1, a21);
+                a30 = _mm512_fmadd_ps(w3, v0, a30); a31 = _mm512_fmadd_ps(w3, v1, a31);
+            }
+            float * const o = out + i*count + j;
+            o[0] = _mm512_reduce_add_ps(a00);
+            o[count] = _mm512_reduce_add_ps(a10);
+            o[2*count] = _mm512_reduce_add_ps(a20);
+            o[3*count] = _mm512_reduce_add_ps(a30);
+            if(j+1 < count)
+            {
+                o[1] = _mm512_reduce_add_ps(a01);
+                o[count+1] = _mm512_reduce_add_ps(a11);
+                o[2*count+1] = _mm512_reduce_add_ps(a21);
+                o[3*count+1] = _mm512_reduce_add_ps(a31);
+            }
+        }
+    }
+    for(; i < q; ++i)
+    {
+        float const * const a = queries + i*stride;
+        for(size_t j = 0; j < count; ++j)
+        {
+            float const * const b = rows + j*stride;
+            __m512 s = _mm512_setzero_ps();
+            for(size_t k = 0; k < stride; k += 16)
+                s = _mm512_fmadd_ps(_mm512_loadu_ps(a+k), _mm512_loadu_ps(b+k), s);
+            out[i*count + j] = _mm512_reduce_add_ps(s);
+        }
+    }
+}
+
+#endif//EXACT_SEARCH_X86
+
+// Fastest kernel the CPU supports, name is set to its instruction set
+inline DotKernel dot_kernel(char const ** name = nullptr)
+{
+    char const * isa = "generic";
+    DotKernel kernel = dots_generic;
+#ifdef EXACT_SEARCH_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f"))
+    {
+        isa = "avx512";
+        kernel = dots_avx512;
+    }
+    else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        isa = "avx2";
+        kernel = dots_avx2;
+    }
+#endif
+    if(name)
+        *name = isa;
+    return kernel;
+}
+
+// Exact search of L2 (squared, as flann reports it) or cosine distance (1 - cosine similarity)
+// - the rows are copied padded to a multiple of 16 floats, normalized for cosine,
+//   L2 rows already padded are used in place
+class ExactEngine : public Engine
+{
+public:
+    ExactEngine(cv::Mat_<float> const & train, int distance)
+        : m_distance(distance)
+        , m_rows(train.rows)
+        , m_dim(train.cols)
+        , m_stride((train.cols + 15)/16*16)
+        , m_kernel(dot_kernel(&m_isa))
+    {
+        bool const cosine = (distance == cosine_distance);
+        if(!cosine && (m_stride == m_dim) && train.isContinuous())
+        {
+            m_data = train.empty() ? nullptr : train[0];
+        }
+        else
+        {
+            m_padded.assign(m_rows*m_stride, 0.0f);
+            for(size_t i = 0; i < m_rows; ++i)
+                std::copy(train[i], train[i] + m_dim, &m_padded[i*m_stride]);
+            m_data = m_padded.data();
+        }
+        m_norms.resize(m_rows);
+        for(size_t i = 0; i < m_rows; ++i)
+        {
+            float * const row = const_cast<float *>(m_data) + i*m_stride;
+            float norm = 0;
+            for(size_t k = 0; k < m_dim; ++k)
+                norm += row[k]*row[k];
+            m_norms[i] = norm;
+            if(cosine && (norm > 0))
+            {
+                float const scale = 1/std::sqrt(norm);
+                for(size_t k = 0; k < m_dim; ++k)
+                    row[k] *= scale;
+            }
+        }
+        // a tile of rows fills about 256KB of cache
+        m_tile = std::max<size_t>(16, (size_t(256) << 10)/(m_stride*sizeof(float)));
+        // the norms and the dot product each round off up to about dim ulps of |q|^2 + |x|^2
+        if(!cosine)
+            m_error = (2*m_dim + 4)*FLT_EPSILON;
+    }
+
+    // Instruction set of the dot product kernel
+    char const * kernel() const { return m_isa; }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        size_t const block = 64;
+        bool const cosine = (m_distance == cosine_distance);
+        size_t const n = query.n;
+        float const bound = (query.radius >= 0) ? query.radius : std::numeric_limits<float>::infinity();
+
+        std::vector<float> q(block*m_stride, 0.0f);
+        std::vector<float> q_norms(block);
+        std::vector<float> dots(block*m_tile);
+        // candidates as (lowest possible distance, row) and a max heap of the n lowest highest possible distances
+        std::vector<std::vector<std::pair<float, int>>> heaps(block);
+        std::vector<std::vector<float>> uppers(block);
+        std::vector<size_t> prune_at(block);
+        for(int first = 0; first < queries.rows; first += block)
+        {
+            size_t const count = std::min<size_t>(block, queries.rows - first);
+            for(size_t i = 0; i < count; ++i)
+            {
+                float const * const row = queries[first+i];
+                float * const padded = &q[i*m_stride];
+                std::copy(row, row + m_dim, padded);
+                float norm = 0;
+                for(size_t k = 0; k < m_dim; ++k)
+                    norm += row[k]*row[k];
+                q_norms[i] = norm;
+                if(cosine && (norm > 0))
+                {
+                    float const scale = 1/std::sqrt(norm);
+                    for(size_t k = 0; k < m_dim; ++k)
+                        padded[k] *= scale;
+                }
+                heaps[i].clear();
+                uppers[i].clear();
+                prune_at[i] = 2*n + 256;
+            }
+
+            for(size_t tile = 0; tile < m_rows; tile += m_tile)
+            {
+                size_t const rows = std::min(m_tile, m_rows - tile);
+                m_kernel(q.data(), count, m_data + tile*m_stride, rows, m_stride, dots.data());
+                for(size_t i = 0; i < count; ++i)
+                {
+                    auto & heap = heaps[i];
+                    auto & upper = uppers[i];
+                    float const * const d = &dots[i*rows];
+                    // a row can be one of the n nearest while its lowest possible distance is below the n-th
+                    // lowest highest possible distance
+                    float limit = (upper.size() == n) ? std::min(bound, upper.front()) : bound;
+                    for(size_t j = 0; j < rows; ++j)
+                    {
+                        float const dist = cosine ? 1 - d[j] : std::max(0.0f, q_norms[i] + m_norms[tile+j] - 2*d[j]);
+                        float const error = m_error*(q_norms[i] + m_norms[tile+j]);
+                        if(dist - error > limit)
+                            continue;
+                        heap.emplace_back(dist - error, int(tile+j));
+                        upper.push_back(dist + error);
+                        std::push_heap(upper.begin(), upper.end());
+                        if(upper.size() > n)
+                        {
+                            std::pop_heap(upper.begin(), upper.end());
+                            upper.pop_back();
+                        }
+                        if(upper.size() == n)
+                            limit = std::min(bound, upper.front());
+                        if(heap.size() >= prune_at[i])
+                        {
+                            prune(heap, limit);
+                            prune_at[i] = std::max(prune_at[i], 2*heap.size());
+                        }
+                    }
+                }
+            }
+
+            for(size_t i = 0; i < count; ++i)
+            {
+                auto & heap = heaps[i];
+                prune(heap, (uppers[i].size() == n) ? std::min(bound, uppers[i].front()) : bound);
+                if(!cosine)
+                {
+                    // direct distances, the candidates beyond the radius are dropped
+                    for(auto & candidate : heap)
+                        full_distance(m_distance, queries[first+i], m_data + size_t(candidate.second)*m_stride, m_dim, candidate.first);
+                    heap.erase(std::remove_if(heap.begin(), heap.end(),
+                        [bound](std::pair<float, int> const & c) { return c.first > bound; }), heap.end());
+                }
+                size_t const found = std::min(heap.size(), n);
+                std::partial_sort(heap.begin(), heap.begin()+found, heap.end());
+                for(int j = 0; j < query.n; ++j)
+                {
+                    indices(first+i, j) = (size_t(j) < found) ? heap[j].second : -1;
+                    dists(first+i, j) = (size_t(j) < found) ? heap[j].first : 0.0f;
+                }
+            }
+        }
+    }
+
+private:
+    // Drops the candidates that can't be closer than limit
+    static void prune(std::vector<std::pair<float, int>> & heap, float limit)
+    {
+        heap.erase(std::remove_if(heap.begin(), heap.end(),
+            [limit](std::pair<float, int> const & c) { return c.first > limit; }), heap.end());
+    }
+
+    int const m_distance;
+    size_t const m_rows;
+    size_t const m_dim;
+    size_t const m_stride;
+    char const * m_isa = nullptr;
+    DotKernel const m_kernel;
+    size_t m_tile = 0;
+    float const * m_data = nullptr;
+    std::vector<float> m_padded;
+    std::vector<float> m_norms;// squared, before normalization
+    float m_error = 0;// rounding error of an expanded L2 distance per unit of |q|^2 + |x|^2
+};
+
+#endif//EXACT_SEARCH_H_INCLUDED
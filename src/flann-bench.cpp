@@ -0,0 +1,210 @@
+#include "bench.h"
+#include "binary.h"
+#include "data.h"
+#include "groundtruth.h"
+#include "matrix.h"
+#include "params.h"
+#include "search.h"
+
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <argtable2.h>
+#include <opencv2/flann/flann.hpp>
+
+int main(int argc, char * argv[])
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct arg_file * train_file = arg_file1("f", "features", "<filename>", "Training dataset");
+    struct arg_file * input = arg_file1("i", "input", "<filename>", "Query dataset");
+    struct arg_int  * distance = arg_int0("d", "distance", "{1..9}", "Distance metric"
+            "\n\t1=L2 (default), 2=L1, 3=MINKOWSKI,\n\t4=MAX, 5=HIST_INTERSECT, 6=HELLLINGER,"
+            "\n\t7=CS, 8=KULLBACK_LEIBLER, 9=HAMMING");
+    struct arg_str * configs = arg_strn(NULL, "config", "<t=..,..>", 0, 64, "Index configuration, repeatable (default t=1, t=2 and t=3)"
+            "\n\tt=index type, then flann-train index options without the kd-/km-/lsh-/auto- prefix,"
+            "\n\te.g. t=1,tree-count=8 or t=2,branching=64,iterations=5");
+    struct arg_int * neighbors = arg_int0("n", "neighbors", "n", "Neighbor count, recall@n (default 10)");
+    struct arg_str * checks = arg_str0("c", "checks", "c,..", "Search checks to sweep (default 16,32,64,128,256)");
+    struct arg_int * max_queries = arg_int0(NULL, "max-queries", "n", "Use only the first n queries");
+    struct arg_int * threads_arg = arg_int0(NULL, "threads", "{0..}", "Worker threads for loading and search (default 0 = all cores)");
+    struct arg_file * truth_file = arg_file0(NULL, "ground-truth", "<filename>", "Exact neighbor cache, computed if it doesn't match");
+    struct arg_file * csv = arg_file0(NULL, "csv", "<filename>", "Write the results as CSV");
+    struct arg_file * json = arg_file0(NULL, "json", "<filename>", "Write the results as JSON");
+    struct arg_lit * help = arg_lit0("h", "help", "Print this help and exit");
+    struct arg_end * end = arg_end(20);
+    void * argtable[] = {
+       train_file, input, distance, configs, neighbors, checks, max_queries, threads_arg,
+       truth_file, csv, json, help, end };
+    if(arg_nullcheck(argtable) != 0)
+    {
+        fprintf(stderr, "%s: insufficient memory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    distance->ival[0] = 1;
+    neighbors->ival[0] = 10;
+    checks->sval[0] = "16,32,64,128,256";
+    threads_arg->ival[0] = 0;
+    int arg_errors = arg_parse(argc, argv, argtable);
+    if(help->count > 0)
+    {
+        printf("Usage: %s", argv[0]);
+        arg_print_syntax(stdout, argtable, "\n");
+        arg_print_glossary(stdout, argtable,"  %-25s %s\n");
+        return EXIT_SUCCESS;
+    }
+    if(arg_errors > 0)
+    {
+        arg_print_errors(stderr, end, argv[0]);
+        fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<int> check_list;
+    if(!parse_list(checks->sval[0], check_list))
+    {
+        fprintf(stderr, "Invalid checks '%s'\n", checks->sval[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<IndexConfig> config_list;
+    for(int i = 0; i < configs->count; ++i)
+    {
+        IndexConfig config;
+        if(!parse_config(configs->sval[i], config) || !make_params(config))
+            return EXIT_FAILURE;
+        config_list.push_back(config);
+    }
+    if(config_list.empty())
+    {
+        for(int type : {1, 2, 3})
+        {
+            IndexConfig config;
+            config.type = type;
+            config_list.push_back(config);
+        }
+    }
+
+    unsigned const threads = thread_count(threads_arg->ival[0]);
+    int const n = neighbors->ival[0];
+    auto const dist_type = static_cast<cvflann::flann_distance_t>(distance->ival[0]);
+
+    // -- Data --
+
+    std::cout << "Loading training data ..." << std::flush;
+
+    auto train = load(train_file->filename[0], threads);
+
+    cv::Mat_<float> mat = dense(train);
+    train.release_features();
+    // Hamming distance indexes the packed rows
+    cv::Mat const packed = is_binary(dist_type) ? pack_bits(mat) : cv::Mat();
+
+    std::cout << " OK\n"
+        "\tdata : " << train.size() << 'x' << train.dim << "\n"
+        "Loading queries ..." << std::flush;
+
+    auto test = load(input->filename[0], threads);
+    size_t const rows = (max_queries->count > 0) ? std::min<size_t>(test.size(), max_queries->ival[0]) : test.size();
+    cv::Mat_<float> queries(rows, mat.cols);
+    for(size_t i = 0; i < rows; ++i)
+        densify(test, i, queries[i], mat.cols);
+    test.clear();
+
+    std::cout << " OK\n"
+        "\tdata : " << rows << " queries\n"
+        "Exact neighbors ..." << std::flush;
+
+    cv::Mat_<int> exact;
+    {
+        GroundTruth truth((truth_file->count > 0) ? truth_file->filename[0] : nullptr, mat, n, distance->ival[0], threads);
+        truth.expect(queries);
+        truth.add(queries, cv::Mat_<int>());
+        truth.finish();
+        exact = truth.exact();
+        if(truth.cached())
+            std::cout << " cached";
+    }
+
+    std::cout << " OK\n";
+
+    // -- Sweep --
+
+    std::vector<BenchRow> results;
+    cv::Mat_<int> indices;
+    cv::Mat_<float> dists;
+    std::vector<double> latencies;
+    for(auto const & config : config_list)
+    {
+        std::string const name = to_string(config);
+        std::cout << "Building " << name << " ..." << std::flush;
+
+        auto const params = make_params(config);
+        auto const begin = Clock::now();
+        cv::flann::Index index(is_binary(dist_type) ? packed : mat, *params, dist_type);
+        double const build_seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+        uint64_t const bytes = index_bytes(index);
+
+        std::cout << " OK (" << build_seconds << " s, " << bytes << " bytes)\n";
+
+        FlannEngine flann_engine(index);
+        BinaryEngine binary_engine(index);
+        Engine & engine = is_binary(dist_type) ? static_cast<Engine &>(binary_engine) : flann_engine;
+        for(int c : check_list)
+        {
+            double const seconds = timed_search(engine, queries, indices, dists, Query{n, -1.0, c}, threads, latencies);
+
+            BenchRow row;
+            row.config = name;
+            row.checks = c;
+            row.build_seconds = build_seconds;
+            row.index_bytes = bytes;
+            row.recall = recall(indices, exact, rows);
+            row.qps = (seconds > 0) ? rows/seconds : 0;
+            row.p50 = percentile(latencies, 0.5);
+            row.p99 = percentile(latencies, 0.99);
+            results.push_back(row);
+
+            std::cout << "\tchecks " << c << " : recall@" << n << ' ' << row.recall << ", " << row.qps << " qps"
+                ", p50 " << (row.p50*1e6) << " us, p99 " << (row.p99*1e6) << " us\n";
+        }
+    }
+
+    mark_pareto(results);
+
+    std::cout << "Pareto front :\n";
+    for(auto const & row : results)
+        if(row.pareto)
+            std::cout << '\t' << row.config << " checks " << row.checks << " : recall@" << n << ' ' << row.recall << ", " << row.qps << " qps\n";
+
+    if(csv->count > 0)
+    {
+        std::ofstream file(csv->filename[0]);
+        write_csv(file, results);
+        if(!file)
+        {
+            fprintf(stderr, "Can't write '%s'\n", csv->filename[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if(json->count > 0)
+    {
+        std::ofstream file(json->filename[0]);
+        write_json(file, results);
+        if(!file)
+        {
+            fprintf(stderr, "Can't write '%s'\n", json->filename[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
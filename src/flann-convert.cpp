@@ -0,0 +1,51 @@
+#include "data.h"
+
+#include <cstdlib>
+
+#include <iostream>
+
+#include <argtable2.h>
+
+int main(int argc, char * argv[])
+{
+    struct arg_lit  * help   = arg_lit0 ("h", "help", "Print this help and exit");
+    struct arg_file * input  = arg_file0("i", "input", "<filename>", "Input dataset in libsvm format (default stdin)");
+    struct arg_file * output = arg_file1("o", "output", "<filename>", "Output binary dataset");
+    struct arg_lit  * sparse = arg_lit0 ("s", "sparse", "Store sparse rows instead of a dense matrix");
+    struct arg_end  * end = arg_end(20);
+    void * argtable[] = { help, input, output, sparse, end };
+    if(arg_nullcheck(argtable) != 0)
+    {
+        fprintf(stderr, "%s: insufficient memory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    input->filename[0] = nullptr;
+    int arg_errors = arg_parse(argc, argv, argtable);
+    if(help->count > 0)
+    {
+        printf("Usage: %s", argv[0]);
+        arg_print_syntax(stdout, argtable, "\n");
+        arg_print_glossary(stdout, argtable,"  %-25s %s\n");
+        return EXIT_SUCCESS;
+    }
+    if(arg_errors > 0)
+    {
+        arg_print_errors(stderr, end, argv[0]);
+        fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Loading data ..." << std::flush;
+
+    auto data = load(input->filename[0]);
+
+    std::cout << " OK\n"
+        "\tdata : " << data.size() << 'x' << data.dim << "\n"
+        "Saving '" << output->filename[0] << "' ..." << std::flush;
+
+    save_dataset(data, output->filename[0], sparse->count > 0);
+
+    std::cout << " OK\n";
+
+    return EXIT_SUCCESS;
+}
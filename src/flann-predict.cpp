@@ -1,8 +1,24 @@
+#include "binary.h"
+#include "bundle.h"
+#include "cache.h"
 #include "data.h"
+#include "delta.h"
+#include "exact.h"
+#include "flat.h"
+#include "groundtruth.h"
+#include "matrix.h"
+#include "metrics.h"
+#include "params.h"
+#include "pipeline.h"
+#include "reduce.h"
+#include "search.h"
+#include "shards.h"
+#include "statistics.h"
+#include "writer.h"
 
 #include <cstdlib>
 
-#include <fstream>
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -15,29 +31,37 @@
 
 int main(int argc, char * argv[])
 {
-    struct arg_file * train_file = arg_file1("f", "features", "<filename>", "Training dataset");
-    struct arg_file * index_file = arg_file1("x", "index", "<filename>", "Training dataset index");
+    struct arg_file * train_file = arg_file0("f", "features", "<filename>", "Training dataset (default from the index bundle)");
+    struct arg_file * index_file = arg_file1("x", "index", "<filename>", "Training dataset index, bundle or shard manifest");
     struct arg_file * input = arg_file1("i", "input", "<filename>", "Input dataset in libsvm format");
     struct arg_file * output = arg_file1("o", "output", "<filename>", "Output index file");
     struct arg_int  * distance = arg_int0("d", "distance", "{1..9}", "Distance metric"
             "\n\t1=L2 (default), 2=L1, 3=MINKOWSKI,\n\t4=MAX, 5=HIST_INTERSECT, 6=HELLLINGER,"
             "\n\t7=CS, 8=KULLBACK_LEIBLER, 9=HAMMING");
-    struct arg_int * neighbors = arg_int0("n", "neighbors", "n", "Neighbor count (default 1)");
+    struct arg_str * neighbors = arg_str0("n", "neighbors", "n,..", "Neighbor counts, one statistics table each (default 1)");
     struct arg_dbl * radius = arg_dbl0("r", "radius", "r", "Search radius, requests radius search");
-    struct arg_int * checks = arg_int0("c", "checks", "...", "Search checks (default 32)");
+    struct arg_str * checks = arg_str0("c", "checks", "c,..", "Search checks, one search each (default 32 or the tuned checks of the bundle)");
+    struct arg_int * threads_arg = arg_int0(NULL, "threads", "{0..}", "Worker threads for loading and search (default 0 = all cores)");
+    struct arg_file * truth_file = arg_file0(NULL, "ground-truth", "<filename>", "Exact neighbor cache for recall@n, computed and saved if it doesn't match");
+    struct arg_lit * stream = arg_lit0(NULL, "stream", "Stream the input, parse, search and output overlap in bounded memory");
+    struct arg_int * batch_arg = arg_int0(NULL, "batch", "{1..}", "Queries per search batch (default fits 64MB)");
+    struct arg_int * cache_arg = arg_int0(NULL, "cache", "MB", "Cache search results of repeated queries in MB, 0 only collapses duplicates");
     struct arg_lit * help = arg_lit0("h", "help", "Print this help and exit");
+    struct arg_int * rerank = arg_int0(NULL, "rerank", "m", "Candidates reranked at full precision for reduced indexes (default 4 x n, 0 = off)");
+    struct arg_file * metrics_file = arg_file0(NULL, "metrics", "<filename>", "Write phase timings, memory, I/O and query latencies as JSON");
     struct arg_end * end = arg_end(20);
     void * argtable[] = {
-       train_file, index_file, input, output, distance, neighbors, radius, checks,
-       help, end };
+       train_file, index_file, input, output, distance, neighbors, radius, checks, threads_arg,
+       truth_file, stream, batch_arg, cache_arg, rerank, metrics_file, help, end };
     if(arg_nullcheck(argtable) != 0)
     {
         fprintf(stderr, "%s: insufficient memory\n", argv[0]);
         return EXIT_FAILURE;
     }
     distance->ival[0] = 1;
-    neighbors->ival[0] = 1;
-    checks->ival[0] = 32;
+    neighbors->sval[0] = "1";
+    checks->sval[0] = "32";
+    threads_arg->ival[0] = 0;
     int arg_errors = arg_parse(argc, argv, argtable);
     if(help->count > 0)
     {
@@ -53,117 +77,320 @@ int main(int argc, char * argv[])
         return EXIT_FAILURE;
     }
 
+    // every check level is searched once at the largest neighbor count
+    std::vector<int> neighbor_list, check_list;
+    if(!parse_list(neighbors->sval[0], neighbor_list))
+    {
+        fprintf(stderr, "Invalid neighbor counts '%s'\n", neighbors->sval[0]);
+        return EXIT_FAILURE;
+    }
+    if(!parse_list(checks->sval[0], check_list))
+    {
+        fprintf(stderr, "Invalid checks '%s'\n", checks->sval[0]);
+        return EXIT_FAILURE;
+    }
+    if((batch_arg->count > 0) && (batch_arg->ival[0] < 1))
+    {
+        fprintf(stderr, "Invalid batch %d\n", batch_arg->ival[0]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned const threads = thread_count(threads_arg->ival[0]);
+
+    Metrics metrics("flann-predict");
+    LatencyHistogram * const latencies = (metrics_file->count > 0) ? &metrics.latencies : nullptr;
+
     std::cout << "Loading training data ..." << std::flush;
+    metrics.phase("load");
+
+    // shards are loaded with their indexes, the rows are only copied together for exact neighbors
+    bool const sharded = is_manifest(index_file->filename[0]);
+    ShardSet shards;
+    Data train;
+    std::string params_text;
+    Reduction reduction;
+    Delta delta;
+    bool has_delta = false;
+    cv::Mat_<float> mat;
+    if(sharded)
+    {
+        shards.load(index_file->filename[0], threads);
+        train = shards.train();
+        params_text = shards.params();
+        if(truth_file->count > 0)
+            mat = shards.features();
+    }
+    else
+    {
+        train = load_train((train_file->count > 0) ? train_file->filename[0] : nullptr, index_file->filename[0], threads, &params_text);
 
-    auto train = load(train_file->filename[0]);
+        metrics.phase("dense");
 
-    cv::Mat_<float> mat = cv::Mat_<float>::zeros(train.data.size(), train.dim);
+        mat = index_features(train, index_file->filename[0], reduction, threads);
+        train.release_features();
+
+        // appended rows continue the row numbers
+        has_delta = load_delta(index_file->filename[0], train.size(), train.dim, delta);
+        if(has_delta)
+            train.labels.insert(train.labels.end(), delta.labels.begin(), delta.labels.end());
+    }
+    // queries are searched at full precision, exact neighbors include the appended rows
+    cv::Mat_<float> const full = (has_delta && (truth_file->count > 0)) ? with_delta(reduction ? reduction.full : mat, delta)
+        : reduction ? reduction.full : mat;
+    int const cols = sharded ? shards.dim() : full.cols;
 
     boost::dynamic_bitset<> train_class_set;
-    for(size_t i = 0; i < train.data.size(); ++i)
+    for(size_t i = 0; i < train.size(); ++i)
     {
-        size_t const c = train.data[i].first;
+        size_t const c = train.labels[i];
         if(c >= train_class_set.size())
             train_class_set.resize(c+1);
         train_class_set.set(c);
-        for(auto p : train.data[i].second)
-            mat(i, p.first-1) = p.second;
     }
 
     std::cout << " OK\n"
-        "\tdata : " << train.data.size() << 'x' << train.dim << ", " << train_class_set.count() << " classes\n"
-        "Loading model ..." << std::flush;
+        "\tdata : " << train.size() << 'x' << train.dim << ", " << train_class_set.count() << " classes\n";
+    if(sharded)
+        std::cout << "\tshards : " << shards.size() << '\n';
+    if(has_delta)
+        std::cout << "\tdelta : " << delta.size() << " appended, " << delta.deleted_count() << " deleted\n";
+    if(reduction)
+        std::cout << "\treduced : " << full.cols << " -> " << mat.cols << '\n';
+    std::cout << "Loading model ..." << std::flush;
+
+    metrics.phase("load_index");
 
+    // binary indexes are over the packed rows
+    bool const binary = !sharded && is_binary(index_distance(index_file->filename[0], distance->ival[0]));
+    cv::Mat const packed = binary ? pack_bits(mat) : cv::Mat();
+    // flat indexes are mapped and searched in place
+    bool const flat = !sharded && is_flat_index(index_file->filename[0]);
+    FlatIndex flat_index;
     cv::flann::Index index;
-    if(!index.load(mat, index_file->filename[0]))
+    if(flat)
+        flat_index = FlatIndex::load(index_file->filename[0]);
+    else if(!sharded && !index.load(binary ? packed : mat, index_file->filename[0]))
     {
         fprintf(stderr, "Can't load index '%s'.\n", index_file->filename[0]);
         return EXIT_SUCCESS;
     }
 
-    std::cout << " OK\nLoading testing data ..." << std::flush;
-
-    auto test = load(input->filename[0]);
+    std::cout << " OK\n";
+    if(flat)
+        std::cout << "\tflat index : " << flat_index.size() << " bytes mapped\n";
 
-    boost::dynamic_bitset<> test_class_set;
-    for(size_t i = 0; i < test.data.size(); ++i)
+    Writer file;
+    if(!file.open(output->filename[0]))
     {
-        size_t const c = test.data[i].first;
-        if(c >= test_class_set.size())
-            test_class_set.resize(c+1);
-        test_class_set.set(c);
+        fprintf(stderr, "Can't open output file '%s'\n", output->filename[0]);
+        return EXIT_FAILURE;
     }
 
-    std::cout << " OK\n"
-        "\tdata : " << test.data.size() << 'x' << test.dim << ", " << test_class_set.count() << " classes\n";
-    if(!test_class_set.is_subset_of(train_class_set))
+    int const n = *std::max_element(neighbor_list.begin(), neighbor_list.end());
+    // the checks of a tuned bundle unless -c is given
+    if(checks->count == 0)
+        check_list.assign(1, checks_from_params(params_text, check_list[0]));
+    Query query{n, (radius->count > 0) ? radius->dval[0] : -1.0, check_list[0]};
+    int const dist_type = sharded ? shards.distance() : flat ? flat_index.distance() : index.getDistance();
+    // a linear index is searched by the blocked exact engine
+    std::unique_ptr<ExactEngine> exact_engine;
+    if(!sharded && !binary && exact_supported(dist_type) && (flat ? (flat_index.type() == 0) : (index.getAlgorithm() == cvflann::FLANN_INDEX_LINEAR)))
+        exact_engine = std::make_unique<ExactEngine>(mat, dist_type);
+    std::unique_ptr<FlatEngine> flat_engine;
+    if(flat && !exact_engine)
+        flat_engine = std::make_unique<FlatEngine>(flat_index, mat);
+    FlannEngine flann_engine(index);
+    Engine & base_engine = exact_engine ? static_cast<Engine &>(*exact_engine) : flat_engine ? static_cast<Engine &>(*flat_engine) : flann_engine;
+    std::unique_ptr<Engine> wrapped_engine;
+    if(reduction)
+        wrapped_engine = std::make_unique<RerankEngine>(base_engine, reduction, (rerank->count > 0) ? rerank->ival[0] : 4*n, dist_type);
+    else if(binary)
+        wrapped_engine = std::make_unique<BinaryEngine>(index);
+    else if(sharded)
+        wrapped_engine = std::make_unique<ShardedEngine>(shards);
+    Engine & index_engine = wrapped_engine ? *wrapped_engine : base_engine;
+    std::unique_ptr<Engine> delta_engine;
+    if(has_delta)
+        delta_engine = std::make_unique<DeltaEngine>(index_engine, delta, dist_type);
+    Engine & uncached_engine = delta_engine ? *delta_engine : index_engine;
+    // repeated queries are answered from the result cache
+    std::unique_ptr<CacheEngine> cache_engine;
+    if(cache_arg->count > 0)
+        cache_engine = std::make_unique<CacheEngine>(uncached_engine, size_t(std::max(0, cache_arg->ival[0])) << 20);
+    Engine & engine = cache_engine ? *cache_engine : uncached_engine;
+
+    StatisticsSweep sweep(check_list, neighbor_list, train_class_set.size());
+    bool written = true;
+
+    std::unique_ptr<GroundTruth> truth;
+    if(truth_file->count > 0)
+        truth = std::make_unique<GroundTruth>(truth_file->filename[0], full, n, dist_type, threads);
+
+    // Adds search results of count queries from row first to the statistics of a check level,
+    // the first check level goes to the output
+    size_t level = 0;
+    auto const consume = [&](size_t first, double const * labels, size_t count, cv::Mat_<int> const & indices)
     {
-        std::cout << "\t!!! " << (test_class_set-train_class_set).count() << " test classes not in training data\n";
-    }
-    std::cout << "Searching ..." << std::flush;
+        for(size_t i = 0; i < count; ++i)
+        {
+            int const * row = indices[i];
+            auto const m = sweep.add(level, labels[i], row, train);
+            if(level > 0)
+                continue;
+            file << labels[i];
+            for(int j = 0; j < n; ++j)
+                if(row[j] >= 0)
+                    file << ' ' << row[j] << ':' << train.labels[row[j]];
+            file << ' ' << m << '\n';
+        }
+        if(truth)
+            for(size_t i = 0; i < neighbor_list.size(); ++i)
+                sweep.recalls[level*neighbor_list.size() + i] += truth->recall_sum(indices.rowRange(0, count), first, neighbor_list[i]);
+    };
 
-    auto const n = neighbors->ival[0];
-    cv::flann::SearchParams const params{checks->ival[0]};
+    size_t batch = (batch_arg->count > 0) ? batch_arg->ival[0] : batch_rows(cols, threads);
 
-    std::ofstream file(output->filename[0]);
-    if(!file)
+    if(stream->count > 0)
     {
-        fprintf(stderr, "Can't open output file '%s'\n", output->filename[0]);
-        return EXIT_FAILURE;
-    }
+        std::cout << "Streaming testing data ..." << std::flush;
+        metrics.phase("search");
 
-    std::vector<size_t> match_counts(n, 0);
-    std::vector<size_t> cumulative_match_counts(n, 0);
-    std::vector<size_t> match_hist(n+1, 0);
+        // the input is read once, the stream searches the first check level and every batch is
+        // searched again at the other levels, so it can be a pipe
+        query.checks = check_list[0];
+        size_t first = 0;
+        cv::Mat_<int  > indices;
+        cv::Mat_<float> dists;
+        stream_search(input->filename[0], batch, engine, query, cols, threads, [&](QueryBatch const & b)
+        {
+            size_t const count = b.data.size();
+            cv::Mat_<float> const queries = b.queries.rowRange(0, count);
+            if(truth)
+                truth->add(queries, b.indices.rowRange(0, count));
+            level = 0;
+            consume(first, b.data.labels.data(), count, b.indices);
+            for(level = 1; level < check_list.size(); ++level)
+            {
+                Query level_query = query;
+                level_query.checks = check_list[level];
+                search(engine, queries, indices, dists, level_query, threads, latencies);
+                consume(first, b.data.labels.data(), count, indices);
+            }
+            first += count;
+        }, latencies);
+        written = file.close();
 
-    for(size_t i = 0; i < test.data.size(); ++i)
+        auto const test_class_set = sweep.tables[0].class_set();
+        std::cout << " OK\n"
+            "\tdata : " << sweep.tables[0].count << " queries, " << test_class_set.count() << " classes\n";
+        if(!test_class_set.is_subset_of(train_class_set))
+        {
+            std::cout << "\t!!! " << (test_class_set-train_class_set).count() << " test classes not in training data\n";
+        }
+    }
+    else
     {
-        std::vector<float> query(test.dim, 0);
-        std::vector<int  > indices(n);
-        std::vector<float> dists(n);
+        std::cout << "Loading testing data ..." << std::flush;
+        metrics.phase("load_query");
+
+        auto test = load(input->filename[0], threads);
 
-        for(auto p : test.data[i].second)
-            query[p.first-1] = p.second;
+        if(truth)
+            truth->expect(test);
 
-        if(radius->count > 0)
-            index.radiusSearch(query, indices, dists, radius->dval[0], n, params);
-        else
-            index.knnSearch(query, indices, dists, n, params);
+        boost::dynamic_bitset<> test_class_set;
+        for(size_t i = 0; i < test.size(); ++i)
+        {
+            size_t const c = test.labels[i];
+            if(c >= test_class_set.size())
+                test_class_set.resize(c+1);
+            test_class_set.set(c);
+        }
 
-        unsigned m = 0;
-        bool found = false;
-        file << test.data[i].first;
-        for(int j = 0; j < n; ++j)
+        std::cout << " OK\n"
+            "\tdata : " << test.size() << 'x' << test.dim << ", " << test_class_set.count() << " classes\n";
+        if(!test_class_set.is_subset_of(train_class_set))
         {
-            file << ' ' << indices[j] << ':' << train.data[indices[j]].first;
-            bool ok = abs(test.data[i].first - train.data[indices[j]].first) < 0.1;
-            if(ok)
+            std::cout << "\t!!! " << (test_class_set-train_class_set).count() << " test classes not in training data\n";
+        }
+        std::cout << "Searching ..." << std::flush;
+        metrics.phase("search");
+
+        // Queries are searched in parallel batches, results are consumed in order
+        // - the batch buffers are allocated once
+        batch = std::min(test.size(), batch);
+        cv::Mat_<float> queries(batch, cols);
+        cv::Mat_<int  > indices(batch, n);
+        cv::Mat_<float> dists(batch, n);
+        for(level = 0; level < check_list.size(); ++level)
+        {
+            query.checks = check_list[level];
+            for(size_t begin = 0; begin < test.size(); begin += batch)
             {
-                ++m;
-                ++match_counts[j];
+                size_t const end = std::min(test.size(), begin+batch);
+                cv::Mat_<float> const batch_queries = queries.rowRange(0, end-begin);
+                for(size_t i = begin; i < end; ++i)
+                    densify(test, i, queries[i-begin], cols);
+
+                search(engine, batch_queries, indices, dists, query, threads, latencies);
+
+                if(truth && (level == 0))
+                    truth->add(batch_queries, indices.rowRange(0, end-begin));
+
+                consume(begin, test.labels.data()+begin, end-begin, indices);
             }
-            found = found || ok;
-            if(found)
-                ++cumulative_match_counts[j];
         }
-        file << ' ' << m << std::endl;
+        written = file.close();
+        metrics.end();
 
-        ++match_hist[m];
+        std::cout << " OK\n";
     }
 
-    std::cout << " OK\n";
-
-    auto const count = test.data.size();
-
-    for(int i = 0; i < n; ++i)
+    if(!written)
     {
-        std::cout << i << " : " << match_counts[i] << " of " << count << ", total " << cumulative_match_counts[i]
-            << " (" << (100.*match_counts[i]/count) << "%, " << (100.*cumulative_match_counts[i]/count) << "%)\n";
+        fprintf(stderr, "Can't write output file '%s'\n", output->filename[0]);
+        return EXIT_FAILURE;
     }
-    for(int i = 0; i < (n+1); ++i)
+
+    bool const truth_ok = truth && truth->finish();
+    if(truth && !truth_ok)
+        std::cout << "!!! ground truth '" << truth_file->filename[0] << "' is for other queries\n";
+    if(cache_engine)
+        std::cout << "Result cache : " << cache_engine->hits() << " hits, " << cache_engine->duplicates() << " duplicates, "
+            << cache_engine->misses() << " misses, " << cache_engine->evictions() << " evictions\n";
+
+    // one report per check level and neighbor count, headed when there are several
+    for(level = 0; level < check_list.size(); ++level)
     {
-        std::cout << i << " : " << match_hist[i] << " (" << (100.*match_hist[i]/count) << "%)\n";
+        for(size_t table = 0; table < neighbor_list.size(); ++table)
+        {
+            int const n = neighbor_list[table];
+            auto const & stats = sweep.table(level, table);
+            auto const count = stats.count;
+
+            if(sweep.size() > 1)
+                std::cout << "-- checks " << check_list[level] << ", n " << n << " --\n";
+
+            for(int i = 0; i < n; ++i)
+            {
+                std::cout << i << " : " << stats.match_counts[i] << " of " << count << ", total " << stats.cumulative_match_counts[i]
+                    << " (" << (100.*stats.match_counts[i]/count) << "%, " << (100.*stats.cumulative_match_counts[i]/count) << "%)\n";
+            }
+            for(int i = 0; i < (n+1); ++i)
+            {
+                std::cout << i << " : " << stats.match_hist[i] << " (" << (100.*stats.match_hist[i]/count) << "%)\n";
+            }
+
+            if(truth_ok)
+            {
+                std::cout << "Recall@" << n << " : " << ((count > 0) ? sweep.recalls[level*neighbor_list.size() + table]/count : 0.0)
+                    << (truth->cached() ? " (cached ground truth)\n" : " (ground truth saved)\n");
+            }
+        }
     }
 
+    if(metrics_file->count > 0)
+        metrics.write(metrics_file->filename[0]);
+
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,679 @@
+#include "binary.h"
+#include "bundle.h"
+#include "data.h"
+#include "delta.h"
+#include "flat.h"
+#include "matrix.h"
+#include "params.h"
+#include "protocol.h"
+#include "reduce.h"
+#include "remote.h"
+#include "search.h"
+#include "shards.h"
+#include "socket.h"
+
+#include <csignal>
+#include <cstdlib>
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <utility>
+
+#include <argtable2.h>
+#include <opencv2/flann/flann.hpp>
+#include <poll.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+volatile std::sig_atomic_t stop = 0;
+
+void on_signal(int)
+{
+    stop = 1;
+}
+
+struct Connection
+{
+    enum Mode { unknown, binary, text };
+
+    explicit Connection(int fd)
+        : fd(fd)
+    {
+    }
+
+    ~Connection()
+    {
+        close(fd);
+    }
+
+    int fd;
+    Mode mode = unknown;
+    std::string in;// received, not parsed yet
+    std::string out;// not sent yet
+    bool eof = false;// the client is done sending, pending replies are still sent
+    bool closed = false;// broken, pending replies are dropped
+};
+
+// Query waiting for the next batch
+struct Request
+{
+    std::shared_ptr<Connection> connection;
+    Clock::time_point arrival;
+    uint32_t id = 0;
+    Query query{1, -1.0, 32};
+    Data data;
+    std::vector<float> dense;// binary dense rows, data.dense points here
+    std::string error;// for line requests that can't be parsed
+    // results, query.n per row
+    std::vector<int> indices;
+    std::vector<float> dists;
+};
+
+template<typename T>
+void append(std::string & out, T value)
+{
+    char buffer[64];
+    out.append(buffer, std::to_chars(buffer, buffer+sizeof(buffer), value).ptr);
+}
+
+template<typename T>
+void append_raw(std::string & out, T const * values, size_t count)
+{
+    out.append(reinterpret_cast<char const *>(values), count*sizeof(T));
+}
+
+class Server
+{
+public:
+    // cols is the query dimension, it differs from train.dim for reduced training data
+    Server(Data const & train, int cols, Engine & engine, Query const & defaults, unsigned threads)
+        : m_train(train)
+        , m_engine(engine)
+        , m_defaults(defaults)
+        , m_threads(threads)
+        , m_cols(cols)
+    {
+    }
+
+    // Parses complete requests received on a connection
+    void receive(std::shared_ptr<Connection> const & connection, std::vector<Request> & pending)
+    {
+        auto & in = connection->in;
+        if(connection->mode == Connection::unknown)
+        {
+            uint32_t magic = 0;
+            if(in.size() < sizeof(magic) && (in.find('\n') == std::string::npos) && !connection->eof)
+                return;
+            memcpy(&magic, in.data(), std::min(in.size(), sizeof(magic)));
+            connection->mode = (magic == request_magic) ? Connection::binary : Connection::text;
+        }
+
+        size_t used = 0;
+        if(connection->mode == Connection::binary)
+        {
+            RequestHeader header;
+            while(in.size()-used >= sizeof(header))
+            {
+                memcpy(&header, in.data()+used, sizeof(header));
+                if((header.magic != request_magic) || (header.type > request_labels)
+                    || ((header.type == request_search) && !request_in_limits(header)))
+                {
+                    // the stream can't be resynchronized
+                    reply_status(*connection, header.id, status_invalid);
+                    connection->closed = true;
+                    break;
+                }
+                size_t const size = sizeof(header) + request_payload(header);
+                if(in.size()-used < size)
+                    break;
+                if(header.type == request_info)
+                    reply_status(*connection, header.id, status_ok);
+                else if(header.type == request_labels)
+                    reply_labels(*connection, header);
+                else
+                    pending.push_back(binary_request(connection, header, in.data()+used+sizeof(header)));
+                used += size;
+            }
+        }
+        else
+        {
+            for(size_t eol; (eol = in.find('\n', used)) != std::string::npos; used = eol+1)
+                pending.push_back(line_request(connection, in.data()+used, in.data()+eol));
+            // the last line may end without a newline
+            if(connection->eof && (used < in.size()))
+            {
+                pending.push_back(line_request(connection, in.data()+used, in.data()+in.size()));
+                used = in.size();
+            }
+        }
+        in.erase(0, used);
+    }
+
+    // Searches all pending requests, requests with the same parameters share one batch
+    void run(std::vector<Request> & pending)
+    {
+        std::map<std::tuple<int, double, int>, std::vector<Request *>> groups;
+        for(auto & request : pending)
+            if(request.error.empty())
+                groups[std::make_tuple(request.query.n, request.query.radius, request.query.checks)].push_back(&request);
+
+        for(auto const & group : groups)
+        {
+            Query const & query = group.second.front()->query;
+            int rows = 0;
+            for(auto request : group.second)
+                rows += request->data.size();
+            if(m_queries.rows < rows)
+                m_queries.create(rows, m_cols);
+
+            int row = 0;
+            for(auto request : group.second)
+                for(size_t i = 0; i < request->data.size(); ++i)
+                    densify(request->data, i, m_queries[row++], m_cols);
+
+            search(m_engine, m_queries.rowRange(0, rows), m_indices, m_dists, query, m_threads);
+
+            row = 0;
+            for(auto request : group.second)
+            {
+                size_t const count = request->data.size();
+                request->indices.assign(m_indices[row], m_indices[row]+count*query.n);
+                request->dists.assign(m_dists[row], m_dists[row]+count*query.n);
+                row += count;
+            }
+        }
+
+        // Reply in arrival order, line clients rely on it
+        for(auto & request : pending)
+        {
+            auto const latency = Clock::now() - request.arrival;
+            uint64_t const latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count();
+            if(request.connection->mode == Connection::binary)
+                reply_binary(request, latency_ns);
+            else
+                reply_line(request, latency_ns);
+
+            ++m_served;
+            m_latency_total += latency_ns;
+            m_latency_max = std::max(m_latency_max, latency_ns);
+            if(m_verbose)
+                std::cerr << "request " << request.id << " : " << request.data.size() << " queries, " << (latency_ns/1000.) << " us\n";
+        }
+    }
+
+    void set_verbose(bool verbose) { m_verbose = verbose; }
+
+    void summary(std::ostream & out) const
+    {
+        out << "Served " << m_served << " requests";
+        if(m_served > 0)
+            out << ", latency mean " << (m_latency_total/1000./m_served) << " us, max " << (m_latency_max/1000.) << " us";
+        out << '\n';
+    }
+
+private:
+    Request binary_request(std::shared_ptr<Connection> const & connection, RequestHeader const & header, char const * payload)
+    {
+        Request request;
+        request.connection = connection;
+        request.arrival = Clock::now();
+        request.id = header.id;
+        request.query = Query{int(std::min<size_t>(header.n, m_train.size())), header.radius, header.checks};
+        Data & data = request.data;
+        data.labels.assign(header.rows, 0.0);
+        if(header.cols > 0)
+        {
+            request.dense.resize(size_t(header.rows)*header.cols);
+            memcpy(request.dense.data(), payload, request.dense.size()*sizeof(float));
+            data.offsets.clear();
+            data.dim = header.cols;
+            data.dense = request.dense.data();
+        }
+        else
+        {
+            auto const offsets = reinterpret_cast<uint64_t const *>(payload);
+            auto const indices = reinterpret_cast<uint32_t const *>(payload + (header.rows+1)*sizeof(uint64_t));
+            auto const values  = reinterpret_cast<float const *>(payload + (header.rows+1)*sizeof(uint64_t) + header.nnz*sizeof(uint32_t));
+            data.offsets.resize(header.rows+1);
+            memcpy(data.offsets.data(), offsets, data.offsets.size()*sizeof(uint64_t));
+            data.indices.assign(indices, indices+header.nnz);
+            data.values.assign(values, values+header.nnz);
+            bool valid = (data.offsets.front() == 0) && (data.offsets.back() == header.nnz)
+                && std::is_sorted(data.offsets.begin(), data.offsets.end());
+            if(!valid)
+            {
+                data.labels.clear();
+                data.offsets.assign(1, 0);
+                request.error = "invalid row offsets";
+            }
+        }
+        return request;
+    }
+
+    Request line_request(std::shared_ptr<Connection> const & connection, char const * begin, char const * end)
+    {
+        Request request;
+        request.connection = connection;
+        request.arrival = Clock::now();
+        request.id = ++m_lines;
+        request.query = m_defaults;
+
+        DataChunk chunk;
+        parse_chunk(begin, end, chunk);
+        if(chunk.failed || (chunk.lines != 1))
+            request.error = chunk.bad_label ? "Can't read label" : "Invalid data at char " + std::to_string(chunk.error_column);
+        else
+            request.data = std::move(chunk.data);
+        return request;
+    }
+
+    void reply_status(Connection & connection, uint32_t id, uint32_t status)
+    {
+        ResponseHeader header{};
+        header.magic = response_magic;
+        header.status = status;
+        header.id = id;
+        header.dim = m_cols;
+        header.size = m_train.size();
+        append_raw(connection.out, &header, 1);
+    }
+
+    // Rows [nnz, nnz+rows) as one neighbor per row at distance 0
+    void reply_labels(Connection & connection, RequestHeader const & request)
+    {
+        if((request.nnz > m_train.size()) || (request.rows > m_train.size() - request.nnz))
+        {
+            reply_status(connection, request.id, status_invalid);
+            return;
+        }
+        ResponseHeader header{};
+        header.magic = response_magic;
+        header.status = status_ok;
+        header.id = request.id;
+        header.rows = request.rows;
+        header.n = 1;
+        header.dim = m_cols;
+        header.size = m_train.size();
+
+        auto & out = connection.out;
+        append_raw(out, &header, 1);
+        for(uint32_t i = 0; i < request.rows; ++i)
+        {
+            int32_t const index = request.nnz + i;
+            append_raw(out, &index, 1);
+        }
+        std::vector<float> const zeros(request.rows, 0.0f);
+        append_raw(out, zeros.data(), zeros.size());
+        append_raw(out, m_train.labels.data() + request.nnz, request.rows);
+    }
+
+    void reply_binary(Request const & request, uint64_t latency_ns)
+    {
+        ResponseHeader header{};
+        header.magic = response_magic;
+        header.status = request.error.empty() ? status_ok : status_invalid;
+        header.id = request.id;
+        header.rows = request.error.empty() ? request.data.size() : 0;
+        header.n = request.query.n;
+        header.dim = m_cols;
+        header.size = m_train.size();
+        header.latency_ns = latency_ns;
+
+        auto & out = request.connection->out;
+        append_raw(out, &header, 1);
+        if(header.rows == 0)
+            return;
+        append_raw(out, request.indices.data(), request.indices.size());
+        append_raw(out, request.dists.data(), request.dists.size());
+        for(int index : request.indices)
+        {
+            double const label = (index >= 0) ? m_train.labels[index] : 0.0;
+            append_raw(out, &label, 1);
+        }
+    }
+
+    void reply_line(Request const & request, uint64_t latency_ns)
+    {
+        auto & out = request.connection->out;
+        if(!request.error.empty())
+        {
+            out += "! " + request.error + '\n';
+            return;
+        }
+        append(out, latency_ns/1000);
+        for(size_t j = 0; j < request.indices.size(); ++j)
+        {
+            int const index = request.indices[j];
+            if(index < 0)
+                continue;
+            out += ' ';
+            append(out, index);
+            out += ':';
+            append(out, m_train.labels[index]);
+            out += ':';
+            append(out, request.dists[j]);
+        }
+        out += '\n';
+    }
+
+    Data const & m_train;
+    Engine & m_engine;
+    Query const m_defaults;
+    unsigned const m_threads;
+    int const m_cols;
+    bool m_verbose = false;
+
+    cv::Mat_<float> m_queries;
+    cv::Mat_<int  > m_indices;
+    cv::Mat_<float> m_dists;
+
+    uint32_t m_lines = 0;
+    uint64_t m_served = 0;
+    uint64_t m_latency_total = 0;
+    uint64_t m_latency_max = 0;
+};
+
+// Sends what the socket accepts, returns false on error
+bool send_pending(Connection & connection)
+{
+    while(!connection.out.empty())
+    {
+        ssize_t const count = send(connection.fd, connection.out.data(), connection.out.size(), MSG_NOSIGNAL);
+        if(count < 0)
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+        connection.out.erase(0, count);
+    }
+    return true;
+}
+
+// Answers requests on address until SIGINT or SIGTERM
+// - requests are searched once batch_size queries are pending or the oldest one has waited for wait
+void serve(Server & server, char const * address, Clock::duration wait, size_t batch_size)
+{
+    int const listener = listen_address(address);
+    set_nonblocking(listener);
+
+    struct sigaction action{};
+    action.sa_handler = on_signal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "Listening on '" << address << "'" << std::endl;
+
+    std::vector<std::shared_ptr<Connection>> connections;
+    std::vector<Request> pending;
+    size_t pending_rows = 0;
+    std::vector<pollfd> fds;
+    while(!stop)
+    {
+        // Wait for more requests only until the oldest pending one has waited long enough
+        timespec timeout{};
+        timespec * timeout_ptr = nullptr;
+        if(!pending.empty())
+        {
+            auto const left = std::max(Clock::duration::zero(), pending.front().arrival + wait - Clock::now());
+            auto const ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+            timeout.tv_sec = ns / 1000000000;
+            timeout.tv_nsec = ns % 1000000000;
+            timeout_ptr = &timeout;
+        }
+
+        fds.assign(1, pollfd{listener, POLLIN, 0});
+        for(auto const & connection : connections)
+        {
+            // a connection at eof is only watched while there is something to send
+            short const events = (connection->eof ? 0 : POLLIN) | (connection->out.empty() ? 0 : POLLOUT);
+            fds.push_back(pollfd{(events != 0) ? connection->fd : -1, events, 0});
+        }
+
+        if((ppoll(fds.data(), fds.size(), timeout_ptr, nullptr) < 0) && (errno != EINTR))
+        {
+            perror("poll");
+            break;
+        }
+
+        if(fds[0].revents & POLLIN)
+        {
+            for(int fd; (fd = accept(listener, nullptr, nullptr)) >= 0;)
+            {
+                set_nonblocking(fd);
+                set_nodelay(fd);
+                connections.push_back(std::make_shared<Connection>(fd));
+            }
+        }
+
+        for(size_t i = 1; i < fds.size(); ++i)
+        {
+            auto const & connection = connections[i-1];
+            if(!connection->eof && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                char buffer[1 << 16];
+                ssize_t count;
+                while((count = recv(connection->fd, buffer, sizeof(buffer), 0)) > 0)
+                    connection->in.append(buffer, count);
+                if(count == 0)
+                    connection->eof = true;
+                else if((count < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                    connection->closed = true;
+
+                size_t const before = pending.size();
+                server.receive(connection, pending);
+                for(size_t j = before; j < pending.size(); ++j)
+                    pending_rows += pending[j].data.size();
+            }
+        }
+
+        if(!pending.empty() && ((pending_rows >= batch_size) || (Clock::now() >= pending.front().arrival + wait)))
+        {
+            server.run(pending);
+            pending.clear();
+            pending_rows = 0;
+        }
+
+        for(auto const & connection : connections)
+            if(!send_pending(*connection))
+                connection->closed = true;
+
+        // Pending requests keep a broken connection alive until they are answered into the void
+        connections.erase(std::remove_if(connections.begin(), connections.end(),
+            [](std::shared_ptr<Connection> const & c) { return c->closed || (c->eof && c->out.empty() && (c.use_count() == 1)); }),
+            connections.end());
+    }
+
+    close(listener);
+    if(!is_tcp_address(address))
+        unlink(address);
+    server.summary(std::cout);
+}
+
+}
+
+int main(int argc, char * argv[])
+{
+    struct arg_file * train_file = arg_file0("f", "features", "<filename>", "Training dataset (default from the index bundle)");
+    struct arg_file * index_file = arg_file0("x", "index", "<filename>", "Training dataset index or bundle");
+    struct arg_int * shard_arg = arg_int0(NULL, "shard", "i", "Serve shard i of the shard manifest -x, as a worker");
+    struct arg_str * workers_arg = arg_str0(NULL, "workers", "<address>,..", "Coordinate workers serving the shards in order instead of -x");
+    struct arg_int * deadline = arg_int0(NULL, "deadline", "ms", "Workers not replying within ms are left out of a batch (default 0 = wait)");
+    struct arg_file * socket_file = arg_file1("s", "socket", "<address>", "Unix domain socket path or host:port to listen on");
+    struct arg_int * neighbors = arg_int0("n", "neighbors", "n", "Neighbor count of line queries (default 1)");
+    struct arg_dbl * radius = arg_dbl0("r", "radius", "r", "Search radius of line queries, requests radius search");
+    struct arg_int * checks = arg_int0("c", "checks", "...", "Search checks of line queries (default 32 or the tuned checks of the bundle)");
+    struct arg_int * rerank = arg_int0(NULL, "rerank", "m", "Candidates reranked at full precision for reduced indexes (default 32, 0 = off)");
+    struct arg_int * threads_arg = arg_int0(NULL, "threads", "{0..}", "Worker threads for loading and search (default 0 = all cores)");
+    struct arg_int * batch_wait = arg_int0(NULL, "batch-wait", "us", "Time to collect a batch after the first request (default 200)");
+    struct arg_int * batch_size = arg_int0(NULL, "batch-size", "n", "Queries that run a batch at once (default 1024)");
+    struct arg_lit * verbose = arg_lit0("v", "verbose", "Log the latency of every request");
+    struct arg_lit * help = arg_lit0("h", "help", "Print this help and exit");
+    struct arg_end * end = arg_end(20);
+    void * argtable[] = {
+       train_file, index_file, shard_arg, workers_arg, deadline, socket_file, neighbors, radius, checks, rerank, threads_arg,
+       batch_wait, batch_size, verbose, help, end };
+    if(arg_nullcheck(argtable) != 0)
+    {
+        fprintf(stderr, "%s: insufficient memory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    neighbors->ival[0] = 1;
+    checks->ival[0] = 32;
+    rerank->ival[0] = 32;
+    threads_arg->ival[0] = 0;
+    batch_wait->ival[0] = 200;
+    batch_size->ival[0] = 1024;
+    deadline->ival[0] = 0;
+    int arg_errors = arg_parse(argc, argv, argtable);
+    if(help->count > 0)
+    {
+        printf("Usage: %s", argv[0]);
+        arg_print_syntax(stdout, argtable, "\n");
+        arg_print_glossary(stdout, argtable,"  %-25s %s\n");
+        return EXIT_SUCCESS;
+    }
+    if(arg_errors > 0)
+    {
+        arg_print_errors(stderr, end, argv[0]);
+        fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if((workers_arg->count > 0) == (index_file->count > 0))
+    {
+        fprintf(stderr, "Either -x or --workers is required.\n");
+        return EXIT_FAILURE;
+    }
+    if((shard_arg->count > 0) && ((index_file->count == 0) || (train_file->count > 0)))
+    {
+        fprintf(stderr, "--shard needs a shard manifest -x and no -f.\n");
+        return EXIT_FAILURE;
+    }
+    if((workers_arg->count == 0) && (deadline->count > 0))
+    {
+        fprintf(stderr, "--deadline needs --workers.\n");
+        return EXIT_FAILURE;
+    }
+    if((workers_arg->count > 0) && (train_file->count > 0))
+    {
+        fprintf(stderr, "The workers load the training data, -f doesn't apply.\n");
+        return EXIT_FAILURE;
+    }
+
+    unsigned const threads = thread_count(threads_arg->ival[0]);
+    Query const defaults{neighbors->ival[0], (radius->count > 0) ? radius->dval[0] : -1.0, checks->ival[0]};
+
+    if(workers_arg->count > 0)
+    {
+        std::vector<std::string> addresses;
+        std::string const list = workers_arg->sval[0];
+        for(size_t begin = 0, comma; begin <= list.size(); begin = comma+1)
+        {
+            comma = std::min(list.find(',', begin), list.size());
+            if(comma > begin)
+                addresses.push_back(list.substr(begin, comma-begin));
+        }
+
+        std::cout << "Connecting to workers ..." << std::flush;
+        RemoteEngine remote(addresses, deadline->ival[0]);
+        Data const train = remote.train();
+        std::cout << " OK\n"
+            "\tworkers : " << remote.workers() << "\n"
+            "\tdata : " << train.size() << 'x' << train.dim << "\n";
+
+        Server server(train, train.dim, remote, defaults, threads);
+        server.set_verbose(verbose->count > 0);
+        serve(server, socket_file->filename[0], std::chrono::microseconds(batch_wait->ival[0]), batch_size->ival[0]);
+        std::cout << "Missed " << remote.missed() << " worker replies\n";
+        return EXIT_SUCCESS;
+    }
+
+    // a worker serves one shard bundle of a manifest
+    std::string index_path = index_file->filename[0];
+    if(shard_arg->count > 0)
+    {
+        index_path = is_manifest(index_file->filename[0]) ? ShardSet::bundle(index_file->filename[0], shard_arg->ival[0]) : std::string();
+        if(index_path.empty())
+        {
+            fprintf(stderr, "'%s' is not a shard manifest with shard %d.\n", index_file->filename[0], shard_arg->ival[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    char const * const index_name = index_path.c_str();
+
+    std::cout << "Loading training data ..." << std::flush;
+
+    std::string params_text;
+    auto train = load_train((train_file->count > 0) ? train_file->filename[0] : nullptr, index_name, threads, &params_text);
+
+    Reduction reduction;
+    cv::Mat_<float> mat = index_features(train, index_name, reduction, threads);
+    train.release_features();
+    int const cols = reduction ? reduction.full.cols : mat.cols;
+
+    // appended rows continue the row numbers
+    Delta delta;
+    bool const has_delta = load_delta(index_name, train.size(), train.dim, delta);
+    if(has_delta)
+        train.labels.insert(train.labels.end(), delta.labels.begin(), delta.labels.end());
+
+    std::cout << " OK\n"
+        "\tdata : " << train.size() << 'x' << train.dim << "\n";
+    if(has_delta)
+        std::cout << "\tdelta : " << delta.size() << " appended, " << delta.deleted_count() << " deleted\n";
+    if(reduction)
+        std::cout << "\treduced : " << cols << " -> " << mat.cols << '\n';
+    std::cout << "Loading model ..." << std::flush;
+
+    // binary indexes are over the packed rows
+    bool const binary = is_binary(index_distance(index_name, 0));
+    cv::Mat const packed = binary ? pack_bits(mat) : cv::Mat();
+    // flat indexes are mapped and searched in place
+    bool const flat = is_flat_index(index_name);
+    FlatIndex flat_index;
+    cv::flann::Index index;
+    if(flat)
+        flat_index = FlatIndex::load(index_name);
+    else if(!index.load(binary ? packed : mat, index_name))
+    {
+        fprintf(stderr, "Can't load index '%s'.\n", index_name);
+        return EXIT_FAILURE;
+    }
+
+    std::cout << " OK\n";
+    if(flat)
+        std::cout << "\tflat index : " << flat_index.size() << " bytes mapped\n";
+
+    int const dist_type = flat ? flat_index.distance() : index.getDistance();
+    std::unique_ptr<FlatEngine> flat_engine;
+    if(flat)
+        flat_engine = std::make_unique<FlatEngine>(flat_index, mat);
+    FlannEngine flann_engine(index);
+    Engine & base_engine = flat_engine ? static_cast<Engine &>(*flat_engine) : flann_engine;
+    std::unique_ptr<Engine> wrapped_engine;
+    if(reduction)
+        wrapped_engine = std::make_unique<RerankEngine>(base_engine, reduction, rerank->ival[0], dist_type);
+    else if(binary)
+        wrapped_engine = std::make_unique<BinaryEngine>(index);
+    Engine & index_engine = wrapped_engine ? *wrapped_engine : base_engine;
+    std::unique_ptr<Engine> delta_engine;
+    if(has_delta)
+        delta_engine = std::make_unique<DeltaEngine>(index_engine, delta, dist_type);
+    Engine & engine = delta_engine ? *delta_engine : index_engine;
+    Query query = defaults;
+    if(checks->count == 0)
+        query.checks = checks_from_params(params_text, checks->ival[0]);
+    Server server(train, cols, engine, query, threads);
+    server.set_verbose(verbose->count > 0);
+
+    serve(server, socket_file->filename[0], std::chrono::microseconds(batch_wait->ival[0]), batch_size->ival[0]);
+
+    return EXIT_SUCCESS;
+}
@@ -1,7 +1,19 @@
+#include "binary.h"
+#include "bundle.h"
 #include "data.h"
+#include "flat.h"
+#include "matrix.h"
+#include "metrics.h"
+#include "params.h"
+#include "reduce.h"
+#include "search.h"
+#include "shards.h"
+#include "tune.h"
 
+#include <cstdio>
 #include <cstdlib>
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -16,7 +28,7 @@ int main(int argc, char * argv[])
 {
     struct arg_lit  * help       = arg_lit0 ("h", "help", "Print this help and exit");
     struct arg_file * input_file = arg_file0("i", "input" , "<filename>", "Input dataset in libsvm format (default stdin)");
-    struct arg_file * index_file = arg_file1("x", "index" , "<filename>", "Output index file");
+    struct arg_file * index_file = arg_file1("x", "index" , "<filename>", "Output index bundle");
     struct arg_int  * verbosity  = arg_int0 ("v", "verbosity", "{0..4}", "Log verbosity"
             "\nIndex parameters :");
     struct arg_int  * distance = arg_int0("d", "distance", "{1..9}", "Distance metric"
@@ -45,6 +57,20 @@ int main(int argc, char * argv[])
     struct arg_dbl * auto_build_weight    = arg_dbl0(NULL, "auto-build-weight", "", "");
     struct arg_dbl * auto_memory_weight   = arg_dbl0(NULL, "auto-memory-weight", "", "");
     struct arg_dbl * auto_sample_fraction = arg_dbl0(NULL, "auto-sample-fraction", "[0,1]", "");
+    struct arg_int * reduce = arg_int0(NULL, "reduce", "k", "Index features reduced to k dimensions, queries are reranked at full precision");
+    struct arg_int * reduce_method = arg_int0(NULL, "reduce-method", "{1,2}", "1=PCA (default), 2=sparse random projection");
+    struct arg_dbl * tune_recall = arg_dbl0(NULL, "tune-recall", "[0,1]", "Tune the index type and checks for this recall@k, overrides -t"
+            "\n\tthe result is saved to and reused from the --tune-file");
+    struct arg_int * tune_k = arg_int0(NULL, "tune-k", "k", "Neighbor count of the tuned recall (default 10)");
+    struct arg_dbl * tune_latency = arg_dbl0(NULL, "tune-latency", "us", "Tuned p99 query latency budget in microseconds");
+    struct arg_dbl * tune_memory = arg_dbl0(NULL, "tune-memory", "bytes", "Tuned index size budget");
+    struct arg_int * tune_rows = arg_int0(NULL, "tune-rows", "n", "Training rows sampled for tuning (default 100000)");
+    struct arg_int * tune_queries = arg_int0(NULL, "tune-queries", "n", "Held out rows used as tuning queries (default 1000)");
+    struct arg_file * tune_file = arg_file0(NULL, "tune-file", "<filename>", "Tuning result (default <index>.tune)");
+    struct arg_int * shards_arg = arg_int0(NULL, "shards", "n", "Build n shards in parallel, the index file becomes a shard manifest");
+    struct arg_lit * flat_arg = arg_lit0(NULL, "flat", "Build a flat index searched in place from the mapped bundle (-t 0..3, -d 1 or 2)");
+    struct arg_int * threads_arg = arg_int0(NULL, "threads", "{0..}", "Worker threads for sharded builds (default 0 = all cores)");
+    struct arg_file * metrics_file = arg_file0(NULL, "metrics", "<filename>", "Write phase timings, memory, I/O and query latencies as JSON");
     struct arg_end * end = arg_end(20);
     void * argtable[] = {
        help, input_file, index_file, distance, index_type,
@@ -52,7 +78,9 @@ int main(int argc, char * argv[])
        km_branching, km_iterations, km_centers, km_index,
        lsh_table_count, lsh_key_size, lsh_probe_level,
        auto_precision, auto_build_weight, auto_memory_weight, auto_sample_fraction,
-       end };
+       reduce, reduce_method,
+       tune_recall, tune_k, tune_latency, tune_memory, tune_rows, tune_queries, tune_file,
+       shards_arg, flat_arg, threads_arg, metrics_file, end };
     if(arg_nullcheck(argtable) != 0)
     {
         fprintf(stderr, "%s: insufficient memory\n", argv[0]);
@@ -74,6 +102,12 @@ int main(int argc, char * argv[])
     auto_build_weight   ->dval[0] = 0.01;
     auto_memory_weight  ->dval[0] = 0;
     auto_sample_fraction->dval[0] = 0.1;
+    reduce_method->ival[0] = reduce_pca;
+    tune_k->ival[0] = 10;
+    tune_rows->ival[0] = 100000;
+    tune_queries->ival[0] = 1000;
+    shards_arg->ival[0] = 1;
+    threads_arg->ival[0] = 0;
     int arg_errors = arg_parse(argc, argv, argtable);
     if(help->count > 0)
     {
@@ -91,84 +125,199 @@ int main(int argc, char * argv[])
 
     cvflann::log_verbosity(verbosity->ival[0]);
 
-    // -- Index parameters --
+    unsigned const threads = thread_count(threads_arg->ival[0]);
+    size_t const shard_count = std::max(1, shards_arg->ival[0]);
+    if((shard_count > 1) && (reduce->count > 0))
+    {
+        fprintf(stderr, "Sharded indexes can't be reduced.\n");
+        return EXIT_FAILURE;
+    }
+    bool const binary = is_binary(distance->ival[0]);
+    if(binary && ((index_type->ival[0] != 0) && (index_type->ival[0] != 4)))
+    {
+        fprintf(stderr, "Binary features are indexed by -t 0 (linear) or -t 4 (LSH).\n");
+        return EXIT_FAILURE;
+    }
+    if(!binary && (index_type->ival[0] == 4))
+    {
+        fprintf(stderr, "LSH indexes binary features, use -d 9.\n");
+        return EXIT_FAILURE;
+    }
+    if(binary && ((shard_count > 1) || (reduce->count > 0) || (tune_recall->count > 0)))
+    {
+        fprintf(stderr, "Binary features are indexed packed, --shards, --reduce and --tune-recall don't apply.\n");
+        return EXIT_FAILURE;
+    }
 
-    std::unique_ptr<cv::flann::IndexParams> params;
-    switch(index_type->ival[0])
+    bool const flat = flat_arg->count > 0;
+    if(flat && ((shard_count > 1) || !flat_supported(distance->ival[0]) || ((tune_recall->count == 0) && (index_type->ival[0] > 3))))
     {
-        case 0 :
-            params = std::make_unique<cv::flann::LinearIndexParams>();
-            break;
-        case 1 :
-            params = std::make_unique<cv::flann::KDTreeIndexParams>(
-                kd_tree_count->ival[0]);
-            break;
-        case 2 :
-            params = std::make_unique<cv::flann::KMeansIndexParams>(
-                km_branching ->ival[0],
-                km_iterations->ival[0],
-                static_cast<cvflann::flann_centers_init_t>(km_centers->ival[0]),
-                km_index->dval[0]);
-            break;
-        case 3 :
-            params = std::make_unique<cv::flann::CompositeIndexParams>(
-                kd_tree_count->ival[0],
-                km_branching ->ival[0],
-                km_iterations->ival[0],
-                static_cast<cvflann::flann_centers_init_t>(km_centers->ival[0]),
-                km_index->dval[0]);
-            break;
-        case 4 :
-            if((lsh_table_count->count == 0) || (lsh_key_size == 0) || (lsh_probe_level == 0))
-            {
-                std::cerr << "For t=4, lsh-table-count, lsh-key-size and lsh-probe-level must be set.\n";
-                return EXIT_FAILURE;
-            }
-            params = std::make_unique<cv::flann::LshIndexParams>(
-                lsh_table_count->ival[0],
-                lsh_key_size   ->ival[0],
-                lsh_probe_level->ival[0]);
-            break;
-        case 5 :
-            params = std::make_unique<cv::flann::AutotunedIndexParams>(
-                auto_precision      ->dval[0],
-                auto_build_weight   ->dval[0],
-                auto_memory_weight  ->dval[0],
-                auto_sample_fraction->dval[0]);
-            break;
-        default :
-            std::cerr << "Unknown index type " << index_type->ival[0] << std::endl;
-            return EXIT_FAILURE;
+        fprintf(stderr, "Flat indexes are built for -t 0 to 3 and -d 1 or 2, without --shards.\n");
+        return EXIT_FAILURE;
     }
 
+    // -- Index parameters --
+
+    IndexConfig config;
+    config.type = index_type->ival[0];
+    config.kd_tree_count = kd_tree_count->ival[0];
+    config.km_branching  = km_branching ->ival[0];
+    config.km_iterations = km_iterations->ival[0];
+    config.km_centers    = km_centers   ->ival[0];
+    config.km_index      = km_index     ->dval[0];
+    config.lsh_table_count = lsh_table_count->ival[0];
+    config.lsh_key_size    = lsh_key_size   ->ival[0];
+    config.lsh_probe_level = lsh_probe_level->ival[0];
+    config.auto_precision       = auto_precision      ->dval[0];
+    config.auto_build_weight    = auto_build_weight   ->dval[0];
+    config.auto_memory_weight   = auto_memory_weight  ->dval[0];
+    config.auto_sample_fraction = auto_sample_fraction->dval[0];
+    auto params = make_params(config);
+    if(!params)
+        return EXIT_FAILURE;
+
     // -- Load data --
 
+    Metrics metrics("flann-train");
+
     std::cout << "Loading training data ..." << std::flush;
+    metrics.phase("load");
 
     auto train = load(input_file->filename[0]);
 
-    cv::Mat_<float> mat = cv::Mat_<float>::zeros(train.data.size(), train.dim);
+    metrics.phase("dense");
+
+    cv::Mat_<float> mat = dense(train);
+    train.release_features();
 
     boost::dynamic_bitset<> train_class_set;
-    for(size_t i = 0; i < train.data.size(); ++i)
+    for(size_t i = 0; i < train.size(); ++i)
     {
-        size_t const c = train.data[i].first;
+        size_t const c = train.labels[i];
         if(c >= train_class_set.size())
             train_class_set.resize(c+1);
         train_class_set.set(c);
-        for(auto p : train.data[i].second)
-            mat(i, p.first-1) = p.second;
     }
 
     std::cout << " OK\n"
-        "\tdata : " << train.data.size() << 'x' << train.dim << ", " << train_class_set.count() << " classes\n"
-        "Training ..." << std::flush;
+        "\tdata : " << train.size() << 'x' << train.dim << ", " << train_class_set.count() << " classes\n";
+
+    // -- Reduce --
+
+    Reducer reducer;
+    cv::Mat_<float> full;
+    if(reduce->count > 0)
+    {
+        int const k = reduce->ival[0];
+        if((k <= 0) || (k >= mat.cols))
+        {
+            std::cerr << "Reduced dimension must be in [1," << mat.cols << ")\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Reducing ..." << std::flush;
+        metrics.phase("reduce");
+
+        reducer = (reduce_method->ival[0] == reduce_projection) ? random_projection(mat.cols, k) : fit_pca(mat, k);
+        full = mat;
+        mat = reducer.apply(full, threads);
+
+        std::cout << " OK\n"
+            "\treduced : " << full.cols << " -> " << mat.cols << '\n';
+    }
+
+    // -- Tune --
+
+    std::string params_text = describe(*params);
+    if(tune_recall->count > 0)
+    {
+        TuneTarget target;
+        target.k = tune_k->ival[0];
+        target.recall = tune_recall->dval[0];
+        target.latency = (tune_latency->count > 0) ? tune_latency->dval[0]*1e-6 : 0.0;
+        target.memory = (tune_memory->count > 0) ? tune_memory->dval[0] : 0;
+        std::string const tuning = (tune_file->count > 0) ? tune_file->filename[0] : std::string(index_file->filename[0]) + ".tune";
+
+        TuneResult result;
+        if(load_tuning(tuning.c_str(), target, mat, distance->ival[0], result))
+        {
+            std::cout << "Reusing tuning '" << tuning << "'\n";
+        }
+        else
+        {
+            std::cout << "Tuning ...\n";
+            metrics.phase("tune");
+
+            result = tune(mat, distance->ival[0], target, tune_rows->ival[0], tune_queries->ival[0], threads, std::cout);
+            save_tuning(tuning.c_str(), result, target, mat, distance->ival[0]);
+        }
+        std::cout << "\ttuned : " << to_string(result.config) << " checks " << result.checks << ", recall@" << target.k << ' ' << result.recall
+            << ", " << result.qps << " qps, p99 " << (result.p99*1e6) << " us" << (result.met ? "\n" : " (target not met)\n");
+
+        config = result.config;
+        params = make_params(config);
+        // the bundle recommends the tuned checks to the search tools
+        params_text = describe(*params) + "checks=" + std::to_string(result.checks) + '\n';
+    }
+
+    if(shard_count > 1)
+    {
+        std::cout << "Training " << shard_count << " shards ..." << std::flush;
+        metrics.phase("build");
+
+        // unchanged shards of an existing manifest are kept
+        ShardSet shards;
+        shards.build(mat, train.labels, *params, params_text, distance->ival[0], shard_count, threads,
+            is_manifest(index_file->filename[0]) ? index_file->filename[0] : nullptr);
+
+        std::cout << " OK\n"
+            "\trebuilt : " << shards.built() << " of " << shard_count << " shards\n"
+            "Saving shards ..." << std::flush;
+        metrics.phase("save");
+
+        shards.save(index_file->filename[0], threads);
+        std::remove(reducer_path(index_file->filename[0]).c_str());
+
+        std::cout << " OK\n";
+
+        if(metrics_file->count > 0)
+            metrics.write(metrics_file->filename[0]);
+        return EXIT_SUCCESS;
+    }
+
+    std::cout << "Training ..." << std::flush;
+
+    metrics.phase("build");
+
+    // the bundle keeps the 0/1 rows as floats, the index is over the packed rows
+    cv::Mat const packed = binary ? pack_bits(mat) : cv::Mat();
+    cv::flann::Index index;
+    FlatIndex flat_index;
+    if(flat)
+        flat_index = FlatIndex::build(mat, config, distance->ival[0], threads);
+    else
+        index.build(binary ? packed : mat, *params, static_cast<cvflann::flann_distance_t>(distance->ival[0]));
+
+    std::cout << " OK\n";
+    if(flat)
+        std::cout << "\tflat index : " << flat_index.size() << " bytes\n";
+    std::cout << "Saving bundle ..." << std::flush;
+
+    metrics.phase("save");
 
-    cv::flann::Index index(mat, *params, static_cast<cvflann::flann_distance_t>(distance->ival[0]));
+    if(flat)
+        save_flat_bundle(flat_index, mat, train.labels, params_text, index_file->filename[0]);
+    else
+        save_bundle(index, mat, train.labels, params_text, index_file->filename[0]);
+    // a stale sidecar would reduce the queries of an unreduced index
+    if(reducer)
+        save_reduction(reducer, full, reducer_path(index_file->filename[0]).c_str());
+    else
+        std::remove(reducer_path(index_file->filename[0]).c_str());
 
     std::cout << " OK\n";
 
-    index.save(index_file->filename[0]);
+    if(metrics_file->count > 0)
+        metrics.write(metrics_file->filename[0]);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,189 @@
+#include "binary.h"
+#include "bundle.h"
+#include "data.h"
+#include "delta.h"
+#include "flat.h"
+#include "matrix.h"
+#include "params.h"
+#include "reduce.h"
+#include "search.h"
+#include "shards.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <argtable2.h>
+#include <opencv2/flann/flann.hpp>
+
+int main(int argc, char * argv[])
+{
+    struct arg_file * index_file = arg_file1("x", "index", "<filename>", "Index bundle to update");
+    struct arg_file * append = arg_file0("a", "append", "<filename>", "Rows to append, libsvm or binary dataset");
+    struct arg_file * remove = arg_file0(NULL, "delete", "<filename>", "Row numbers to delete, one per line");
+    struct arg_dbl * fold_ratio = arg_dbl0(NULL, "fold-ratio", "r", "Fold the delta into the bundle once it has r x bundle rows (default 0.01)");
+    struct arg_lit * fold_now = arg_lit0(NULL, "fold", "Fold the delta into the bundle now");
+    struct arg_int * threads_arg = arg_int0(NULL, "threads", "{0..}", "Worker threads for loading and flat index builds (default 0 = all cores)");
+    struct arg_lit * help = arg_lit0("h", "help", "Print this help and exit");
+    struct arg_end * end = arg_end(20);
+    void * argtable[] = {
+       index_file, append, remove, fold_ratio, fold_now, threads_arg, help, end };
+    if(arg_nullcheck(argtable) != 0)
+    {
+        fprintf(stderr, "%s: insufficient memory\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    fold_ratio->dval[0] = 0.01;
+    threads_arg->ival[0] = 0;
+    int arg_errors = arg_parse(argc, argv, argtable);
+    if(help->count > 0)
+    {
+        printf("Usage: %s", argv[0]);
+        arg_print_syntax(stdout, argtable, "\n");
+        arg_print_glossary(stdout, argtable,"  %-25s %s\n");
+        return EXIT_SUCCESS;
+    }
+    if(arg_errors > 0)
+    {
+        arg_print_errors(stderr, end, argv[0]);
+        fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned const threads = thread_count(threads_arg->ival[0]);
+    char const * const index = index_file->filename[0];
+
+    if(!is_bundle(index) || is_manifest(index))
+    {
+        fprintf(stderr, "'%s' is not an index bundle.\n", index);
+        return EXIT_FAILURE;
+    }
+    if(Mapping(reducer_path(index).c_str()))
+    {
+        fprintf(stderr, "Reduced indexes can't be updated, rebuild them with flann-train.\n");
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Loading bundle ..." << std::flush;
+
+    auto bundle = load_bundle(index);
+    if(is_binary(bundle.distance))
+    {
+        fprintf(stderr, "\nBinary indexes can't be updated, rebuild them with flann-train.\n");
+        return EXIT_FAILURE;
+    }
+    Delta delta;
+    if(!load_delta(index, bundle.train.size(), bundle.train.dim, delta))
+    {
+        delta.base_rows = bundle.train.size();
+        delta.dim = bundle.train.dim;
+    }
+
+    std::cout << " OK\n"
+        "\tdata : " << bundle.train.size() << 'x' << bundle.train.dim << ", delta " << delta.size() << " rows, "
+        << delta.deleted_count() << " deleted\n";
+
+    // -- Update --
+
+    if(append->count > 0)
+    {
+        std::cout << "Appending '" << append->filename[0] << "' ..." << std::flush;
+
+        auto rows = load(append->filename[0], threads);
+        if(rows.dim > delta.dim)
+        {
+            std::cerr << "Appended rows have " << rows.dim << " features, the index " << delta.dim << '\n';
+            return EXIT_FAILURE;
+        }
+        delta.append(rows);
+
+        std::cout << " OK\n"
+            "\tappended : " << rows.size() << " rows from " << delta.rows() - rows.size() << '\n';
+    }
+    if(remove->count > 0)
+    {
+        std::ifstream ids(remove->filename[0]);
+        if(!ids)
+        {
+            fprintf(stderr, "Can't open '%s'\n", remove->filename[0]);
+            return EXIT_FAILURE;
+        }
+        size_t count = 0;
+        for(size_t id; ids >> id; ++count)
+        {
+            if(!delta.erase(id))
+            {
+                std::cerr << "Row " << id << " is out of range [0," << delta.rows() << ")\n";
+                return EXIT_FAILURE;
+            }
+        }
+        std::cout << "\tdeleted : " << count << " rows\n";
+    }
+
+    // -- Fold --
+
+    bool const fold = (fold_now->count > 0) || (delta.size() + delta.deleted_count() > fold_ratio->dval[0]*delta.base_rows);
+    if(!fold)
+    {
+        save_delta(index, delta);
+        std::cout << "Saved delta '" << delta_path(index) << "'\n";
+        return EXIT_SUCCESS;
+    }
+
+    std::cout << "Folding ..." << std::flush;
+
+    IndexConfig config;
+    if(!config_from_params(bundle.params, config))
+        return EXIT_FAILURE;
+    auto const params = make_params(config);
+    if(!params)
+        return EXIT_FAILURE;
+
+    // surviving rows in order, bundle rows first
+    cv::Mat_<float> const base = dense(bundle.train);
+    cv::Mat_<float> const appended = delta.features();
+    cv::Mat_<float> mat(delta.rows() - delta.deleted_count(), delta.dim);
+    std::vector<double> labels;
+    labels.reserve(mat.rows);
+    for(size_t id = 0; id < delta.rows(); ++id)
+    {
+        if(delta.deleted(id))
+            continue;
+        bool const old = id < delta.base_rows;
+        float const * row = old ? base[id] : appended[id - delta.base_rows];
+        std::copy(row, row + delta.dim, mat[labels.size()]);
+        labels.push_back(old ? bundle.train.labels[id] : delta.labels[id - delta.base_rows]);
+    }
+
+    // the new bundle replaces the old one in one step, then the delta is removed
+    // - readers in between see the new bundle and ignore the delta, which records the generation of the old one
+    // - the delta is kept if the bundle can't be replaced
+    // - a flat index is rebuilt flat
+    std::string const temporary = std::string(index) + ".fold";
+    if(is_flat_index(index))
+    {
+        FlatIndex const folded = FlatIndex::build(mat, config, bundle.distance, threads);
+        save_flat_bundle(folded, mat, labels, bundle.params, temporary.c_str());
+    }
+    else
+    {
+        cv::flann::Index folded(mat, *params, static_cast<cvflann::flann_distance_t>(bundle.distance));
+        save_bundle(folded, mat, labels, bundle.params, temporary.c_str());
+    }
+    if(std::rename(temporary.c_str(), index) != 0)
+    {
+        fprintf(stderr, "Can't replace '%s'\n", index);
+        std::remove(temporary.c_str());
+        return EXIT_FAILURE;
+    }
+    std::remove(delta_path(index).c_str());
+
+    std::cout << " OK\n"
+        "\tdata : " << mat.rows << 'x' << mat.cols << ", rows are renumbered\n";
+
+    return EXIT_SUCCESS;
+}
@@ -1,8 +1,27 @@
+#include "binary.h"
+#include "bundle.h"
+#include "cache.h"
 #include "data.h"
-
+#include "delta.h"
+#include "exact.h"
+#include "flat.h"
+#include "groundtruth.h"
+#include "matrix.h"
+#include "metrics.h"
+#include "params.h"
+#include "pipeline.h"
+#include "quantize.h"
+#include "reduce.h"
+#include "search.h"
+#include "shards.h"
+#include "sparse.h"
+#include "statistics.h"
+#include "writer.h"
+
+#include <cstdio>
 #include <cstdlib>
 
-#include <fstream>
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -10,28 +29,23 @@
 #include <utility>
 
 #include <argtable2.h>
-#include <boost/accumulators/accumulators.hpp>
-#include <boost/accumulators/statistics/stats.hpp>
-#include <boost/accumulators/statistics/mean.hpp>
-#include <boost/accumulators/statistics/min.hpp>
-#include <boost/accumulators/statistics/max.hpp>
 #include <boost/dynamic_bitset.hpp>
 #include <opencv2/flann/flann.hpp>
 
 int main(int argc, char * argv[])
 {
-    struct arg_file * train_file = arg_file1("f", "features", "<filename>", "Training dataset");
-    struct arg_file * index_file = arg_file0("x", "index", "<filename>", "Training dataset index");
-    struct arg_file * output_index = arg_file0(NULL, "output-index", "<filename>", "Save used index to file");
+    struct arg_file * train_file = arg_file0("f", "features", "<filename>", "Training dataset (default from the index bundle)");
+    struct arg_file * index_file = arg_file0("x", "index", "<filename>", "Training dataset index, bundle or shard manifest");
+    struct arg_file * output_index = arg_file0(NULL, "output-index", "<filename>", "Save used index to a bundle");
     struct arg_file * input  = arg_file0("i", "input", "<filename>", "Input dataset in libsvm format");
     struct arg_file * output = arg_file0("o", "output", "<filename>", "");
     struct arg_lit * hist = arg_lit0(NULL, "hist", "");
     struct arg_lit * help   = arg_lit0("h", "help", "Print this help and exit");
     struct arg_int * verbosity = arg_int0 ("v", "verbosity", "{0..4}", "Log verbosity"
             "\nIndex parameters :");
-    struct arg_int  * distance = arg_int0("d", "distance", "{1..9}", "Distance metric"
+    struct arg_int  * distance = arg_int0("d", "distance", "{1..10}", "Distance metric"
             "\n\t1=L2 (default), 2=L1, 3=MINKOWSKI,\n\t4=MAX, 5=HIST_INTERSECT, 6=HELLLINGER,"
-            "\n\t7=CS, 8=KULLBACK_LEIBLER, 9=HAMMING");
+            "\n\t7=CS, 8=KULLBACK_LEIBLER, 9=HAMMING,\n\t10=COSINE (-t 0 only)");
     struct arg_int  * index_type = arg_int0("t", "index-type", "{0..5}", "Constructed index type"
             "\n t=0 - linear brute force search"
             "\n t=1 - kd-tree :");
@@ -51,11 +65,26 @@ int main(int argc, char * argv[])
     struct arg_dbl * auto_precision       = arg_dbl0(NULL, "auto-precision", "[0,1]", "Expected percentage of exact hits");
     struct arg_dbl * auto_build_weight    = arg_dbl0(NULL, "auto-build-weight", "", "");
     struct arg_dbl * auto_memory_weight   = arg_dbl0(NULL, "auto-memory-weight", "", "");
-    struct arg_dbl * auto_sample_fraction = arg_dbl0(NULL, "auto-sample-fraction", "[0,1]", ""
+    struct arg_dbl * auto_sample_fraction = arg_dbl0(NULL, "auto-sample-fraction", "[0,1]", "");
+    struct arg_int * reduce = arg_int0(NULL, "reduce", "k", "Index features reduced to k dimensions, queries are reranked at full precision");
+    struct arg_int * reduce_method = arg_int0(NULL, "reduce-method", "{1,2}", "1=PCA (default), 2=sparse random projection");
+    struct arg_int * storage_arg = arg_int0(NULL, "storage", "{0..2}", "Feature storage, 1 and 2 search exhaustively instead of an index"
+            "\n\t0=float (default), 1=float16, 2=int8 with per dimension scale");
+    struct arg_int * shards_arg = arg_int0(NULL, "shards", "n", "Build n shards in parallel, --output-index saves a shard manifest");
+    struct arg_int * sparse_arg = arg_int0(NULL, "sparse", "{1..3}", "Exact search in a sparse inverted index instead, rows are never densified"
+            "\n\t1=L2, 2=dot product, 3=cosine"
             "\nSearch parameters :");
-    struct arg_int * neighbors = arg_int0("n", "neighbors", "n", "Neighbor count (default 1)");
+    struct arg_str * neighbors = arg_str0("n", "neighbors", "n,..", "Neighbor counts, one statistics table each (default 1)");
     struct arg_dbl * radius    = arg_dbl0("r", "radius", "r", "Search radius, requests radius search");
-    struct arg_int * checks    = arg_int0("c", "checks", "...", "Search checks (default 32)");
+    struct arg_str * checks    = arg_str0("c", "checks", "c,..", "Search checks, one search each (default 32 or the tuned checks of the bundle)");
+    struct arg_int * rerank = arg_int0(NULL, "rerank", "m", "Candidates reranked at full precision for reduced indexes and compact storage (default 4 x n, 0 = off)");
+    struct arg_int * threads_arg = arg_int0(NULL, "threads", "{0..}", "Worker threads for loading and search (default 0 = all cores)");
+    struct arg_file * truth_file = arg_file0(NULL, "ground-truth", "<filename>", "Exact neighbor cache for recall@n, computed and saved if it doesn't match");
+    struct arg_int * folds_arg = arg_int0(NULL, "folds", "k", "Cross-validate k folds of the training rows instead of -i, folds are contiguous rows");
+    struct arg_lit * stream    = arg_lit0(NULL, "stream", "Stream the input, parse, search and output overlap in bounded memory");
+    struct arg_int * batch_arg = arg_int0(NULL, "batch", "{1..}", "Queries per search batch (default fits 64MB)");
+    struct arg_int * cache_arg = arg_int0(NULL, "cache", "MB", "Cache search results of repeated queries in MB, 0 only collapses duplicates");
+    struct arg_file * metrics_file = arg_file0(NULL, "metrics", "<filename>", "Write phase timings, memory, I/O and query latencies as JSON");
     struct arg_end * end = arg_end(20);
     void * argtable[] = {
        train_file, index_file, output_index, input, output, hist, help, verbosity,
@@ -63,7 +92,8 @@ int main(int argc, char * argv[])
        km_branching, km_iterations, km_centers, km_index,
        lsh_table_count, lsh_key_size, lsh_probe_level,
        auto_precision, auto_build_weight, auto_memory_weight, auto_sample_fraction,
-       neighbors, radius, checks, end };
+       reduce, reduce_method, storage_arg, shards_arg, sparse_arg,
+       neighbors, radius, checks, rerank, threads_arg, truth_file, folds_arg, stream, batch_arg, cache_arg, metrics_file, end };
     if(arg_nullcheck(argtable) != 0)
     {
         fprintf(stderr, "%s: insufficient memory\n", argv[0]);
@@ -85,9 +115,14 @@ int main(int argc, char * argv[])
     auto_build_weight   ->dval[0] = 0.01;
     auto_memory_weight  ->dval[0] = 0;
     auto_sample_fraction->dval[0] = 0.1;
+    // reduction
+    reduce_method->ival[0] = reduce_pca;
+    storage_arg->ival[0] = storage_float;
+    shards_arg->ival[0] = 1;
     // search
-    neighbors->ival[0] = 1;
-    checks->ival[0] = 32;
+    neighbors->sval[0] = "1";
+    checks->sval[0] = "32";
+    threads_arg->ival[0] = 0;
     // -- Parse --
     int arg_errors = arg_parse(argc, argv, argtable);
     if(help->count > 0)
@@ -106,17 +141,171 @@ int main(int argc, char * argv[])
 
     cvflann::log_verbosity(verbosity->ival[0]);
 
-    std::cout << "Loading features '" << train_file->filename[0] << "' ..." << std::flush;
+    // every check level is searched once at the largest neighbor count
+    std::vector<int> neighbor_list, check_list;
+    if(!parse_list(neighbors->sval[0], neighbor_list))
+    {
+        fprintf(stderr, "Invalid neighbor counts '%s'\n", neighbors->sval[0]);
+        return EXIT_FAILURE;
+    }
+    if(!parse_list(checks->sval[0], check_list))
+    {
+        fprintf(stderr, "Invalid checks '%s'\n", checks->sval[0]);
+        return EXIT_FAILURE;
+    }
+    if((batch_arg->count > 0) && (batch_arg->ival[0] < 1))
+    {
+        fprintf(stderr, "Invalid batch %d\n", batch_arg->ival[0]);
+        return EXIT_FAILURE;
+    }
 
-    auto train = load(train_file->filename[0]);
+    unsigned const threads = thread_count(threads_arg->ival[0]);
 
-    cv::Mat_<float> mat = cv::Mat_<float>::zeros(train.data.size(), train.dim);
+    Metrics metrics("flann");
+    LatencyHistogram * const latencies = (metrics_file->count > 0) ? &metrics.latencies : nullptr;
+
+    if((train_file->count == 0) && (index_file->count == 0))
+    {
+        fprintf(stderr, "Training features or an index bundle are required.\n");
+        return EXIT_FAILURE;
+    }
+    if((reduce->count > 0) && (index_file->count > 0))
+    {
+        fprintf(stderr, "A loaded index keeps its reduction, --reduce needs a built index.\n");
+        return EXIT_FAILURE;
+    }
+    int const storage = storage_arg->ival[0];
+    if((storage < storage_float) || (storage > storage_int8))
+    {
+        fprintf(stderr, "Invalid storage %d.\n", storage);
+        return EXIT_FAILURE;
+    }
+    if((storage != storage_float) && ((index_file->count > 0) || (output_index->count > 0) || (reduce->count > 0)))
+    {
+        fprintf(stderr, "Compact storage is searched without an index, -x, --output-index and --reduce don't apply.\n");
+        return EXIT_FAILURE;
+    }
+    bool const load_shards = (index_file->count > 0) && is_manifest(index_file->filename[0]);
+    size_t const shard_count = std::max(1, shards_arg->ival[0]);
+    bool const sharded = load_shards || (shard_count > 1);
+    if((shard_count > 1) && ((index_file->count > 0) || (reduce->count > 0) || (storage != storage_float)))
+    {
+        fprintf(stderr, "--shards builds a plain index, -x, --reduce and --storage don't apply.\n");
+        return EXIT_FAILURE;
+    }
+    if(load_shards && (storage != storage_float))
+    {
+        fprintf(stderr, "Shards are searched with their indexes, --storage doesn't apply.\n");
+        return EXIT_FAILURE;
+    }
+    bool const sparse = sparse_arg->count > 0;
+    if(sparse && ((index_file->count > 0) || (output_index->count > 0) || (reduce->count > 0)
+        || (storage != storage_float) || (shard_count > 1) || (truth_file->count > 0)))
+    {
+        fprintf(stderr, "The sparse index is built in memory and exact, -x, --output-index, --reduce, --storage, --shards and --ground-truth don't apply.\n");
+        return EXIT_FAILURE;
+    }
+    // binary features are packed for Hamming distance, a loaded bundle knows its distance
+    bool const binary = !sparse && is_binary((index_file->count > 0) ? index_distance(index_file->filename[0], distance->ival[0]) : distance->ival[0]);
+    if(binary && ((reduce->count > 0) || (storage != storage_float) || sharded))
+    {
+        fprintf(stderr, "Binary features are indexed packed, --reduce, --storage and --shards don't apply.\n");
+        return EXIT_FAILURE;
+    }
+    bool const built = (index_file->count == 0) && !sparse;
+    if(built && binary && (index_type->ival[0] != 0) && (index_type->ival[0] != 4))
+    {
+        fprintf(stderr, "Binary features are indexed by -t 0 (linear) or -t 4 (LSH).\n");
+        return EXIT_FAILURE;
+    }
+    if(built && !binary && (index_type->ival[0] == 4))
+    {
+        fprintf(stderr, "LSH indexes binary features, use -d 9.\n");
+        return EXIT_FAILURE;
+    }
+    // cosine distance has no flann index, it is searched exactly
+    bool const cosine = !sparse && (distance->ival[0] == cosine_distance);
+    if(cosine && ((index_file->count > 0) || (output_index->count > 0) || (index_type->ival[0] != 0) || (reduce->count > 0)
+        || (storage != storage_float) || (shard_count > 1) || (folds_arg->ival[0] > 1)))
+    {
+        fprintf(stderr, "Cosine distance is searched exactly with -t 0, -x, --output-index, --reduce, --storage, --shards and --folds don't apply.\n");
+        return EXIT_FAILURE;
+    }
+    // every held out fold is searched once in an index of the other folds
+    size_t const fold_count = std::max(1, folds_arg->ival[0]);
+    bool const folds = fold_count > 1;
+    if(folds && ((train_file->count == 0) || (input->count > 0) || (index_file->count > 0) || (output_index->count > 0)
+        || (reduce->count > 0) || (storage != storage_float) || (shard_count > 1) || sparse || binary
+        || (truth_file->count > 0) || (stream->count > 0)))
+    {
+        fprintf(stderr, "--folds queries the training features, only -f and index and search parameters apply.\n");
+        return EXIT_FAILURE;
+    }
+    char const * const features = (train_file->count > 0) ? train_file->filename[0] : nullptr;
+
+    std::cout << "Loading features '" << (features ? features : index_file->filename[0]) << "' ..." << std::flush;
+
+    metrics.phase("load");
+
+    std::string params_text;
+    ShardSet shards;
+    std::unique_ptr<cv::flann::IndexParams> fold_params;
+    Data train;
+    if(load_shards)
+    {
+        shards.load(index_file->filename[0], threads);
+        train = shards.train();
+        params_text = shards.params();
+    }
+    else
+    {
+        train = (index_file->count > 0) ? load_train(features, index_file->filename[0], threads, &params_text) : load(features, threads);
+    }
+
+    metrics.phase("dense");
+
+    // compact storage keeps the float rows only for ground truth, reranking reads the loaded training rows
+    int const n = *std::max_element(neighbor_list.begin(), neighbor_list.end());
+    int const candidates = (rerank->count > 0) ? rerank->ival[0] : 4*n;
+    Reduction reduction;
+    Delta delta;
+    bool has_delta = false;
+    CompactMatrix compact;
+    SparseIndex sparse_index;
+    cv::Mat_<float> mat;
+    cv::Mat packed;
+    if(storage != storage_float)
+    {
+        compact = ::compact(train, storage, threads);
+        if(truth_file->count > 0)
+            mat = dense(train);
+        if(candidates <= 0)
+            train.release_features();
+    }
+    else if(load_shards)
+    {
+        // the shard rows are only copied together for exact neighbors
+        if(truth_file->count > 0)
+            mat = shards.features();
+    }
+    else if(!sparse)
+    {
+        mat = (index_file->count > 0) ? index_features(train, index_file->filename[0], reduction, threads) : dense(train);
+        train.release_features();
+        if(binary)
+            packed = pack_bits(mat);
+
+        // appended rows of a loaded index continue the row numbers
+        has_delta = (index_file->count > 0) && load_delta(index_file->filename[0], train.size(), train.dim, delta);
+        if(has_delta)
+            train.labels.insert(train.labels.end(), delta.labels.begin(), delta.labels.end());
+    }
 
     boost::dynamic_bitset<> train_class_set;
     std::vector<size_t> train_class_hist;
-    for(size_t i = 0; i < train.data.size(); ++i)
+    for(size_t i = 0; i < train.size(); ++i)
     {
-        size_t const c = train.data[i].first;
+        size_t const c = train.labels[i];
         if(c >= train_class_set.size())
         {
             train_class_set.resize(c+1);
@@ -124,27 +313,70 @@ int main(int argc, char * argv[])
         }
         train_class_set.set(c);
         train_class_hist[c] += 1;
-
-        for(auto p : train.data[i].second)
-            mat(i, p.first-1) = p.second;
     }
 
     std::cout << " OK\n"
-        "\tdata : " << train.data.size() << 'x' << train.dim << ", " << train_class_set.count() << " classes\n";
+        "\tdata : " << train.size() << 'x' << train.dim << ", " << train_class_set.count() << " classes\n";
     if(hist->count > 0)
     {
         std::cout << "\thistogram :\n";
         for(size_t i = 0; i < train_class_set.size(); ++i)
-            std::cout << '\t' << i << " : " << train_class_hist[i] << " (" << (100.*train_class_hist[i]/train.data.size()) << "%)\n";
+            std::cout << '\t' << i << " : " << train_class_hist[i] << " (" << (100.*train_class_hist[i]/train.size()) << "%)\n";
     }
 
+    if(reduce->count > 0)
+    {
+        int const k = reduce->ival[0];
+        if((k <= 0) || (k >= mat.cols))
+        {
+            std::cerr << "Reduced dimension must be in [1," << mat.cols << ")\n";
+            return EXIT_FAILURE;
+        }
+        std::cout << "Reducing ..." << std::flush;
+        metrics.phase("reduce");
+
+        reduction.reducer = (reduce_method->ival[0] == reduce_projection) ? random_projection(mat.cols, k) : fit_pca(mat, k);
+        reduction.full = mat;
+        mat = reduction.reducer.apply(mat, threads);
+
+        std::cout << " OK\n";
+    }
+    if(has_delta)
+        std::cout << "\tdelta : " << delta.size() << " appended, " << delta.deleted_count() << " deleted\n";
+    if(binary)
+        std::cout << "\tpacked : " << packed.cols << " bytes per row\n";
+    if(reduction)
+        std::cout << "\treduced : " << reduction.full.cols << " -> " << mat.cols << '\n';
+    if(compact)
+        std::cout << "\tstorage : " << ((storage == storage_int8) ? "int8, " : "float16, ") << compact.bytes() << " bytes ("
+            << (100.*compact.bytes()/(sizeof(float)*std::max<size_t>(1, size_t(train.size())*train.dim))) << "% of float)\n";
+
     // -- Index --
 
     cv::flann::Index index;
-    if(index_file->count > 0)
+    FlatIndex flat_index;// mapped from a flat -x bundle
+    if(sparse)
+    {
+        std::cout << "Building sparse index ..." << std::flush;
+        metrics.phase("build");
+        sparse_index.build(train, sparse_arg->ival[0]);
+        train.release_features();
+    }
+    else if(compact)
+    {
+        std::cout << "Searching compact features exhaustively ..." << std::flush;
+    }
+    else if(load_shards)
+    {
+        std::cout << "Loaded " << shards.size() << " shards of '" << index_file->filename[0] << "' ..." << std::flush;
+    }
+    else if(index_file->count > 0)
     {
         std::cout << "Loading index '" << index_file->filename[0] << "' ..." << std::flush;
-        if(!index.load(mat, index_file->filename[0]))
+        metrics.phase("load_index");
+        if(is_flat_index(index_file->filename[0]))
+            flat_index = FlatIndex::load(index_file->filename[0]);
+        else if(!index.load(binary ? packed : mat, index_file->filename[0]))
         {
             fprintf(stderr, "Can't load index '%s'.\n", index_file->filename[0]);
             return EXIT_SUCCESS;
@@ -153,182 +385,404 @@ int main(int argc, char * argv[])
     else
     {
         std::cout << "Building index ..." << std::flush;
+        metrics.phase("build");
         // Parameters
-        std::unique_ptr<cv::flann::IndexParams> params;
-        switch(index_type->ival[0])
+        IndexConfig config;
+        config.type = index_type->ival[0];
+        config.kd_tree_count = kd_tree_count->ival[0];
+        config.km_branching  = km_branching ->ival[0];
+        config.km_iterations = km_iterations->ival[0];
+        config.km_centers    = km_centers   ->ival[0];
+        config.km_index      = km_index     ->dval[0];
+        config.lsh_table_count = lsh_table_count->ival[0];
+        config.lsh_key_size    = lsh_key_size   ->ival[0];
+        config.lsh_probe_level = lsh_probe_level->ival[0];
+        config.auto_precision       = auto_precision      ->dval[0];
+        config.auto_build_weight    = auto_build_weight   ->dval[0];
+        config.auto_memory_weight   = auto_memory_weight  ->dval[0];
+        config.auto_sample_fraction = auto_sample_fraction->dval[0];
+        auto params = make_params(config);
+        if(!params)
+            return EXIT_FAILURE;
+        params_text = describe(*params);
+        if(folds)
         {
-            case 0 : // linear brute force search
-                params = std::make_unique<cv::flann::LinearIndexParams>();
-                break;
-            case 1 : // k-d tree
-                params = std::make_unique<cv::flann::KDTreeIndexParams>(
-                    kd_tree_count->ival[0]);
-                break;
-            case 2 : // k-means 
-                params = std::make_unique<cv::flann::KMeansIndexParams>(
-                    km_branching ->ival[0],
-                    km_iterations->ival[0],
-                    static_cast<cvflann::flann_centers_init_t>(km_centers->ival[0]),
-                    km_index->dval[0]);
-                break;
-            case 3 : // k-d tree + k-means
-                params = std::make_unique<cv::flann::CompositeIndexParams>(
-                    kd_tree_count->ival[0],
-                    km_branching ->ival[0],
-                    km_iterations->ival[0],
-                    static_cast<cvflann::flann_centers_init_t>(km_centers->ival[0]),
-                    km_index->dval[0]);
-                break;
-            case 4 : // lsh
-                if((lsh_table_count->count == 0) || (lsh_key_size == 0) || (lsh_probe_level == 0))
-                {
-                    std::cerr << "For t=4, lsh-table-count, lsh-key-size and lsh-probe-level must be set.\n";
-                    return EXIT_FAILURE;
-                }
-                params = std::make_unique<cv::flann::LshIndexParams>(
-                    lsh_table_count->ival[0],
-                    lsh_key_size   ->ival[0],
-                    lsh_probe_level->ival[0]);
-                break;
-            case 5 : // autotuned index
-                params = std::make_unique<cv::flann::AutotunedIndexParams>(
-                    auto_precision      ->dval[0],
-                    auto_build_weight   ->dval[0],
-                    auto_memory_weight  ->dval[0],
-                    auto_sample_fraction->dval[0]);
-                break;
-            default :
-                std::cerr << "Unknown index type " << index_type->ival[0] << std::endl;
-                return EXIT_FAILURE;
+            // the fold indexes are built one at a time while cross-validating
+            fold_params = std::move(params);
+        }
+        else if(sharded)
+        {
+            // unchanged shards of an existing output manifest are kept
+            char const * const reuse = ((output_index->count > 0) && is_manifest(output_index->filename[0])) ? output_index->filename[0] : nullptr;
+            shards.build(mat, train.labels, *params, params_text, distance->ival[0], shard_count, threads, reuse);
+        }
+        else if(!cosine)
+        {
+            index.build(binary ? packed : mat, *params, static_cast<cvflann::flann_distance_t>(distance->ival[0]));
         }
-        index.build(mat, *params, static_cast<cvflann::flann_distance_t>(distance->ival[0]));
     }
     std::cout << " OK\n";
+    if(sharded && !load_shards)
+        std::cout << "\trebuilt : " << shards.built() << " of " << shard_count << " shards\n";
+    if(folds)
+        std::cout << "\tfolds : " << fold_count << " of " << (mat.rows/fold_count) << " to " << ((mat.rows+fold_count-1)/fold_count) << " rows\n";
+    if(sparse)
+        std::cout << "\tpostings : " << sparse_index.postings() << ", " << sparse_index.bytes() << " bytes\n";
 
     if(output_index->count > 0)
     {
         std::cout << "Saving index '" << output_index->filename[0] << "' ..." << std::flush;
-        index.save(output_index->filename[0]);
+        metrics.phase("save");
+        if(sharded)
+            shards.save(output_index->filename[0], threads);
+        else if(flat_index)
+            save_flat_bundle(flat_index, mat, train.labels, params_text, output_index->filename[0]);
+        else
+            save_bundle(index, mat, train.labels, params_text, output_index->filename[0]);
+        if(reduction)
+            save_reduction(reduction.reducer, reduction.full, reducer_path(output_index->filename[0]).c_str());
+        else
+            std::remove(reducer_path(output_index->filename[0]).c_str());
         std::cout << " OK\n";
     }
 
     // -- Query --
 
-    if(input->count > 0)
+    if((input->count > 0) || folds)
     {
-        std::cout << "Loading query '" << input->filename[0] << "' ..." << std::flush;
-
-        auto test = load(input->filename[0]);
-
-        boost::dynamic_bitset<> test_class_set(train_class_set.size());
-        std::vector<size_t> test_class_hist(train_class_set.size());
-        for(size_t i = 0; i < test.data.size(); ++i)
+        Writer file;
+        if(output->count > 0)
         {
-            size_t const c = test.data[i].first;
-            if(c >= test_class_set.size())
+            if(!file.open(output->filename[0]))
             {
-                test_class_set.resize(c+1);
-                test_class_hist.resize(c+1, 0);
+                fprintf(stderr, "Can't open output file '%s'\n", output->filename[0]);
+                return EXIT_FAILURE;
             }
-            test_class_set.set(c);
-            test_class_hist[c] += 1;
         }
 
-        std::cout << " OK\n"
-            "\tdata : " << test.data.size() << 'x' << test.dim << ", " << test_class_set.count() << " classes\n";
-        if(!test_class_set.is_subset_of(train_class_set))
-            std::cout << "\t!!! " << (test_class_set-train_class_set).count() << " test classes not in training data\n";
-        //std::cout << "\thistogram :\n";
-        //for(size_t i = 0; i < test_class_set.size(); ++i)
-        //    std::cout << '\t' << i << " : " << test_class_hist[i] << " (" << (100.*test_class_hist[i]/test.data.size()) << "%)\n";
-
-        std::cout << "Searching ..." << std::flush;
+        // the checks of a tuned bundle unless -c is given
+        if(checks->count == 0)
+            check_list.assign(1, checks_from_params(params_text, check_list[0]));
+        Query query{n, (radius->count > 0) ? radius->dval[0] : -1.0, check_list[0]};
+        // queries are searched at full precision, exact neighbors include the appended rows
+        cv::Mat_<float> const full = (has_delta && (truth_file->count > 0)) ? with_delta(reduction ? reduction.full : mat, delta)
+            : reduction ? reduction.full : mat;
+        int const cols = sparse ? sparse_index.dim() : compact ? compact.dim : sharded ? shards.dim() : full.cols;
+        int const dist_type = (sparse || compact || cosine) ? distance->ival[0] : sharded ? shards.distance()
+            : flat_index ? flat_index.distance() : index.getDistance();
+        // a linear index is searched by the blocked exact engine
+        std::unique_ptr<ExactEngine> exact_engine;
+        if(!sparse && !compact && !sharded && !binary && exact_supported(dist_type)
+            && (cosine || (flat_index ? (flat_index.type() == 0) : (index.getAlgorithm() == cvflann::FLANN_INDEX_LINEAR))))
+            exact_engine = std::make_unique<ExactEngine>(mat, dist_type);
+        std::unique_ptr<FlatEngine> flat_engine;
+        if(flat_index && !exact_engine)
+            flat_engine = std::make_unique<FlatEngine>(flat_index, mat);
+        FlannEngine flann_engine(index);
+        Engine & base_engine = exact_engine ? static_cast<Engine &>(*exact_engine) : flat_engine ? static_cast<Engine &>(*flat_engine) : flann_engine;
+        SparseEngine sparse_engine(sparse_index);
+        std::unique_ptr<Engine> wrapped_engine;
+        if(reduction)
+            wrapped_engine = std::make_unique<RerankEngine>(base_engine, reduction, candidates, dist_type);
+        else if(binary)
+            wrapped_engine = std::make_unique<BinaryEngine>(index);
+        else if(compact)
+            wrapped_engine = std::make_unique<CompactEngine>(compact, dist_type, (candidates > 0) ? &train : nullptr, candidates);
+        else if(sharded)
+            wrapped_engine = std::make_unique<ShardedEngine>(shards);
+        Engine & index_engine = sparse ? sparse_engine : wrapped_engine ? *wrapped_engine : base_engine;
+        if(exact_engine)
+            std::cout << "\texact search : " << exact_engine->kernel() << " kernel\n";
+        std::unique_ptr<Engine> delta_engine;
+        if(has_delta)
+            delta_engine = std::make_unique<DeltaEngine>(index_engine, delta, dist_type);
+        Engine & uncached_engine = delta_engine ? *delta_engine : index_engine;
+        // repeated queries are answered from the result cache
+        std::unique_ptr<CacheEngine> cache_engine;
+        if(cache_arg->count > 0)
+            cache_engine = std::make_unique<CacheEngine>(uncached_engine, size_t(std::max(0, cache_arg->ival[0])) << 20);
+        Engine & engine = cache_engine ? *cache_engine : uncached_engine;
+
+        StatisticsSweep sweep(check_list, neighbor_list, train_class_set.size());
+        bool written = true;
+
+        std::unique_ptr<GroundTruth> truth;
+        if(truth_file->count > 0)
+            truth = std::make_unique<GroundTruth>(truth_file->filename[0], full, n, dist_type, threads);
+
+        // Adds search results of count queries from row first to the statistics of a check level,
+        // the first check level goes to the output
+        size_t level = 0;
+        auto const consume = [&](size_t first, double const * labels, size_t count, cv::Mat_<int> const & indices)
+        {
+            for(size_t i = 0; i < count; ++i)
+            {
+                int const * row = indices[i];
+                auto const matching_neighbors = sweep.add(level, labels[i], row, train);
+                if(file && (level == 0))
+                {
+                    file << labels[i];
+                    for(int j = 0; j < n; ++j)
+                        if(row[j] >= 0)
+                            file << ' ' << row[j] << ':' << train.labels[row[j]];
+                    file << ' ' << matching_neighbors << '\n';
+                }
+            }
+            if(truth)
+                for(size_t i = 0; i < neighbor_list.size(); ++i)
+                    sweep.recalls[level*neighbor_list.size() + i] += truth->recall_sum(indices.rowRange(0, count), first, neighbor_list[i]);
+        };
 
-        cv::flann::SearchParams const params{checks->ival[0]};
+        // sparse queries are only densified when streamed
+        size_t batch = (batch_arg->count > 0) ? batch_arg->ival[0] : batch_rows((sparse && (stream->count == 0)) ? 1 : cols, threads);
 
-        std::ofstream file;
-        if(output->count > 0)
+        if(folds)
         {
-            file.open(output->filename[0]);
-            if(!file)
+            std::cout << "Cross-validating ..." << std::flush;
+
+            // the index of the other folds holds a copy of their rows, it is built right before
+            // the held out rows are searched at every check level, results are in row order
+            cv::Mat_<int  > indices;
+            cv::Mat_<float> dists;
+            for(size_t s = 0; s < fold_count; ++s)
             {
-                fprintf(stderr, "Can't open output file '%s'\n", output->filename[0]);
-                return EXIT_FAILURE;
+                size_t const first = mat.rows*s/fold_count;
+                size_t const rows = mat.rows*(s+1)/fold_count - first;
+                size_t const last = first + rows;
+                cv::Mat_<float> const fold = mat.rowRange(first, last);
+
+                metrics.phase("build");
+                cv::Mat_<float> others(mat.rows - rows, mat.cols);
+                cv::Mat_<float> before = others.rowRange(0, first);
+                cv::Mat_<float> after = others.rowRange(first, others.rows);
+                mat.rowRange(0, first).copyTo(before);
+                mat.rowRange(last, mat.rows).copyTo(after);
+                cv::flann::Index fold_index;
+                fold_index.build(others, *fold_params, static_cast<cvflann::flann_distance_t>(distance->ival[0]));
+                FlannEngine fold_engine(fold_index);
+
+                metrics.phase("search");
+                for(level = 0; level < check_list.size(); ++level)
+                {
+                    query.checks = check_list[level];
+                    search(fold_engine, fold, indices, dists, query, threads, latencies);
+                    // rows of the other folds past the held out one are shifted by its size
+                    for(size_t r = 0; r < rows; ++r)
+                        for(int j = 0; j < indices.cols; ++j)
+                            if(indices(r, j) >= int(first))
+                                indices(r, j) += rows;
+                    consume(first, train.labels.data()+first, rows, indices);
+
+                    for(size_t i = 0; i < neighbor_list.size(); ++i)
+                    {
+                        Statistics fold_stat(neighbor_list[i], train_class_set.size());
+                        for(size_t r = 0; r < rows; ++r)
+                            fold_stat.add(train.labels[first+r], indices[r], train);
+                        sweep.folds[level*neighbor_list.size() + i].add(fold_stat);
+                    }
+                }
             }
+            written = file.close();
+            metrics.end();
+
+            std::cout << " OK\n"
+                "\tdata : " << sweep.tables[0].count << " queries in " << sweep.folds[0].folds << " folds\n";
+        }
+        else if(stream->count > 0)
+        {
+            std::cout << "Streaming query '" << input->filename[0] << "' ..." << std::flush;
+            metrics.phase("search");
+
+            // the input is read once, the stream searches the first check level and every batch is
+            // searched again at the other levels, so it can be a pipe
+            query.checks = check_list[0];
+            size_t first = 0;
+            cv::Mat_<int  > indices;
+            cv::Mat_<float> dists;
+            stream_search(input->filename[0], batch, engine, query, cols, threads, [&](QueryBatch const & b)
+            {
+                size_t const count = b.data.size();
+                cv::Mat_<float> const queries = b.queries.rowRange(0, count);
+                if(truth)
+                    truth->add(queries, b.indices.rowRange(0, count));
+                level = 0;
+                consume(first, b.data.labels.data(), count, b.indices);
+                for(level = 1; level < check_list.size(); ++level)
+                {
+                    Query level_query = query;
+                    level_query.checks = check_list[level];
+                    search(engine, queries, indices, dists, level_query, threads, latencies);
+                    consume(first, b.data.labels.data(), count, indices);
+                }
+                first += count;
+            }, latencies);
+            written = file.close();
+
+            auto const test_class_set = sweep.tables[0].class_set();
+            std::cout << " OK\n"
+                "\tdata : " << sweep.tables[0].count << " queries, " << test_class_set.count() << " classes\n";
+            if(!test_class_set.is_subset_of(train_class_set))
+                std::cout << "\t!!! " << (test_class_set-train_class_set).count() << " test classes not in training data\n";
         }
+        else
+        {
+            std::cout << "Loading query '" << input->filename[0] << "' ..." << std::flush;
+            metrics.phase("load_query");
 
-        auto const n = neighbors->ival[0];
-        std::vector<size_t> match_counts(n, 0);
-        std::vector<size_t> cumulative_match_counts(n, 0);
-        std::vector<size_t> match_hist(n+1, 0);
+            auto test = load(input->filename[0], threads);
 
-        namespace acc = boost::accumulators;
-        
-        std::vector<acc::accumulator_set<double, acc::stats<
-            acc::tag::mean, acc::tag::min, acc::tag::max>>> class_matches(test_class_set.size());
+            if(truth)
+                truth->expect(test);
 
-        for(size_t i = 0; i < test.data.size(); ++i)
-        {
-            std::vector<float> query(test.dim, 0);
-            std::vector<int  > indices(n);
-            std::vector<float> dists(n);
-
-            for(auto p : test.data[i].second)
-                query[p.first-1] = p.second;
-
-            if(radius->count > 0)
-                index.radiusSearch(query, indices, dists, radius->dval[0], n, params);
-            else
-                index.knnSearch(query, indices, dists, n, params);
-
-            unsigned matching_neighbors = 0;
-            bool found = false;
-            file << test.data[i].first;
-            for(int j = 0; j < n; ++j)
+            boost::dynamic_bitset<> test_class_set(train_class_set.size());
+            std::vector<size_t> test_class_hist(train_class_set.size());
+            for(size_t i = 0; i < test.size(); ++i)
             {
-                file << ' ' << indices[j] << ':' << train.data[indices[j]].first;
-                bool ok = abs(test.data[i].first - train.data[indices[j]].first) < 0.1;
-                if(ok)
+                size_t const c = test.labels[i];
+                if(c >= test_class_set.size())
                 {
-                    ++matching_neighbors;
-                    ++match_counts[j];
+                    test_class_set.resize(c+1);
+                    test_class_hist.resize(c+1, 0);
                 }
-                found = found || ok;
-                if(found)
-                    ++cumulative_match_counts[j];
+                test_class_set.set(c);
+                test_class_hist[c] += 1;
             }
-            file << ' ' << matching_neighbors << std::endl;
 
-            ++match_hist[matching_neighbors];
+            std::cout << " OK\n"
+                "\tdata : " << test.size() << 'x' << test.dim << ", " << test_class_set.count() << " classes\n";
+            if(!test_class_set.is_subset_of(train_class_set))
+                std::cout << "\t!!! " << (test_class_set-train_class_set).count() << " test classes not in training data\n";
+            //std::cout << "\thistogram :\n";
+            //for(size_t i = 0; i < test_class_set.size(); ++i)
+            //    std::cout << '\t' << i << " : " << test_class_hist[i] << " (" << (100.*test_class_hist[i]/test.size()) << "%)\n";
+
+            std::cout << "Searching ..." << std::flush;
+            metrics.phase("search");
+
+            // Queries are searched in parallel batches, results are consumed in order
+            // - the batch buffers are allocated once
+            batch = std::min(test.size(), batch);
+            cv::Mat_<float> queries(sparse ? 0 : batch, cols);
+            cv::Mat_<int  > indices(batch, n);
+            cv::Mat_<float> dists(batch, n);
+            for(level = 0; level < check_list.size(); ++level)
+            {
+                query.checks = check_list[level];
+                for(size_t begin = 0; begin < test.size(); begin += batch)
+                {
+                    size_t const end = std::min(test.size(), begin+batch);
+                    if(sparse)
+                    {
+                        search(sparse_engine, test, begin, end, indices, dists, query, threads, latencies);
+                        consume(begin, test.labels.data()+begin, end-begin, indices);
+                        continue;
+                    }
+                    cv::Mat_<float> const batch_queries = queries.rowRange(0, end-begin);
+                    for(size_t i = begin; i < end; ++i)
+                        densify(test, i, queries[i-begin], cols);
+
+                    search(engine, batch_queries, indices, dists, query, threads, latencies);
+
+                    if(truth && (level == 0))
+                        truth->add(batch_queries, indices.rowRange(0, end-begin));
+
+                    consume(begin, test.labels.data()+begin, end-begin, indices);
+                }
+            }
+            written = file.close();
+            metrics.end();
 
-            class_matches[test.data[i].first](matching_neighbors);
+            std::cout << " OK\n";
         }
-        std::cout << " OK\n";
-
-        auto const count = test.data.size();
 
-        for(int i = 0; i < n; ++i)
+        if(!written)
         {
-            std::cout << i << " : " << match_counts[i] << ", total " << cumulative_match_counts[i]
-                << " (" << (100.*match_counts[i]/count) << "%, " << (100.*cumulative_match_counts[i]/count) << "%)\n";
-        }
-        for(int i = 0; i < (n+1); ++i)
-        {
-            std::cout << i << " : " << match_hist[i] << " (" << (100.*match_hist[i]/count) << "%)\n";
+            fprintf(stderr, "Can't write output file '%s'\n", output->filename[0]);
+            return EXIT_FAILURE;
         }
 
-        std::cout << "Class matches :\n";
-        for(size_t i = 0; i < class_matches.size(); ++i)
+        bool const truth_ok = truth && truth->finish();
+        if(truth && !truth_ok)
+            std::cout << "!!! ground truth '" << truth_file->filename[0] << "' is for other queries\n";
+        if(cache_engine)
+            std::cout << "Result cache : " << cache_engine->hits() << " hits, " << cache_engine->duplicates() << " duplicates, "
+                << cache_engine->misses() << " misses, " << cache_engine->evictions() << " evictions\n";
+
+        namespace acc = boost::accumulators;
+
+        // one report per check level and neighbor count, headed when there are several
+        for(level = 0; level < check_list.size(); ++level)
         {
-            auto const cnt = acc::count(class_matches[i]);
-            if(cnt > 0)
+            for(size_t table = 0; table < neighbor_list.size(); ++table)
             {
-                auto const mean = acc::mean(class_matches[i]);
-                std::cout << i << " : " << cnt << " (" << (100.*cnt/count) << "%) - "
-                    << mean << " (" << (100.*mean/n)
-                    << "%) in [" << acc::min(class_matches[i]) << ',' << acc::max(class_matches[i]) << "]\n";
+                int const n = neighbor_list[table];
+                auto const & stats = sweep.table(level, table);
+                auto const & fold_stats = sweep.folds[level*neighbor_list.size() + table];
+                auto const count = stats.count;
+
+                if(sweep.size() > 1)
+                    std::cout << "-- checks " << check_list[level] << ", n " << n << " --\n";
+
+                for(int i = 0; i < n; ++i)
+                {
+                    std::cout << i << " : " << stats.match_counts[i] << ", total " << stats.cumulative_match_counts[i]
+                        << " (" << (100.*stats.match_counts[i]/count) << "%, " << (100.*stats.cumulative_match_counts[i]/count) << "%)\n";
+                }
+                for(int i = 0; i < (n+1); ++i)
+                {
+                    std::cout << i << " : " << stats.match_hist[i] << " (" << (100.*stats.match_hist[i]/count) << "%)\n";
+                }
+
+                if(folds)
+                {
+                    // match rates in %, variance in %^2 across folds
+                    std::cout << "Folds mean (variance) :\n";
+                    for(int i = 0; i < n; ++i)
+                    {
+                        auto const & rate = fold_stats.match_rates[i];
+                        auto const & cumulative = fold_stats.cumulative_match_rates[i];
+                        std::cout << i << " : " << (100.*acc::mean(rate)) << "% (" << (1e4*acc::variance(rate)) << "), total "
+                            << (100.*acc::mean(cumulative)) << "% (" << (1e4*acc::variance(cumulative)) << ")\n";
+                    }
+                    for(int i = 0; i < (n+1); ++i)
+                    {
+                        auto const & rate = fold_stats.hist_rates[i];
+                        std::cout << i << " : " << (100.*acc::mean(rate)) << "% (" << (1e4*acc::variance(rate)) << ")\n";
+                    }
+                    std::cout << "Folds class matches :\n";
+                    for(size_t i = 0; i < fold_stats.class_matches.size(); ++i)
+                    {
+                        auto const & class_matches = fold_stats.class_matches[i];
+                        if(acc::count(class_matches) > 0)
+                            std::cout << i << " : " << acc::mean(class_matches) << " (" << acc::variance(class_matches) << ") in "
+                                << acc::count(class_matches) << " folds\n";
+                    }
+                }
+
+                if(truth_ok)
+                {
+                    std::cout << "Recall@" << n << " : " << ((count > 0) ? sweep.recalls[level*neighbor_list.size() + table]/count : 0.0)
+                        << (truth->cached() ? " (cached ground truth)\n" : " (ground truth saved)\n");
+                }
+
+                std::cout << "Class matches :\n";
+                for(size_t i = 0; i < stats.class_matches.size(); ++i)
+                {
+                    auto const & class_matches = stats.class_matches[i];
+                    auto const cnt = acc::count(class_matches);
+                    if(cnt > 0)
+                    {
+                        auto const mean = acc::mean(class_matches);
+                        std::cout << i << " : " << cnt << " (" << (100.*cnt/count) << "%) - "
+                            << mean << " (" << (100.*mean/n)
+                            << "%) in [" << acc::min(class_matches) << ',' << acc::max(class_matches) << "]\n";
+                    }
+                }
             }
         }
     }
+    if(metrics_file->count > 0)
+        metrics.write(metrics_file->filename[0]);
+
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,877 @@
+#ifndef FLAT_INDEX_H_INCLUDED
+#define FLAT_INDEX_H_INCLUDED
+
+#include "bundle.h"
+#include "data.h"
+#include "mapping.h"
+#include "params.h"
+#include "search.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+// -- Flat index --
+//
+// Linear, kd-tree, k-means and composite indexes built here instead of by flann and stored as flat arrays,
+// searched in place from a read-only mapping of the file. Loading maps the file and checks the nodes once,
+// nothing is copied, and the processes that search the same index share one copy in the page cache.
+// Native endian :
+//  header  : FlatHeader
+//  roots   : int32 root node of every kd-tree
+//  kd      : KdNode of all kd-trees
+//  km      : KmNode of the k-means tree, node 0 is the root, the children of a node are consecutive
+//  centers : float cluster center of every k-means node, dim floats each
+//  indices : int32 rows of the leaves, one permutation of all rows per kd-tree and one for the k-means tree
+// Every array is at a multiple of 64 bytes, offsets are from the header. The index is the first part
+// of a bundle instead of cv::flann::Index::save output, the bundle's features are the searched rows.
+// Build and search follow flann : randomized kd-trees split at the mean of a random high variance
+// dimension and are searched best bin first, k-means clusters are searched by distance to their centers
+// less km-index times their variance, and checks bound the rows compared.
+
+char const flat_magic[8] = {'F','L','A','N','N','F','L','T'};
+
+struct FlatHeader
+{
+    char magic[8];
+    uint32_t version;
+    int32_t type;// IndexConfig type, 0..3
+    int32_t distance;
+    int32_t dim;
+    uint64_t rows;
+    int32_t trees;
+    int32_t branching;
+    float cb_index;
+    uint32_t reserved;
+    uint64_t roots;
+    uint64_t kd;
+    uint64_t kd_count;
+    uint64_t km;
+    uint64_t km_count;
+    uint64_t centers;
+    uint64_t indices;
+    uint64_t index_count;
+    uint64_t size;// of the whole index
+};
+
+// Leaf when feature < 0, with rows [lower, upper) of indices
+struct KdNode
+{
+    int32_t feature;// split dimension
+    float value;// split value, rows below go to lower
+    int32_t lower;
+    int32_t upper;
+};
+
+// Leaf when children == 0, with rows [first, last) of indices
+struct KmNode
+{
+    int32_t first_child;
+    int32_t children;
+    int32_t first;
+    int32_t last;
+    float radius;// largest distance of a row to the center
+    float variance;// mean distance of the rows to the center
+};
+
+inline bool flat_supported(int distance)
+{
+    return (distance == cvflann::FLANN_DIST_L2) || (distance == cvflann::FLANN_DIST_L1);
+}
+
+inline bool flat_supported(IndexConfig const & config)
+{
+    return (config.type >= 0) && (config.type <= 3);
+}
+
+inline bool is_flat_index(char const * filename)
+{
+    char magic[sizeof(flat_magic)] = {};
+    std::ifstream file(filename, std::ios::binary);
+    file.read(magic, sizeof(magic));
+    return file && (memcmp(magic, flat_magic, sizeof(flat_magic)) == 0);
+}
+
+// Distances as flann reports them, L2 is squared
+struct FlatL2
+{
+    static float distance(float const * a, float const * b, int dim)
+    {
+        float sum[4] = {0, 0, 0, 0};
+        int j = 0;
+        for(; j + 4 <= dim; j += 4)
+            for(int l = 0; l < 4; ++l)
+                sum[l] += (a[j+l]-b[j+l])*(a[j+l]-b[j+l]);
+        for(; j < dim; ++j)
+            sum[0] += (a[j]-b[j])*(a[j]-b[j]);
+        return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    }
+
+    // contribution of one dimension
+    static float accum(float a, float b)
+    {
+        return (a-b)*(a-b);
+    }
+};
+
+struct FlatL1
+{
+    static float distance(float const * a, float const * b, int dim)
+    {
+        float sum[4] = {0, 0, 0, 0};
+        int j = 0;
+        for(; j + 4 <= dim; j += 4)
+            for(int l = 0; l < 4; ++l)
+                sum[l] += std::abs(a[j+l]-b[j+l]);
+        for(; j < dim; ++j)
+            sum[0] += std::abs(a[j]-b[j]);
+        return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    }
+
+    static float accum(float a, float b)
+    {
+        return std::abs(a-b);
+    }
+};
+
+class FlatIndex
+{
+public:
+    // per thread search buffers, reused between searches
+    struct Scratch
+    {
+        std::vector<uint64_t> checked;// rows compared to the query, the trees share rows
+        std::vector<size_t> touched;// checked words to clear
+        std::vector<std::pair<float, int>> heap;
+        std::vector<std::pair<float, int>> results;
+        std::vector<float> domain;
+    };
+
+    FlatIndex() = default;
+    FlatIndex(FlatIndex &&) = default;
+    FlatIndex & operator=(FlatIndex &&) = default;
+    FlatIndex(FlatIndex const &) = delete;
+    FlatIndex & operator=(FlatIndex const &) = delete;
+
+    // Maps an index file, the index is used in place
+    static FlatIndex load(char const * filename)
+    {
+        FlatIndex index;
+        index.m_mapping = std::make_shared<Mapping const>(filename);
+        index.m_base = index.m_mapping->data();
+        FlatHeader const * header = index.m_base ? &index.header() : nullptr;
+        size_t const size = index.m_mapping->size();
+        auto const fits = [&](uint64_t offset, uint64_t count, size_t item)
+        {
+            return (offset % 64 == 0) && (offset <= header->size) && (count <= (header->size - offset)/item);
+        };
+        if(!header || (size < sizeof(FlatHeader)) || (memcmp(header->magic, flat_magic, sizeof(flat_magic)) != 0)
+            || (header->version != 1) || (header->type < 0) || (header->type > 3) || !flat_supported(header->distance)
+            || (header->dim <= 0) || (header->rows > uint64_t(std::numeric_limits<int32_t>::max()))
+            || (header->size > size) || !fits(header->roots, header->trees, sizeof(int32_t))
+            || !fits(header->kd, header->kd_count, sizeof(KdNode)) || !fits(header->km, header->km_count, sizeof(KmNode))
+            || !fits(header->centers, header->km_count, size_t(header->dim)*sizeof(float))
+            || !fits(header->indices, header->index_count, sizeof(int32_t)) || !index.valid_nodes())
+        {
+            std::cerr << "Invalid flat index '" << filename << "'\n";
+            throw std::runtime_error("");
+        }
+        return index;
+    }
+
+    explicit operator bool() const { return m_base != nullptr; }
+
+    FlatHeader const & header() const { return *reinterpret_cast<FlatHeader const *>(m_base); }
+    int type() const { return header().type; }
+    int distance() const { return header().distance; }
+    int dim() const { return header().dim; }
+    size_t rows() const { return header().rows; }
+    size_t size() const { return header().size; }
+    char const * data() const { return m_base; }
+
+    // Builds the index of the rows of mat, kd-trees are built in parallel on threads workers
+    static FlatIndex build(cv::Mat_<float> const & mat, IndexConfig const & config, int distance, unsigned threads)
+    {
+        if(!flat_supported(config) || !flat_supported(distance))
+        {
+            std::cerr << "Flat indexes support index types 0 to 3 and distances 1 and 2\n";
+            throw std::runtime_error("");
+        }
+        return (distance == cvflann::FLANN_DIST_L2) ? build<FlatL2>(mat, config, distance, threads)
+            : build<FlatL1>(mat, config, distance, threads);
+    }
+
+    // Searches one query, missing neighbors are -1
+    // - checks <= 0 searches the trees exhaustively
+    void search(float const * query, cv::Mat_<float> const & rows, int n, double radius, int checks,
+        int * indices, float * dists, Scratch & scratch) const
+    {
+        if(distance() == cvflann::FLANN_DIST_L2)
+            search<FlatL2>(query, rows, n, radius, checks, indices, dists, scratch);
+        else
+            search<FlatL1>(query, rows, n, radius, checks, indices, dists, scratch);
+    }
+
+private:
+    template<class T>
+    T const * array(uint64_t offset) const
+    {
+        return reinterpret_cast<T const *>(m_base + offset);
+    }
+
+    // Checks that searches stay within the arrays and end, children come after their parent
+    bool valid_nodes() const
+    {
+        FlatHeader const & h = header();
+        int64_t const kd_count = h.kd_count, km_count = h.km_count, index_count = h.index_count;
+        if(((h.type == 1) || (h.type == 3)) && ((h.trees <= 0) || (kd_count == 0)))
+            return false;
+        if(((h.type == 2) || (h.type == 3)) && (km_count == 0))
+            return false;
+
+        int32_t const * const roots = array<int32_t>(h.roots);
+        for(int t = 0; t < h.trees; ++t)
+            if((roots[t] < 0) || (roots[t] >= kd_count))
+                return false;
+
+        // internal nodes hold child node ids, leaves a range of indices
+        KdNode const * const kd = array<KdNode>(h.kd);
+        for(int64_t i = 0; i < kd_count; ++i)
+        {
+            KdNode const & n = kd[i];
+            bool const valid = (n.feature < 0)
+                ? (n.lower >= 0) && (n.lower <= n.upper) && (n.upper <= index_count)
+                : (n.feature < h.dim) && (n.lower > i) && (n.lower < kd_count) && (n.upper > i) && (n.upper < kd_count);
+            if(!valid)
+                return false;
+        }
+
+        KmNode const * const km = array<KmNode>(h.km);
+        for(int64_t i = 0; i < km_count; ++i)
+        {
+            KmNode const & n = km[i];
+            if((n.first < 0) || (n.first > n.last) || (n.last > index_count) || (n.children < 0))
+                return false;
+            if((n.children > 0) && ((n.first_child <= i) || (int64_t(n.first_child) + n.children > km_count)))
+                return false;
+        }
+
+        int32_t const * const indices = array<int32_t>(h.indices);
+        for(int64_t i = 0; i < index_count; ++i)
+            if((indices[i] < 0) || (uint64_t(indices[i]) >= h.rows))
+                return false;
+        return true;
+    }
+
+    // -- Build --
+
+    // Splits the rows of a kd-tree, rows [first, first+count) of indices are at rows
+    // - a stack instead of recursion, unbalanced splits can make deep trees
+    static void build_kd(std::vector<KdNode> & nodes, cv::Mat_<float> const & mat, int32_t * rows, int32_t first, int32_t count, std::mt19937 & random)
+    {
+        int const dim = mat.cols;
+        std::vector<double> mean(dim), variance(dim);
+        std::vector<int> order(dim);
+        std::vector<int> stack;
+        nodes.push_back(KdNode{-1, 0.0f, first, first + count});
+        stack.push_back(nodes.size()-1);
+        while(!stack.empty())
+        {
+            int const node = stack.back();
+            stack.pop_back();
+            int32_t const begin = nodes[node].lower;
+            int32_t const size = nodes[node].upper - begin;
+            if(size <= 1)
+                continue;
+            int32_t * const part = rows + (begin - first);
+
+            // mean and variance over the first rows, the rows are in random order
+            int const samples = std::min(size, 100);
+            std::fill(mean.begin(), mean.end(), 0.0);
+            std::fill(variance.begin(), variance.end(), 0.0);
+            for(int i = 0; i < samples; ++i)
+                for(int j = 0; j < dim; ++j)
+                    mean[j] += mat(part[i], j);
+            for(int j = 0; j < dim; ++j)
+                mean[j] /= samples;
+            for(int i = 0; i < samples; ++i)
+                for(int j = 0; j < dim; ++j)
+                    variance[j] += (mat(part[i], j) - mean[j])*(mat(part[i], j) - mean[j]);
+
+            // a random one of the 5 highest variance dimensions
+            std::iota(order.begin(), order.end(), 0);
+            int const top = std::min(dim, 5);
+            std::partial_sort(order.begin(), order.begin()+top, order.end(), [&](int a, int b) { return variance[a] > variance[b]; });
+            int const feature = order[std::uniform_int_distribution<int>(0, top-1)(random)];
+            float const value = mean[feature];
+
+            // rows below, equal to and above the value, equal rows balance the split
+            int32_t * const end = part + size;
+            int32_t * const equal = std::partition(part, end, [&](int32_t r) { return mat(r, feature) < value; });
+            int32_t * const above = std::partition(equal, end, [&](int32_t r) { return !(mat(r, feature) > value); });
+            int const lim1 = equal - part, lim2 = above - part;
+            int split = (lim1 > size/2) ? lim1 : (lim2 < size/2) ? lim2 : size/2;
+            if((lim1 == size) || (lim2 == 0))
+                split = size/2;
+
+            int const lower = nodes.size();
+            nodes.push_back(KdNode{-1, 0.0f, begin, begin + split});
+            nodes.push_back(KdNode{-1, 0.0f, begin + split, begin + size});
+            nodes[node] = KdNode{feature, value, lower, lower + 1};
+            stack.push_back(lower + 1);
+            stack.push_back(lower);
+        }
+    }
+
+    // Center, radius and variance of the rows of a k-means node
+    template<class Distance>
+    static void node_statistics(KmNode & node, float * center, cv::Mat_<float> const & mat, int32_t const * rows, int count)
+    {
+        int const dim = mat.cols;
+        std::vector<double> sum(dim, 0.0);
+        for(int i = 0; i < count; ++i)
+            for(int j = 0; j < dim; ++j)
+                sum[j] += mat(rows[i], j);
+        for(int j = 0; j < dim; ++j)
+            center[j] = sum[j]/std::max(count, 1);
+        double radius = 0, variance = 0;
+        for(int i = 0; i < count; ++i)
+        {
+            double const d = Distance::distance(mat[rows[i]], center, dim);
+            radius = std::max(radius, d);
+            variance += d;
+        }
+        node.radius = radius;
+        node.variance = variance/std::max(count, 1);
+    }
+
+    // Initial centers, fewer than k when the rows have fewer distinct values
+    template<class Distance>
+    static std::vector<int32_t> initial_centers(cv::Mat_<float> const & mat, int32_t const * rows, int count, int k, int method, std::mt19937 & random)
+    {
+        std::vector<int32_t> centers;
+        auto const distinct = [&](int32_t r)
+        {
+            for(int32_t c : centers)
+                if(Distance::distance(mat[r], mat[c], mat.cols) < 1e-16)
+                    return false;
+            return true;
+        };
+        if(method == cvflann::FLANN_CENTERS_RANDOM)
+        {
+            std::vector<int32_t> shuffled(rows, rows + count);
+            std::shuffle(shuffled.begin(), shuffled.end(), random);
+            for(int i = 0; (i < count) && (int(centers.size()) < k); ++i)
+                if(distinct(shuffled[i]))
+                    centers.push_back(shuffled[i]);
+            return centers;
+        }
+
+        // gonzales takes the farthest row, k-means++ samples rows by distance
+        centers.push_back(rows[std::uniform_int_distribution<int>(0, count-1)(random)]);
+        std::vector<double> closest(count);
+        for(int i = 0; i < count; ++i)
+            closest[i] = Distance::distance(mat[rows[i]], mat[centers[0]], mat.cols);
+        while(int(centers.size()) < k)
+        {
+            int pick = -1;
+            if(method == cvflann::FLANN_CENTERS_GONZALES)
+            {
+                pick = std::max_element(closest.begin(), closest.end()) - closest.begin();
+                if(closest[pick] <= 0)
+                    break;
+            }
+            else
+            {
+                double const total = std::accumulate(closest.begin(), closest.end(), 0.0);
+                if(total <= 0)
+                    break;
+                double target = std::uniform_real_distribution<double>(0, total)(random);
+                for(pick = 0; (pick < count-1) && ((target -= closest[pick]) > 0); ++pick)
+                    ;
+                if(closest[pick] <= 0)
+                    continue;
+            }
+            centers.push_back(rows[pick]);
+            for(int i = 0; i < count; ++i)
+                closest[i] = std::min<double>(closest[i], Distance::distance(mat[rows[i]], mat[rows[pick]], mat.cols));
+        }
+        return centers;
+    }
+
+    // Clusters the rows of node into its children, rows is reordered by child
+    template<class Distance>
+    static void build_km(std::vector<KmNode> & nodes, std::vector<float> & centers, cv::Mat_<float> const & mat,
+        int32_t * rows, int node, IndexConfig const & config, std::mt19937 & random)
+    {
+        int const dim = mat.cols;
+        int const count = nodes[node].last - nodes[node].first;
+        int const branching = config.km_branching;
+        if(count < branching)
+            return;
+        std::vector<int32_t> const initial = initial_centers<Distance>(mat, rows, count, branching, config.km_centers, random);
+        if(int(initial.size()) < branching)
+            return;
+
+        // Lloyd iterations, iterations < 0 runs until the assignment doesn't change
+        std::vector<float> means(size_t(branching)*dim);
+        for(int c = 0; c < branching; ++c)
+            std::copy(mat[initial[c]], mat[initial[c]] + dim, &means[size_t(c)*dim]);
+        std::vector<int> cluster(count, -1);
+        std::vector<int> sizes(branching, 0);
+        std::vector<double> sums(size_t(branching)*dim);
+        for(int iteration = 0; (config.km_iterations < 0) || (iteration <= config.km_iterations); ++iteration)
+        {
+            bool changed = false;
+            for(int i = 0; i < count; ++i)
+            {
+                int best = 0;
+                float best_dist = std::numeric_limits<float>::max();
+                for(int c = 0; c < branching; ++c)
+                {
+                    float const d = Distance::distance(mat[rows[i]], &means[size_t(c)*dim], dim);
+                    if(d < best_dist)
+                    {
+                        best_dist = d;
+                        best = c;
+                    }
+                }
+                changed = changed || (cluster[i] != best);
+                cluster[i] = best;
+            }
+            if(!changed || (iteration == config.km_iterations))
+                break;
+            std::fill(sums.begin(), sums.end(), 0.0);
+            std::fill(sizes.begin(), sizes.end(), 0);
+            for(int i = 0; i < count; ++i)
+            {
+                ++sizes[cluster[i]];
+                for(int j = 0; j < dim; ++j)
+                    sums[size_t(cluster[i])*dim + j] += mat(rows[i], j);
+            }
+            for(int c = 0; c < branching; ++c)
+                if(sizes[c] > 0)
+                    for(int j = 0; j < dim; ++j)
+                        means[size_t(c)*dim + j] = sums[size_t(c)*dim + j]/sizes[c];
+        }
+
+        std::fill(sizes.begin(), sizes.end(), 0);
+        for(int i = 0; i < count; ++i)
+            ++sizes[cluster[i]];
+        int const children = std::count_if(sizes.begin(), sizes.end(), [](int s) { return s > 0; });
+        if(children < 2)
+            return;
+
+        // rows in cluster order, one child per nonempty cluster
+        std::vector<int32_t> sorted(count);
+        std::vector<int> start(branching+1, 0);
+        for(int c = 0; c < branching; ++c)
+            start[c+1] = start[c] + sizes[c];
+        std::vector<int> next(start.begin(), start.end()-1);
+        for(int i = 0; i < count; ++i)
+            sorted[next[cluster[i]]++] = rows[i];
+        std::copy(sorted.begin(), sorted.end(), rows);
+
+        int const first_child = nodes.size();
+        nodes[node].first_child = first_child;
+        nodes[node].children = children;
+        int const first = nodes[node].first;
+        for(int c = 0; c < branching; ++c)
+        {
+            if(sizes[c] == 0)
+                continue;
+            nodes.push_back(KmNode{0, 0, first + start[c], first + start[c+1], 0.0f, 0.0f});
+            centers.resize(nodes.size()*dim);
+            node_statistics<Distance>(nodes.back(), &centers[(nodes.size()-1)*dim], mat, rows + start[c], sizes[c]);
+        }
+        for(int c = 0, child = first_child; c < branching; ++c)
+        {
+            if(sizes[c] == 0)
+                continue;
+            build_km<Distance>(nodes, centers, mat, rows + start[c], child++, config, random);
+        }
+    }
+
+    template<class Distance>
+    static FlatIndex build(cv::Mat_<float> const & mat, IndexConfig const & config, int distance, unsigned threads)
+    {
+        int32_t const count = mat.rows;
+        bool const kd = (config.type == 1) || (config.type == 3);
+        bool const km = (config.type == 2) || (config.type == 3);
+        int const trees = kd ? std::max(1, config.kd_tree_count) : 0;
+        if(km && (config.km_branching < 2))
+        {
+            std::cerr << "k-means branching must be at least 2\n";
+            throw std::runtime_error("");
+        }
+
+        // every tree has its own row permutation and node array, trees are built in parallel
+        std::vector<int32_t> indices(size_t(count)*(trees + (km ? 1 : 0)));
+        std::vector<std::vector<KdNode>> tree_nodes(trees);
+        std::vector<std::thread> workers;
+        std::atomic<int> next{0};
+        auto const worker = [&]()
+        {
+            for(int t; (t = next++) < trees;)
+            {
+                std::mt19937 random(t);
+                int32_t * rows = &indices[size_t(t)*count];
+                std::iota(rows, rows + count, 0);
+                std::shuffle(rows, rows + count, random);
+                tree_nodes[t].reserve(2*size_t(count));
+                build_kd(tree_nodes[t], mat, rows, t*count, count, random);
+            }
+        };
+        for(unsigned i = 1; i < std::min<unsigned>(threads, trees); ++i)
+            workers.emplace_back(worker);
+        worker();
+        for(auto & w : workers)
+            w.join();
+
+        std::vector<int32_t> roots;
+        std::vector<KdNode> kd_nodes;
+        for(auto & nodes : tree_nodes)
+        {
+            // child numbers are made global
+            int32_t const offset = kd_nodes.size();
+            roots.push_back(offset);
+            for(KdNode node : nodes)
+            {
+                if(node.feature >= 0)
+                {
+                    node.lower += offset;
+                    node.upper += offset;
+                }
+                kd_nodes.push_back(node);
+            }
+            std::vector<KdNode>{}.swap(nodes);
+        }
+
+        std::vector<KmNode> km_nodes;
+        std::vector<float> centers;
+        if(km)
+        {
+            std::mt19937 random(trees);
+            int32_t * rows = &indices[size_t(trees)*count];
+            std::iota(rows, rows + count, 0);
+            km_nodes.push_back(KmNode{0, 0, trees*count, (trees+1)*count, 0.0f, 0.0f});
+            centers.resize(mat.cols);
+            node_statistics<Distance>(km_nodes[0], centers.data(), mat, rows, count);
+            build_km<Distance>(km_nodes, centers, mat, rows, 0, config, random);
+        }
+
+        FlatHeader header{};
+        memcpy(header.magic, flat_magic, sizeof(flat_magic));
+        header.version = 1;
+        header.type = config.type;
+        header.distance = distance;
+        header.dim = mat.cols;
+        header.rows = count;
+        header.trees = trees;
+        header.branching = km ? config.km_branching : 0;
+        header.cb_index = config.km_index;
+        header.kd_count = kd_nodes.size();
+        header.km_count = km_nodes.size();
+        header.index_count = indices.size();
+
+        uint64_t offset = dataset_align(sizeof(header));
+        auto const place = [&](uint64_t & field, size_t bytes)
+        {
+            field = offset;
+            offset = dataset_align(offset + bytes);
+        };
+        place(header.roots, roots.size()*sizeof(int32_t));
+        place(header.kd, kd_nodes.size()*sizeof(KdNode));
+        place(header.km, km_nodes.size()*sizeof(KmNode));
+        place(header.centers, centers.size()*sizeof(float));
+        place(header.indices, indices.size()*sizeof(int32_t));
+        header.size = offset;
+
+        FlatIndex index;
+        index.m_buffer.assign(header.size, 0);
+        char * base = index.m_buffer.data();
+        memcpy(base, &header, sizeof(header));
+        memcpy(base + header.roots, roots.data(), roots.size()*sizeof(int32_t));
+        memcpy(base + header.kd, kd_nodes.data(), kd_nodes.size()*sizeof(KdNode));
+        memcpy(base + header.km, km_nodes.data(), km_nodes.size()*sizeof(KmNode));
+        memcpy(base + header.centers, centers.data(), centers.size()*sizeof(float));
+        memcpy(base + header.indices, indices.data(), indices.size()*sizeof(int32_t));
+        index.m_base = base;
+        return index;
+    }
+
+    // -- Search --
+
+    // Nearest rows found so far, sorted by distance
+    struct Results
+    {
+        std::vector<std::pair<float, int>> & items;
+        size_t n;
+        float limit;// the radius, or no limit
+
+        bool full() const { return items.size() == n; }
+
+        float worst() const
+        {
+            return full() ? std::min(limit, items.back().first) : limit;
+        }
+
+        void add(float dist, int row)
+        {
+            if((dist > limit) || (full() && (dist >= items.back().first)))
+                return;
+            if(full())
+                items.pop_back();
+            items.insert(std::upper_bound(items.begin(), items.end(), std::make_pair(dist, row)), std::make_pair(dist, row));
+        }
+    };
+
+    // Marks a row checked, returns false if it already was
+    static bool check(Scratch & scratch, int row)
+    {
+        uint64_t & word = scratch.checked[row/64];
+        uint64_t const bit = uint64_t(1) << (row%64);
+        if(word & bit)
+            return false;
+        if(word == 0)
+            scratch.touched.push_back(row/64);
+        word |= bit;
+        return true;
+    }
+
+    static void push(std::vector<std::pair<float, int>> & heap, float dist, int node)
+    {
+        heap.emplace_back(dist, node);
+        std::push_heap(heap.begin(), heap.end(), std::greater<std::pair<float, int>>());
+    }
+
+    static std::pair<float, int> pop(std::vector<std::pair<float, int>> & heap)
+    {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<std::pair<float, int>>());
+        auto const top = heap.back();
+        heap.pop_back();
+        return top;
+    }
+
+    template<class Distance>
+    void search_kd(float const * query, cv::Mat_<float> const & rows, int node, float mindist, int & checks, int max_checks,
+        Results & results, Scratch & scratch) const
+    {
+        KdNode const * const nodes = array<KdNode>(header().kd);
+        int32_t const * const indices = array<int32_t>(header().indices);
+        for(;;)
+        {
+            if(results.worst() < mindist)
+                return;
+            KdNode const & n = nodes[node];
+            if(n.feature < 0)
+            {
+                for(int32_t i = n.lower; i < n.upper; ++i)
+                {
+                    if((checks >= max_checks) && results.full())
+                        return;
+                    int const row = indices[i];
+                    if(!check(scratch, row))
+                        continue;
+                    ++checks;
+                    results.add(Distance::distance(query, rows[row], rows.cols), row);
+                }
+                return;
+            }
+            // the closer side first, the other one is visited later by its distance to the split
+            float const diff = query[n.feature] - n.value;
+            int const best = (diff < 0) ? n.lower : n.upper;
+            int const other = (diff < 0) ? n.upper : n.lower;
+            float const other_dist = mindist + Distance::accum(n.value, query[n.feature]);
+            if((other_dist < results.worst()) || !results.full())
+                push(scratch.heap, other_dist, other);
+            node = best;
+        }
+    }
+
+    template<class Distance>
+    void search_km(float const * query, cv::Mat_<float> const & rows, int node, int & checks, int max_checks,
+        Results & results, Scratch & scratch) const
+    {
+        FlatHeader const & h = header();
+        KmNode const * const nodes = array<KmNode>(h.km);
+        float const * const centers = array<float>(h.centers);
+        int32_t const * const indices = array<int32_t>(h.indices);
+        for(;;)
+        {
+            KmNode const & n = nodes[node];
+            // clusters that can't hold a closer row are skipped
+            float const wsq = results.worst();
+            if(wsq < std::numeric_limits<float>::max())
+            {
+                float const bsq = Distance::distance(query, centers + size_t(node)*h.dim, h.dim);
+                float const rsq = n.radius;
+                float const val = bsq - rsq - wsq;
+                if((val > 0) && (val*val - 4*rsq*wsq > 0))
+                    return;
+            }
+            if(n.children == 0)
+            {
+                if((checks >= max_checks) && results.full())
+                    return;
+                checks += n.last - n.first;
+                for(int32_t i = n.first; i < n.last; ++i)
+                {
+                    int const row = indices[i];
+                    if(check(scratch, row))
+                        results.add(Distance::distance(query, rows[row], rows.cols), row);
+                }
+                return;
+            }
+            // the closest child first, the others by distance less km-index times their variance
+            scratch.domain.resize(n.children);
+            int best = 0;
+            for(int c = 0; c < n.children; ++c)
+            {
+                scratch.domain[c] = Distance::distance(query, centers + size_t(n.first_child + c)*h.dim, h.dim);
+                if(scratch.domain[c] < scratch.domain[best])
+                    best = c;
+            }
+            for(int c = 0; c < n.children; ++c)
+                if(c != best)
+                    push(scratch.heap, scratch.domain[c] - h.cb_index*nodes[n.first_child + c].variance, n.first_child + c);
+            node = n.first_child + best;
+        }
+    }
+
+    template<class Distance>
+    void search(float const * query, cv::Mat_<float> const & rows, int n, double radius, int checks,
+        int * indices, float * dists, Scratch & scratch) const
+    {
+        FlatHeader const & h = header();
+        scratch.checked.resize((h.rows + 63)/64);
+        scratch.results.clear();
+        Results results{scratch.results, size_t(n), (radius >= 0) ? float(radius) : std::numeric_limits<float>::max()};
+        int const max_checks = (checks > 0) ? checks : std::numeric_limits<int>::max();
+
+        if(h.type == 0)
+        {
+            for(int row = 0; row < rows.rows; ++row)
+                results.add(Distance::distance(query, rows[row], rows.cols), row);
+        }
+        // composite indexes search the k-means tree, then the kd-trees, with checks each
+        if((h.type == 2) || (h.type == 3))
+        {
+            int done = 0;
+            scratch.heap.clear();
+            search_km<Distance>(query, rows, 0, done, max_checks, results, scratch);
+            while(!scratch.heap.empty() && ((done < max_checks) || !results.full()))
+                search_km<Distance>(query, rows, pop(scratch.heap).second, done, max_checks, results, scratch);
+        }
+        if((h.type == 1) || (h.type == 3))
+        {
+            int32_t const * const roots = array<int32_t>(h.roots);
+            int done = 0;
+            scratch.heap.clear();
+            for(int t = 0; t < h.trees; ++t)
+                search_kd<Distance>(query, rows, roots[t], 0.0f, done, max_checks, results, scratch);
+            while(!scratch.heap.empty() && ((done < max_checks) || !results.full()))
+            {
+                auto const branch = pop(scratch.heap);
+                search_kd<Distance>(query, rows, branch.second, branch.first, done, max_checks, results, scratch);
+            }
+        }
+
+        for(size_t word : scratch.touched)
+            scratch.checked[word] = 0;
+        scratch.touched.clear();
+        for(int j = 0; j < n; ++j)
+        {
+            bool const found = size_t(j) < scratch.results.size();
+            indices[j] = found ? scratch.results[j].second : -1;
+            dists[j] = found ? scratch.results[j].first : 0.0f;
+        }
+    }
+
+    std::shared_ptr<Mapping const> m_mapping;
+    std::vector<char> m_buffer;// a built index
+    char const * m_base = nullptr;
+};
+
+// Engine over a flat index and the rows it indexes
+class FlatEngine : public Engine
+{
+public:
+    FlatEngine(FlatIndex const & index, cv::Mat_<float> const & rows)
+        : m_index(index)
+        , m_rows(rows)
+    {
+        if((size_t(rows.rows) != index.rows()) || (rows.cols != index.dim()))
+        {
+            std::cerr << "Flat index is for " << index.rows() << 'x' << index.dim() << " features, not " << rows.rows << 'x' << rows.cols << '\n';
+            throw std::runtime_error("");
+        }
+    }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        FlatIndex::Scratch scratch = acquire();
+        for(int i = 0; i < queries.rows; ++i)
+            m_index.search(queries[i], m_rows, query.n, query.radius, query.checks, indices[i], dists[i], scratch);
+        release(std::move(scratch));
+    }
+
+private:
+    // Scratch buffers, one per concurrent search, kept between calls
+    FlatIndex::Scratch acquire()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_pool.empty())
+            return FlatIndex::Scratch();
+        FlatIndex::Scratch scratch = std::move(m_pool.back());
+        m_pool.pop_back();
+        return scratch;
+    }
+
+    void release(FlatIndex::Scratch scratch)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pool.push_back(std::move(scratch));
+    }
+
+    FlatIndex const & m_index;
+    cv::Mat_<float> const m_rows;
+
+    std::mutex m_mutex;
+    std::vector<FlatIndex::Scratch> m_pool;
+};
+
+
+// Saves a flat index followed by the features, labels and build parameters
+void save_flat_bundle(FlatIndex const & index, cv::Mat_<float> const & features, std::vector<double> const & labels,
+    std::string const & params, char const * filename)
+{
+    {
+        std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+        if(!file.write(index.data(), index.size()))
+        {
+            std::cerr << "Can't write '" << filename << "'\n";
+            throw std::runtime_error("");
+        }
+    }
+    append_bundle(features, labels, params, index.distance(), filename);
+}
+
+#endif//FLAT_INDEX_H_INCLUDED
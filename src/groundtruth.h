@@ -0,0 +1,309 @@
+#ifndef GROUND_TRUTH_H_INCLUDED
+#define GROUND_TRUTH_H_INCLUDED
+
+#include "binary.h"
+#include "data.h"
+#include "exact.h"
+#include "mapping.h"
+#include "search.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+// -- Ground truth cache --
+//
+// Exact neighbors of a query set, native endian :
+//  header  : GroundTruthHeader
+//  indices : rows x n int32, at a multiple of 64 bytes
+//  dists   : rows x n float, at a multiple of 64 bytes
+// The cache is valid for the training and query features with the hashes in the header,
+// the distance and any neighbor count up to n.
+
+char const ground_truth_magic[8] = {'F','L','A','N','N','G','T','\0'};
+
+struct GroundTruthHeader
+{
+    char magic[8];
+    uint32_t version;
+    int32_t n;
+    int32_t distance;
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t train_hash;
+    uint64_t query_hash;
+};
+
+uint64_t const hash_seed = 14695981039346656037ull;
+
+// FNV-1a over 32 bit words, continues from h
+inline uint64_t hash_floats(float const * values, size_t count, uint64_t h = hash_seed)
+{
+    for(size_t i = 0; i < count; ++i)
+    {
+        uint32_t word;
+        memcpy(&word, values+i, sizeof(word));
+        h = (h ^ word) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Fraction of the exact neighbors found, -1 entries are ignored
+inline double row_recall(int const * found, int found_count, int const * exact, int exact_count)
+{
+    int hits = 0, total = 0;
+    for(int j = 0; j < exact_count; ++j)
+    {
+        if(exact[j] < 0)
+            continue;
+        ++total;
+        if(std::find(found, found+found_count, exact[j]) != found+found_count)
+            ++hits;
+    }
+    return (total > 0) ? double(hits)/total : 1.0;
+}
+
+// Exact n nearest neighbors of queries added in batches, from the cache file or computed and then saved
+// - the features are hashed densified, so text and binary datasets of the same data share a cache
+// - a cache for other queries is only detected at finish when the queries are streamed
+// - without a filename the neighbors are only computed
+class GroundTruth
+{
+public:
+    GroundTruth(char const * filename, cv::Mat_<float> const & train, int n, int distance, unsigned threads)
+        : m_filename(filename ? filename : "")
+        , m_train(train)
+        , m_n(n)
+        , m_distance(distance)
+        , m_threads(threads)
+    {
+        for(int i = 0; i < train.rows; ++i)
+            m_train_hash = hash_floats(train[i], train.cols, m_train_hash);
+        read();
+    }
+
+    // True if the exact neighbors come from the cache
+    bool cached() const { return m_cached; }
+
+    // Checks the cache against all queries before they are added
+    void expect(Data const & queries)
+    {
+        if(!m_cached)
+            return;
+        std::vector<float> row(m_train.cols);
+        uint64_t h = hash_seed;
+        for(size_t i = 0; i < queries.size(); ++i)
+        {
+            densify(queries, i, row.data(), row.size());
+            h = hash_floats(row.data(), row.size(), h);
+        }
+        if((h != m_cache_hash) || (queries.size() != m_cache_rows))
+            drop_cache();
+    }
+
+    void expect(cv::Mat_<float> const & queries)
+    {
+        if(!m_cached)
+            return;
+        uint64_t h = hash_seed;
+        for(int i = 0; i < queries.rows; ++i)
+            h = hash_floats(queries[i], queries.cols, h);
+        if((h != m_cache_hash) || (size_t(queries.rows) != m_cache_rows))
+            drop_cache();
+    }
+
+    // Adds a batch of dense queries, found are their approximate neighbors (or empty)
+    void add(cv::Mat_<float> const & queries, cv::Mat_<int> const & found)
+    {
+        size_t const first = m_rows;
+        for(int i = 0; i < queries.rows; ++i)
+            m_query_hash = hash_floats(queries[i], queries.cols, m_query_hash);
+        m_rows += queries.rows;
+
+        if(m_cached)
+        {
+            if(m_rows > m_cache_rows)
+                m_mismatch = true;
+        }
+        else
+        {
+            if(exact_supported(m_distance))
+            {
+                if(!m_exact)
+                    m_exact = std::make_unique<ExactEngine>(m_train, m_distance);
+            }
+            else if(!m_linear)
+            {
+                // Hamming distance needs the packed rows
+                if(is_binary(m_distance))
+                    m_packed = pack_bits(m_train);
+                m_linear = std::make_unique<cv::flann::Index>(is_binary(m_distance) ? m_packed : cv::Mat(m_train), cv::flann::LinearIndexParams(),
+                    static_cast<cvflann::flann_distance_t>(m_distance));
+            }
+            std::unique_ptr<Engine> linear_engine;
+            if(is_binary(m_distance))
+                linear_engine = std::make_unique<BinaryEngine>(*m_linear);
+            else if(m_linear)
+                linear_engine = std::make_unique<FlannEngine>(*m_linear);
+            Engine & engine = m_exact ? static_cast<Engine &>(*m_exact) : *linear_engine;
+            search(engine, queries, m_batch_indices, m_batch_dists, Query{m_n, -1.0, 32}, m_threads);
+            m_indices.insert(m_indices.end(), m_batch_indices[0], m_batch_indices[0] + size_t(queries.rows)*m_n);
+            m_dists.insert(m_dists.end(), m_batch_dists[0], m_batch_dists[0] + size_t(queries.rows)*m_n);
+        }
+
+        if(m_mismatch || found.empty())
+            return;
+        for(int i = 0; i < queries.rows; ++i)
+            m_recall += row_recall(found[i], found.cols, &m_indices[(first+i)*m_n], m_n);
+    }
+
+    // Saves computed neighbors, returns false if the cache didn't match the queries
+    bool finish()
+    {
+        if(m_cached)
+        {
+            m_mismatch = m_mismatch || (m_rows != m_cache_rows) || (m_query_hash != m_cache_hash);
+            return !m_mismatch;
+        }
+        if(!m_filename.empty())
+            write();
+        return true;
+    }
+
+    // Mean recall of the added results
+    double recall() const
+    {
+        return (m_rows > 0) ? m_recall/m_rows : 0.0;
+    }
+
+    // Summed recall@n of found, the neighbors of the added rows [first, first + found.rows), n up to the ground truth n
+    // - for results of other searches over the same queries, 0 if the rows have no exact neighbors
+    double recall_sum(cv::Mat_<int> const & found, size_t first, int n) const
+    {
+        n = std::min(n, m_n);
+        if(m_mismatch || (n > found.cols) || ((first + found.rows)*m_n > m_indices.size()))
+            return 0.0;
+        double sum = 0;
+        for(int i = 0; i < found.rows; ++i)
+            sum += row_recall(found[i], n, &m_indices[(first+i)*m_n], n);
+        return sum;
+    }
+
+    // Exact neighbors of the added queries, rows x n
+    cv::Mat_<int> exact() const
+    {
+        cv::Mat_<int> result(m_rows, m_n);
+        if(m_rows > 0)
+            std::copy(m_indices.begin(), m_indices.begin()+m_rows*m_n, result[0]);
+        return result;
+    }
+
+private:
+    void read()
+    {
+        if(m_filename.empty())
+            return;
+        Mapping const mapping(m_filename.c_str());
+        GroundTruthHeader header{};
+        if(!mapping || (mapping.size() < sizeof(header)))
+            return;
+        memcpy(&header, mapping.data(), sizeof(header));
+
+        // the indices and the distances hold rows x n elements each within the mapping, at aligned offsets
+        uint64_t const available = mapping.size();
+        auto const fits = [available](uint64_t offset, uint64_t count, uint64_t size)
+        {
+            return (offset % size == 0) && (offset <= available) && (count <= (available - offset)/size);
+        };
+        bool const sized = (memcmp(header.magic, ground_truth_magic, sizeof(ground_truth_magic)) == 0) && (header.version == 1)
+            && (header.n > 0) && (header.rows <= UINT64_MAX/uint64_t(header.n));
+        uint64_t const count = sized ? header.rows*header.n : 0;
+        uint64_t const indices = dataset_align(sizeof(header));
+        bool const valid = sized && fits(indices, count, sizeof(int32_t))
+            && fits(dataset_align(indices + count*sizeof(int32_t)), count, sizeof(float));
+        if(!valid)
+        {
+            std::cerr << "Invalid ground truth cache '" << m_filename << "'\n";
+            throw std::runtime_error("");
+        }
+        if((header.train_hash != m_train_hash) || (header.distance != m_distance) || (header.n < m_n))
+            return;
+
+        // keep the first n neighbors of each row
+        auto const cached = reinterpret_cast<int32_t const *>(mapping.data()+indices);
+        m_indices.resize(header.rows*m_n);
+        for(size_t i = 0; i < header.rows; ++i)
+            std::copy(cached+i*header.n, cached+i*header.n+m_n, &m_indices[i*m_n]);
+        m_cached = true;
+        m_cache_rows = header.rows;
+        m_cache_hash = header.query_hash;
+    }
+
+    void drop_cache()
+    {
+        m_cached = false;
+        m_indices.clear();
+    }
+
+    void write() const
+    {
+        std::ofstream file(m_filename, std::ios::binary);
+        GroundTruthHeader header{};
+        memcpy(header.magic, ground_truth_magic, sizeof(ground_truth_magic));
+        header.version = 1;
+        header.n = m_n;
+        header.distance = m_distance;
+        header.rows = m_rows;
+        header.train_hash = m_train_hash;
+        header.query_hash = m_query_hash;
+
+        static char const zeros[64] = {};
+        uint64_t const indices = dataset_align(sizeof(header));
+        uint64_t const dists = dataset_align(indices + m_indices.size()*sizeof(int32_t));
+        file.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        file.write(zeros, indices - sizeof(header));
+        file.write(reinterpret_cast<char const *>(m_indices.data()), m_indices.size()*sizeof(int32_t));
+        file.write(zeros, dists - indices - m_indices.size()*sizeof(int32_t));
+        file.write(reinterpret_cast<char const *>(m_dists.data()), m_dists.size()*sizeof(float));
+        if(!file.flush())
+        {
+            std::cerr << "Can't write ground truth cache '" << m_filename << "'\n";
+            throw std::runtime_error("");
+        }
+    }
+
+    std::string const m_filename;
+    cv::Mat_<float> const m_train;
+    int const m_n;
+    int const m_distance;
+    unsigned const m_threads;
+    uint64_t m_train_hash = hash_seed;
+
+    bool m_cached = false;
+    bool m_mismatch = false;
+    size_t m_cache_rows = 0;
+    uint64_t m_cache_hash = 0;
+
+    size_t m_rows = 0;
+    uint64_t m_query_hash = hash_seed;
+    std::vector<int> m_indices;// rows x n
+    std::vector<float> m_dists;// computed only
+    double m_recall = 0;
+
+    cv::Mat m_packed;
+    std::unique_ptr<cv::flann::Index> m_linear;
+    std::unique_ptr<ExactEngine> m_exact;// L2 and cosine
+    cv::Mat_<int> m_batch_indices;
+    cv::Mat_<float> m_batch_dists;
+};
+
+#endif//GROUND_TRUTH_H_INCLUDED
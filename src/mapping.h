@@ -0,0 +1,77 @@
+#ifndef FILE_MAPPING_H_INCLUDED
+#define FILE_MAPPING_H_INCLUDED
+
+#include <cstddef>
+
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file
+// - empty when the file can't be mapped (missing, pipe, empty, ...)
+class Mapping
+{
+public:
+    Mapping() = default;
+
+    explicit Mapping(char const * filename)
+    {
+        int const fd = open(filename, O_RDONLY);
+        if(fd < 0)
+            return;
+        struct stat st;
+        if((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0))
+        {
+            void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(addr != MAP_FAILED)
+            {
+                m_addr = addr;
+                m_size = st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    Mapping(Mapping && other) noexcept
+        : m_addr(std::exchange(other.m_addr, nullptr))
+        , m_size(std::exchange(other.m_size, 0))
+    {
+    }
+
+    Mapping & operator=(Mapping && other) noexcept
+    {
+        std::swap(m_addr, other.m_addr);
+        std::swap(m_size, other.m_size);
+        return *this;
+    }
+
+    Mapping(Mapping const &) = delete;
+    Mapping & operator=(Mapping const &) = delete;
+
+    ~Mapping()
+    {
+        if(m_addr)
+            munmap(m_addr, m_size);
+    }
+
+    explicit operator bool() const { return m_addr != nullptr; }
+
+    char const * data() const { return static_cast<char const *>(m_addr); }
+    size_t size() const { return m_size; }
+
+    // Hint the kernel about the access pattern, e.g. MADV_SEQUENTIAL
+    void advise(int advice) const
+    {
+        if(m_addr)
+            madvise(m_addr, m_size, advice);
+    }
+
+private:
+    void * m_addr = nullptr;
+    size_t m_size = 0;
+};
+
+#endif//FILE_MAPPING_H_INCLUDED
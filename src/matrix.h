@@ -0,0 +1,21 @@
+#ifndef FEATURE_MATRIX_H_INCLUDED
+#define FEATURE_MATRIX_H_INCLUDED
+
+#include "data.h"
+
+#include <opencv2/flann/flann.hpp>
+
+// Dense feature matrix, binary dense datasets are used in place without a copy
+cv::Mat_<float> dense(Data const & data)
+{
+    if(data.dense)
+        return cv::Mat_<float>(data.size(), data.dim, const_cast<float *>(data.dense));
+
+    cv::Mat_<float> mat = cv::Mat_<float>::zeros(data.size(), data.dim);
+    for(size_t i = 0; i < data.size(); ++i)
+        for(size_t j = data.offsets[i]; j < data.offsets[i+1]; ++j)
+            mat(i, data.indices[j]-1) = data.values[j];
+    return mat;
+}
+
+#endif//FEATURE_MATRIX_H_INCLUDED
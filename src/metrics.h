@@ -0,0 +1,213 @@
+#ifndef RUN_METRICS_H_INCLUDED
+#define RUN_METRICS_H_INCLUDED
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+// Thread safe histogram of latencies in nanoseconds
+// - 8 linear sub-buckets per power of two, values are reported as the bucket upper bound (<= 12.5% high)
+class LatencyHistogram
+{
+public:
+    void add(uint64_t ns)
+    {
+        m_buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_total.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = m_max.load(std::memory_order_relaxed);
+        while((ns > max) && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+            ;
+    }
+
+    uint64_t count() const { return m_count.load(); }
+    uint64_t max() const { return m_max.load(); }
+    double mean() const { return count() ? double(m_total.load())/count() : 0.0; }
+
+    // Upper bound of the bucket with the p-th value, p in [0,1]
+    uint64_t percentile(double p) const
+    {
+        uint64_t const total = count();
+        if(total == 0)
+            return 0;
+        uint64_t const rank = std::max<uint64_t>(1, uint64_t(p*total + 0.5));
+        uint64_t seen = 0;
+        for(size_t i = 0; i < m_buckets.size(); ++i)
+        {
+            seen += m_buckets[i].load();
+            if(seen >= rank)
+                return std::min(upper(i), max());
+        }
+        return max();
+    }
+
+    // Non-empty buckets as (upper bound, count)
+    std::vector<std::pair<uint64_t, uint64_t>> buckets() const
+    {
+        std::vector<std::pair<uint64_t, uint64_t>> result;
+        for(size_t i = 0; i < m_buckets.size(); ++i)
+            if(auto const c = m_buckets[i].load())
+                result.emplace_back(upper(i), c);
+        return result;
+    }
+
+private:
+    static size_t bucket(uint64_t ns)
+    {
+        if(ns < 8)
+            return ns;
+        int const log = 63 - __builtin_clzll(ns);// >= 3
+        return (log-2)*8 + ((ns >> (log-3)) & 7);
+    }
+
+    static uint64_t upper(size_t i)
+    {
+        if(i < 8)
+            return i;
+        int const log = i/8 + 2;
+        return ((uint64_t(8 + i%8 + 1)) << (log-3)) - 1;
+    }
+
+    std::array<std::atomic<uint64_t>, 62*8> m_buckets{};
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_total{0};
+    std::atomic<uint64_t> m_max{0};
+};
+
+// Resource usage of the whole process
+struct Usage
+{
+    double wall = 0;// seconds
+    double cpu = 0;// seconds, all threads
+    uint64_t read = 0;// bytes read by read() and friends, mapped files don't count
+    uint64_t read_storage = 0;// bytes fetched from storage, mapped files included
+    uint64_t peak_rss = 0;// bytes
+
+    static Usage now()
+    {
+        Usage usage;
+        usage.wall = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        timespec cpu;
+        if(clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu) == 0)
+            usage.cpu = cpu.tv_sec + cpu.tv_nsec*1e-9;
+        rusage self;
+        if(getrusage(RUSAGE_SELF, &self) == 0)
+            usage.peak_rss = uint64_t(self.ru_maxrss)*1024;
+        if(FILE * io = fopen("/proc/self/io", "r"))
+        {
+            char key[32];
+            unsigned long long value;
+            while(fscanf(io, "%31[^:]: %llu\n", key, &value) == 2)
+            {
+                if(std::string(key) == "rchar")
+                    usage.read = value;
+                else if(std::string(key) == "read_bytes")
+                    usage.read_storage = value;
+            }
+            fclose(io);
+        }
+        return usage;
+    }
+};
+
+// Named phases of a tool run with their resource usage, written as JSON
+class Metrics
+{
+public:
+    explicit Metrics(char const * tool)
+        : m_tool(tool)
+        , m_start(Usage::now())
+        , m_phase_start(m_start)
+    {
+    }
+
+    // Ends the current phase and starts the next one
+    void phase(char const * name)
+    {
+        end();
+        m_name = name;
+    }
+
+    // Ends the current phase
+    void end()
+    {
+        Usage const now = Usage::now();
+        if(!m_name.empty())
+            m_phases.push_back(Phase{m_name, m_phase_start, now});
+        m_name.clear();
+        m_phase_start = now;
+    }
+
+    // Per query latencies, filled by search when metrics are requested, the queries are searched one at a time
+    LatencyHistogram latencies;
+
+    void write(char const * filename)
+    {
+        end();
+        Usage const now = Usage::now();
+
+        std::ofstream out(filename);
+        out << "{\n  \"tool\": \"" << m_tool << "\",\n  \"phases\": [\n";
+        for(size_t i = 0; i < m_phases.size(); ++i)
+        {
+            out << "    {\"name\": \"" << m_phases[i].name << "\", ";
+            usage(out, m_phases[i].begin, m_phases[i].end);
+            out << ((i+1 < m_phases.size()) ? "},\n" : "}\n");
+        }
+        out << "  ],\n  \"total\": {";
+        usage(out, m_start, now);
+        out << "},\n  \"queries\": {\"count\": " << latencies.count() << ", \"searched\": \"one per call\"";
+        if(latencies.count() > 0)
+        {
+            out << ", \"latency_ns\": {\"mean\": " << latencies.mean()
+                << ", \"p50\": " << latencies.percentile(0.5) << ", \"p90\": " << latencies.percentile(0.9)
+                << ", \"p99\": " << latencies.percentile(0.99) << ", \"max\": " << latencies.max() << "}"
+                ", \"histogram\": [";
+            auto const buckets = latencies.buckets();
+            for(size_t i = 0; i < buckets.size(); ++i)
+                out << (i ? ", " : "") << "{\"le\": " << buckets[i].first << ", \"count\": " << buckets[i].second << '}';
+            out << ']';
+        }
+        out << "}\n}\n";
+        if(!out.flush())
+        {
+            std::cerr << "Can't write metrics '" << filename << "'\n";
+            throw std::runtime_error("");
+        }
+    }
+
+private:
+    struct Phase
+    {
+        std::string name;
+        Usage begin;
+        Usage end;
+    };
+
+    static void usage(std::ostream & out, Usage const & begin, Usage const & end)
+    {
+        out << "\"wall_seconds\": " << (end.wall - begin.wall) << ", \"cpu_seconds\": " << (end.cpu - begin.cpu)
+            << ", \"bytes_read\": " << (end.read - begin.read) << ", \"storage_bytes_read\": " << (end.read_storage - begin.read_storage)
+            << ", \"peak_rss_bytes\": " << end.peak_rss;
+    }
+
+    std::string const m_tool;
+    Usage const m_start;
+    Usage m_phase_start;
+    std::string m_name;
+    std::vector<Phase> m_phases;
+};
+
+#endif//RUN_METRICS_H_INCLUDED
@@ -1,3 +1,5 @@
+#include "compress.h"
+
 #include <cstdio>
 #include <cstdlib>
 #include <cmath>
@@ -9,9 +11,13 @@
 
 int main()
 {
+    // gzip and zstd input is decompressed
+    InputStream input(0);
+    std::istream in(&input);
+
     size_t line_number = 0;
     std::string line;
-    while(std::getline(std::cin, line))
+    while(std::getline(in, line))
     {
         ++line_number;
         char const * p = line.c_str();
@@ -0,0 +1,241 @@
+#ifndef INDEX_PARAMS_H_INCLUDED
+#define INDEX_PARAMS_H_INCLUDED
+
+#include <cstdlib>
+
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+// Index construction parameters of all index types, defaults match the tools
+struct IndexConfig
+{
+    int type = 3;// 0=linear, 1=kd-tree, 2=k-means, 3=kd-tree + k-means, 4=LSH, 5=autotuned
+    // kd-tree
+    int kd_tree_count = 4;
+    // k-means
+    int km_branching = 32;
+    int km_iterations = 11;
+    int km_centers = 0;// CENTERS_RANDOM
+    double km_index = 0.2;
+    // LSH
+    int lsh_table_count = 0;
+    int lsh_key_size = 0;
+    int lsh_probe_level = 0;
+    // autotuned
+    double auto_precision = 0.9;
+    double auto_build_weight = 0.01;
+    double auto_memory_weight = 0;
+    double auto_sample_fraction = 0.1;
+};
+
+// Returns nullptr after printing the error for invalid parameters
+std::unique_ptr<cv::flann::IndexParams> make_params(IndexConfig const & config)
+{
+    switch(config.type)
+    {
+        case 0 : // linear brute force search
+            return std::make_unique<cv::flann::LinearIndexParams>();
+        case 1 : // k-d tree
+            return std::make_unique<cv::flann::KDTreeIndexParams>(
+                config.kd_tree_count);
+        case 2 : // k-means
+            return std::make_unique<cv::flann::KMeansIndexParams>(
+                config.km_branching,
+                config.km_iterations,
+                static_cast<cvflann::flann_centers_init_t>(config.km_centers),
+                config.km_index);
+        case 3 : // k-d tree + k-means
+            return std::make_unique<cv::flann::CompositeIndexParams>(
+                config.kd_tree_count,
+                config.km_branching,
+                config.km_iterations,
+                static_cast<cvflann::flann_centers_init_t>(config.km_centers),
+                config.km_index);
+        case 4 : // lsh
+            if((config.lsh_table_count <= 0) || (config.lsh_key_size <= 0) || (config.lsh_probe_level < 0))
+            {
+                std::cerr << "For t=4, lsh-table-count, lsh-key-size and lsh-probe-level must be set.\n";
+                return nullptr;
+            }
+            return std::make_unique<cv::flann::LshIndexParams>(
+                config.lsh_table_count,
+                config.lsh_key_size,
+                config.lsh_probe_level);
+        case 5 : // autotuned index
+            return std::make_unique<cv::flann::AutotunedIndexParams>(
+                config.auto_precision,
+                config.auto_build_weight,
+                config.auto_memory_weight,
+                config.auto_sample_fraction);
+        default :
+            std::cerr << "Unknown index type " << config.type << std::endl;
+            return nullptr;
+    }
+}
+
+// Parses "t=1,trees=8" style configurations, unset parameters keep their defaults
+// - keys are the tool option names without the index type prefix, "t" is the index type
+bool parse_config(std::string const & text, IndexConfig & config)
+{
+    std::istringstream in(text);
+    for(std::string item; std::getline(in, item, ',');)
+    {
+        auto const eq = item.find('=');
+        if(eq == std::string::npos)
+        {
+            std::cerr << "Invalid index configuration '" << text << "'\n";
+            return false;
+        }
+        std::string const key = item.substr(0, eq);
+        char const * const value = item.c_str()+eq+1;
+        char * end = nullptr;
+        double const number = strtod(value, &end);
+        if((end == value) || (*end != 0))
+        {
+            std::cerr << "Invalid value of '" << key << "' in index configuration '" << text << "'\n";
+            return false;
+        }
+        if(key == "t")
+            config.type = number;
+        else if(key == "tree-count")
+            config.kd_tree_count = number;
+        else if(key == "branching")
+            config.km_branching = number;
+        else if(key == "iterations")
+            config.km_iterations = number;
+        else if(key == "centers")
+            config.km_centers = number;
+        else if(key == "index")
+            config.km_index = number;
+        else if(key == "table-count")
+            config.lsh_table_count = number;
+        else if(key == "key-size")
+            config.lsh_key_size = number;
+        else if(key == "probe-level")
+            config.lsh_probe_level = number;
+        else if(key == "precision")
+            config.auto_precision = number;
+        else if(key == "build-weight")
+            config.auto_build_weight = number;
+        else if(key == "memory-weight")
+            config.auto_memory_weight = number;
+        else if(key == "sample-fraction")
+            config.auto_sample_fraction = number;
+        else
+        {
+            std::cerr << "Unknown parameter '" << key << "' in index configuration '" << text << "'\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reads the "name=value" lines bundle.h describe writes, unknown names are ignored
+bool config_from_params(std::string const & text, IndexConfig & config)
+{
+    bool algorithm = false;
+    std::istringstream in(text);
+    for(std::string line; std::getline(in, line);)
+    {
+        auto const eq = line.find('=');
+        if(eq == std::string::npos)
+            continue;
+        std::string const name = line.substr(0, eq);
+        double const number = strtod(line.c_str()+eq+1, nullptr);
+        if(name == "algorithm")
+        {
+            algorithm = true;
+            switch(int(number))
+            {
+                case cvflann::FLANN_INDEX_LINEAR : config.type = 0; break;
+                case cvflann::FLANN_INDEX_KDTREE : config.type = 1; break;
+                case cvflann::FLANN_INDEX_KMEANS : config.type = 2; break;
+                case cvflann::FLANN_INDEX_COMPOSITE : config.type = 3; break;
+                case cvflann::FLANN_INDEX_LSH : config.type = 4; break;
+                case cvflann::FLANN_INDEX_AUTOTUNED : config.type = 5; break;
+                default :
+                    std::cerr << "Unknown index algorithm " << number << '\n';
+                    return false;
+            }
+        }
+        else if(name == "trees")
+            config.kd_tree_count = number;
+        else if(name == "branching")
+            config.km_branching = number;
+        else if(name == "iterations")
+            config.km_iterations = number;
+        else if(name == "centers_init")
+            config.km_centers = number;
+        else if(name == "cb_index")
+            config.km_index = number;
+        else if(name == "table_number")
+            config.lsh_table_count = number;
+        else if(name == "key_size")
+            config.lsh_key_size = number;
+        else if(name == "multi_probe_level")
+            config.lsh_probe_level = number;
+        else if(name == "target_precision")
+            config.auto_precision = number;
+        else if(name == "build_weight")
+            config.auto_build_weight = number;
+        else if(name == "memory_weight")
+            config.auto_memory_weight = number;
+        else if(name == "sample_fraction")
+            config.auto_sample_fraction = number;
+    }
+    if(!algorithm)
+        std::cerr << "Build parameters without an algorithm\n";
+    return algorithm;
+}
+
+// Search checks a tuned bundle recommends in its "checks=" line, fallback without one
+int checks_from_params(std::string const & text, int fallback)
+{
+    std::istringstream in(text);
+    for(std::string line; std::getline(in, line);)
+        if(line.compare(0, 7, "checks=") == 0)
+            return atoi(line.c_str()+7);
+    return fallback;
+}
+
+// Parses a comma separated list of positive integers
+bool parse_list(char const * text, std::vector<int> & values)
+{
+    values.clear();
+    for(char const * p = text; *p;)
+    {
+        char * end = nullptr;
+        long const value = strtol(p, &end, 10);
+        if((end == p) || (value <= 0) || ((*end != ',') && (*end != 0)))
+            return false;
+        values.push_back(value);
+        p = (*end == ',') ? end+1 : end;
+    }
+    return !values.empty();
+}
+
+// Short description of the parameters that matter for the index type
+std::string to_string(IndexConfig const & config)
+{
+    std::ostringstream out;
+    out << "t=" << config.type;
+    if((config.type == 1) || (config.type == 3))
+        out << ",tree-count=" << config.kd_tree_count;
+    if((config.type == 2) || (config.type == 3))
+        out << ",branching=" << config.km_branching << ",iterations=" << config.km_iterations
+            << ",centers=" << config.km_centers << ",index=" << config.km_index;
+    if(config.type == 4)
+        out << ",table-count=" << config.lsh_table_count << ",key-size=" << config.lsh_key_size
+            << ",probe-level=" << config.lsh_probe_level;
+    if(config.type == 5)
+        out << ",precision=" << config.auto_precision << ",build-weight=" << config.auto_build_weight
+            << ",memory-weight=" << config.auto_memory_weight << ",sample-fraction=" << config.auto_sample_fraction;
+    return out.str();
+}
+
+#endif//INDEX_PARAMS_H_INCLUDED
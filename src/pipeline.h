@@ -0,0 +1,97 @@
+#ifndef QUERY_PIPELINE_H_INCLUDED
+#define QUERY_PIPELINE_H_INCLUDED
+
+#include "data.h"
+#include "queue.h"
+#include "search.h"
+
+#include <exception>
+#include <thread>
+#include <vector>
+
+// Query rows with their search results
+struct QueryBatch
+{
+    Data data;
+    cv::Mat_<float> queries;
+    cv::Mat_<int  > indices;
+    cv::Mat_<float> dists;
+};
+
+// Streams queries from a file through overlapping parse, search and output stages
+// - batches of up to rows queries circulate between the stages, at most depth of them exist
+// - consume(batch) runs on the output stage thread, batches come in input order
+template<typename Consume>
+void stream_search(char const * filename, size_t rows, Engine & engine, Query const & query,
+    int cols, unsigned threads, Consume consume, LatencyHistogram * latencies = nullptr)
+{
+    size_t const depth = 4;
+    std::vector<QueryBatch> batches(depth);
+    BoundedQueue<QueryBatch *> free(depth), parsed(depth), searched(depth);
+    for(auto & batch : batches)
+        free.push(&batch);
+
+    std::exception_ptr read_error, write_error;
+
+    std::thread reader([&]()
+    {
+        try
+        {
+            DataReader in(filename);
+            QueryBatch * batch;
+            while(free.pop(batch) && in.read(batch->data, rows))
+                parsed.push(batch);
+        }
+        catch(...)
+        {
+            read_error = std::current_exception();
+        }
+        parsed.close();
+    });
+
+    std::thread writer([&]()
+    {
+        QueryBatch * batch;
+        while(searched.pop(batch))
+        {
+            if(!write_error)
+            {
+                try
+                {
+                    consume(*batch);
+                }
+                catch(...)
+                {
+                    // stop reading, drain the batches in flight
+                    write_error = std::current_exception();
+                    free.close();
+                }
+            }
+            free.push(batch);
+        }
+    });
+
+    QueryBatch * batch;
+    while(parsed.pop(batch))
+    {
+        size_t const count = batch->data.size();
+        if(batch->queries.rows < int(count))
+            batch->queries.create(rows, cols);
+        cv::Mat_<float> const queries = batch->queries.rowRange(0, count);
+        for(size_t i = 0; i < count; ++i)
+            densify(batch->data, i, batch->queries[i], cols);
+        search(engine, queries, batch->indices, batch->dists, query, threads, latencies);
+        searched.push(batch);
+    }
+    searched.close();
+    writer.join();
+    free.close();
+    reader.join();
+
+    if(read_error)
+        std::rethrow_exception(read_error);
+    if(write_error)
+        std::rethrow_exception(write_error);
+}
+
+#endif//QUERY_PIPELINE_H_INCLUDED
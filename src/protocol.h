@@ -0,0 +1,94 @@
+#ifndef SERVE_PROTOCOL_H_INCLUDED
+#define SERVE_PROTOCOL_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+// flann-serve wire format, native endian
+//
+// A connection that starts with request_magic uses the binary protocol :
+//  request  : RequestHeader, then for search
+//             dense  - rows x cols float
+//             sparse - (rows+1) x uint64 row offsets, nnz x uint32 feature indices (from 1), nnz x float values
+//  response : ResponseHeader, then for search
+//             rows x n int32 indices (-1 = none), rows x n float distances, rows x n double labels
+//             and for labels the same with n = 1, the training rows [nnz, nnz+rows) at distance 0
+//
+// Any other connection uses the libsvm line protocol :
+//  request  : one libsvm line per query, the label is ignored
+//  response : "<latency us> <index>:<label>:<distance> ..." per query, or "! <error>"
+// Line queries use the server's search parameters.
+//
+// Search requests over the limits below get status_invalid and the connection is closed. An n above the training
+// size is lowered to it, the response carries the lower n.
+
+uint32_t const request_magic  = 0x51524c46;// "FLRQ"
+uint32_t const response_magic = 0x53524c46;// "FLRS"
+
+enum RequestType : uint32_t
+{
+    request_search = 0,
+    request_info = 1,// size and dim of the training data
+    request_labels = 2,// labels of training rows, for a coordinator
+};
+
+enum ResponseStatus : uint32_t
+{
+    status_ok = 0,
+    status_invalid = 1,
+};
+
+uint32_t const request_max_rows = 1 << 16;
+uint64_t const request_max_values = 1 << 26;// dense rows x cols, sparse nnz and rows x n results
+int32_t const request_max_n = 1 << 12;
+
+struct RequestHeader
+{
+    uint32_t magic;
+    uint32_t type;
+    uint32_t id;// echoed in the response
+    uint32_t rows;
+    uint32_t cols;// dense row length, 0 for sparse rows
+    int32_t n;
+    uint64_t nnz;
+    int32_t checks;
+    float radius;// < 0 for knn search
+};
+
+struct ResponseHeader
+{
+    uint32_t magic;
+    uint32_t status;
+    uint32_t id;
+    uint32_t rows;
+    int32_t n;
+    uint32_t dim;
+    uint64_t size;// training rows
+    uint64_t latency_ns;// from receiving the request to sending the response
+};
+
+// Checks a search request against the limits, the payload size can't overflow within them
+inline bool request_in_limits(RequestHeader const & header)
+{
+    return (header.rows <= request_max_rows) && (header.cols <= request_max_values) && (header.nnz <= request_max_values)
+        && (header.n > 0) && (header.n <= request_max_n)
+        && (uint64_t(header.rows)*header.cols <= request_max_values) && (uint64_t(header.rows)*header.n <= request_max_values);
+}
+
+// Bytes following a request header
+inline size_t request_payload(RequestHeader const & header)
+{
+    if(header.type != request_search)
+        return 0;
+    if(header.cols > 0)
+        return size_t(header.rows)*header.cols*sizeof(float);
+    return (size_t(header.rows)+1)*sizeof(uint64_t) + header.nnz*(sizeof(uint32_t)+sizeof(float));
+}
+
+// Bytes following a response header
+inline size_t response_payload(ResponseHeader const & header)
+{
+    return size_t(header.rows)*header.n*(sizeof(int32_t)+sizeof(float)+sizeof(double));
+}
+
+#endif//SERVE_PROTOCOL_H_INCLUDED
@@ -0,0 +1,381 @@
+#ifndef FEATURE_QUANTIZE_H_INCLUDED
+#define FEATURE_QUANTIZE_H_INCLUDED
+
+#include "data.h"
+#include "reduce.h"
+#include "search.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEATURE_QUANTIZE_X86
+#endif
+
+// -- Reduced precision feature storage --
+
+enum Storage
+{
+    storage_float = 0,
+    storage_float16 = 1,
+    storage_int8 = 2,// per dimension scale and offset
+};
+
+// IEEE half precision, finite values only, round to nearest even
+// - scaling by 2^-112 moves the half exponent range onto the float one, denormals included
+inline uint16_t float_to_half(float f)
+{
+    uint32_t sign;
+    memcpy(&sign, &f, sizeof(sign));
+    float const scaled = std::min(std::abs(f), 65504.0f) * 0x1p-112f;
+    uint32_t bits;
+    memcpy(&bits, &scaled, sizeof(bits));
+    return ((sign >> 16) & 0x8000) | ((bits + 0xfff + ((bits >> 13) & 1)) >> 13);
+}
+
+inline float half_to_float(uint16_t h)
+{
+    uint32_t const bits = uint32_t(h & 0x7fff) << 13;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    f *= 0x1p112f;
+    return (h & 0x8000) ? -f : f;
+}
+
+// Training rows in float16 or int8, value = offset + scale*code for int8
+struct CompactMatrix
+{
+    int storage = storage_float;
+    int rows = 0;
+    int dim = 0;
+    std::vector<uint16_t> half;// rows x dim
+    std::vector<uint8_t> codes;// rows x dim
+    std::vector<float> offset;// dim
+    std::vector<float> scale;// dim, 1 for constant dimensions
+
+    explicit operator bool() const { return storage != storage_float; }
+
+    size_t bytes() const
+    {
+        return half.size()*sizeof(uint16_t) + codes.size() + (offset.size() + scale.size())*sizeof(float);
+    }
+};
+
+// Calls f(begin, end) for blocks of rows on threads workers
+template<typename F>
+void for_rows(size_t rows, unsigned threads, F const & f)
+{
+    std::atomic<size_t> next{0};
+    auto const worker = [&]()
+    {
+        for(size_t begin; (begin = next.fetch_add(256)) < rows;)
+            f(begin, std::min(rows, begin+256));
+    };
+    std::vector<std::thread> workers;
+    for(unsigned i = 1; i < threads; ++i)
+        workers.emplace_back(worker);
+    worker();
+    for(auto & w : workers)
+        w.join();
+}
+
+// Encodes the training rows, the float matrix is never materialized
+CompactMatrix compact(Data const & data, int storage, unsigned threads)
+{
+    CompactMatrix m;
+    m.storage = storage;
+    m.rows = data.size();
+    m.dim = data.dim;
+    size_t const dim = m.dim;
+
+    if(storage == storage_float16)
+    {
+        m.half.resize(data.size()*dim);
+        for_rows(data.size(), threads, [&](size_t begin, size_t end)
+        {
+            std::vector<float> row(dim);
+            for(size_t i = begin; i < end; ++i)
+            {
+                densify(data, i, row.data(), dim);
+                for(size_t j = 0; j < dim; ++j)
+                    m.half[i*dim+j] = float_to_half(row[j]);
+            }
+        });
+    }
+    else if(storage == storage_int8)
+    {
+        // per dimension range, merged over the workers
+        std::vector<float> lo(dim, std::numeric_limits<float>::max());
+        std::vector<float> hi(dim, std::numeric_limits<float>::lowest());
+        std::mutex mutex;
+        for_rows(data.size(), threads, [&](size_t begin, size_t end)
+        {
+            std::vector<float> row(dim);
+            std::vector<float> block_lo(dim, std::numeric_limits<float>::max());
+            std::vector<float> block_hi(dim, std::numeric_limits<float>::lowest());
+            for(size_t i = begin; i < end; ++i)
+            {
+                densify(data, i, row.data(), dim);
+                for(size_t j = 0; j < dim; ++j)
+                {
+                    block_lo[j] = std::min(block_lo[j], row[j]);
+                    block_hi[j] = std::max(block_hi[j], row[j]);
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            for(size_t j = 0; j < dim; ++j)
+            {
+                lo[j] = std::min(lo[j], block_lo[j]);
+                hi[j] = std::max(hi[j], block_hi[j]);
+            }
+        });
+        m.offset.resize(dim);
+        m.scale.resize(dim);
+        for(size_t j = 0; j < dim; ++j)
+        {
+            m.offset[j] = (lo[j] <= hi[j]) ? lo[j] : 0.0f;
+            m.scale[j] = (hi[j] > lo[j]) ? (hi[j] - lo[j])/255.0f : 1.0f;
+        }
+
+        m.codes.resize(data.size()*dim);
+        for_rows(data.size(), threads, [&](size_t begin, size_t end)
+        {
+            std::vector<float> row(dim);
+            for(size_t i = begin; i < end; ++i)
+            {
+                densify(data, i, row.data(), dim);
+                for(size_t j = 0; j < dim; ++j)
+                    m.codes[i*dim+j] = uint8_t(std::min(255.0f, std::max(0.0f, std::nearbyint((row[j] - m.offset[j])/m.scale[j]))));
+            }
+        });
+    }
+    return m;
+}
+
+// -- Distance kernels --
+//
+// Sums go to eight accumulators in a fixed order. A float16 row is converted to floats first, with F16C
+// when the CPU has it, picked at runtime like the exact search kernels.
+
+// out[j] = half_to_float(in[j]) for count values
+using HalfConverter = void (*)(uint16_t const * in, size_t count, float * out);
+
+void halves_generic(uint16_t const * in, size_t count, float * out)
+{
+    for(size_t j = 0; j < count; ++j)
+        out[j] = half_to_float(in[j]);
+}
+
+#ifdef FEATURE_QUANTIZE_X86
+
+// 8 values at a time, finite halves convert exactly as with half_to_float
+__attribute__((target("avx,f16c")))
+void halves_f16c(uint16_t const * in, size_t count, float * out)
+{
+    size_t j = 0;
+    for(; j + 8 <= count; j += 8)
+        _mm256_storeu_ps(out + j, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<__m128i const *>(in + j))));
+    for(; j < count; ++j)
+        out[j] = half_to_float(in[j]);
+}
+
+#endif//FEATURE_QUANTIZE_X86
+
+// Fastest conversion the CPU supports, name is set to its instruction set
+inline HalfConverter half_converter(char const ** name = nullptr)
+{
+    char const * isa = "generic";
+    HalfConverter converter = halves_generic;
+#ifdef FEATURE_QUANTIZE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"))
+    {
+        isa = "f16c";
+        converter = halves_f16c;
+    }
+#endif
+    if(name)
+        *name = isa;
+    return converter;
+}
+
+// row is converted into buffer, dim floats
+template<bool squared>
+inline float half_distance(float const * q, uint16_t const * row, int dim, HalfConverter convert, float * buffer)
+{
+    convert(row, dim, buffer);
+    float acc[8] = {};
+    int j = 0;
+    for(; j+8 <= dim; j += 8)
+    {
+        for(int l = 0; l < 8; ++l)
+        {
+            float const d = q[j+l] - buffer[j+l];
+            acc[l] += squared ? d*d : std::abs(d);
+        }
+    }
+    for(; j < dim; ++j)
+    {
+        float const d = q[j] - buffer[j];
+        acc[0] += squared ? d*d : std::abs(d);
+    }
+    return ((acc[0]+acc[1]) + (acc[2]+acc[3])) + ((acc[4]+acc[5]) + (acc[6]+acc[7]));
+}
+
+// q is the query in code units, (q - offset)/scale, w is scale^2 for L2 or scale for L1
+template<bool squared>
+inline float int8_distance(float const * q, float const * w, uint8_t const * row, int dim)
+{
+    float acc[8] = {};
+    int j = 0;
+    for(; j+8 <= dim; j += 8)
+    {
+        for(int l = 0; l < 8; ++l)
+        {
+            float const d = q[j+l] - float(row[j+l]);
+            acc[l] += w[j+l] * (squared ? d*d : std::abs(d));
+        }
+    }
+    for(; j < dim; ++j)
+    {
+        float const d = q[j] - float(row[j]);
+        acc[0] += w[j] * (squared ? d*d : std::abs(d));
+    }
+    return ((acc[0]+acc[1]) + (acc[2]+acc[3])) + ((acc[4]+acc[5]) + (acc[6]+acc[7]));
+}
+
+// Exact search over compact rows
+// - the best candidates by the compact distance are reranked by the float distance of the training rows
+// - without candidates (or training rows) the compact distances are returned
+// - supports L2 (squared, as flann reports it) and L1
+class CompactEngine : public Engine
+{
+public:
+    CompactEngine(CompactMatrix const & compact, int distance, Data const * train, int candidates)
+        : m_compact(compact)
+        , m_squared(distance == 1)
+        , m_distance(distance)
+        , m_train(train)
+        , m_candidates(train ? candidates : 0)
+        , m_convert(half_converter())
+    {
+        if((distance != 1) && (distance != 2))
+        {
+            std::cerr << "Compact storage supports distances 1 and 2 only\n";
+            throw std::runtime_error("");
+        }
+        if(m_compact.storage == storage_int8)
+        {
+            m_weights.resize(m_compact.dim);
+            for(int j = 0; j < m_compact.dim; ++j)
+                m_weights[j] = m_squared ? m_compact.scale[j]*m_compact.scale[j] : m_compact.scale[j];
+        }
+    }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        int const dim = m_compact.dim;
+        size_t const k = std::max(query.n, m_candidates);
+        std::vector<float> coded(dim);
+        std::vector<float> row(dim);
+        std::vector<float> converted(dim);
+        std::vector<std::pair<float, int>> heap;
+        for(int i = 0; i < queries.rows; ++i)
+        {
+            float const * q = queries[i];
+            if(m_compact.storage == storage_int8)
+                for(int j = 0; j < dim; ++j)
+                    coded[j] = (q[j] - m_compact.offset[j])/m_compact.scale[j];
+
+            // k best rows by the compact distance in a max heap
+            heap.clear();
+            bool const filter = (query.radius >= 0) && (m_candidates <= 0);
+            for(int r = 0; r < m_compact.rows; ++r)
+            {
+                float const d = distance(q, coded.data(), r, converted.data());
+                if(filter && (d > query.radius))
+                    continue;
+                if(heap.size() < k)
+                {
+                    heap.emplace_back(d, r);
+                    std::push_heap(heap.begin(), heap.end());
+                }
+                else if(d < heap.front().first)
+                {
+                    std::pop_heap(heap.begin(), heap.end());
+                    heap.back() = {d, r};
+                    std::push_heap(heap.begin(), heap.end());
+                }
+            }
+
+            if(m_candidates > 0)
+            {
+                for(auto & candidate : heap)
+                {
+                    float const * full = train_row(candidate.second, row.data());
+                    full_distance(m_distance, q, full, dim, candidate.first);
+                }
+                if(query.radius >= 0)
+                    heap.erase(std::remove_if(heap.begin(), heap.end(), [&query](std::pair<float, int> const & c)
+                    {
+                        return c.first > query.radius;
+                    }), heap.end());
+            }
+
+            size_t const count = std::min<size_t>(heap.size(), query.n);
+            std::partial_sort(heap.begin(), heap.begin()+count, heap.end());
+            for(int j = 0; j < query.n; ++j)
+            {
+                indices(i, j) = (size_t(j) < count) ? heap[j].second : -1;
+                dists(i, j) = (size_t(j) < count) ? heap[j].first : 0.0f;
+            }
+        }
+    }
+
+private:
+    // buffer holds dim floats for the converted float16 row
+    float distance(float const * q, float const * coded, int r, float * buffer) const
+    {
+        size_t const offset = size_t(r)*m_compact.dim;
+        if(m_compact.storage == storage_float16)
+            return m_squared
+                ? half_distance<true>(q, &m_compact.half[offset], m_compact.dim, m_convert, buffer)
+                : half_distance<false>(q, &m_compact.half[offset], m_compact.dim, m_convert, buffer);
+        return m_squared
+            ? int8_distance<true>(coded, m_weights.data(), &m_compact.codes[offset], m_compact.dim)
+            : int8_distance<false>(coded, m_weights.data(), &m_compact.codes[offset], m_compact.dim);
+    }
+
+    // Float training row r, in place for dense datasets
+    float const * train_row(int r, float * buffer) const
+    {
+        if(m_train->dense)
+            return m_train->dense + size_t(r)*m_train->dim;
+        densify(*m_train, r, buffer, m_compact.dim);
+        return buffer;
+    }
+
+    CompactMatrix const & m_compact;
+    bool const m_squared;
+    int const m_distance;
+    Data const * const m_train;
+    int const m_candidates;
+    HalfConverter const m_convert;
+    std::vector<float> m_weights;
+};
+
+#endif//FEATURE_QUANTIZE_H_INCLUDED
@@ -0,0 +1,63 @@
+#ifndef BOUNDED_QUEUE_H_INCLUDED
+#define BOUNDED_QUEUE_H_INCLUDED
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// Blocking FIFO with a fixed capacity
+// - push blocks while the queue is full, pop while it is empty
+// - after close, push drops items and pop drains what is left
+template<typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : m_capacity(capacity)
+    {
+    }
+
+    // Returns false if the queue was closed
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_full.wait(lock, [this]{ return m_closed || (m_items.size() < m_capacity); });
+        if(m_closed)
+            return false;
+        m_items.push_back(std::move(item));
+        m_not_empty.notify_one();
+        return true;
+    }
+
+    // Returns false when the queue is closed and empty
+    bool pop(T & item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_empty.wait(lock, [this]{ return m_closed || !m_items.empty(); });
+        if(m_items.empty())
+            return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+    }
+
+private:
+    size_t const m_capacity;
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+    std::deque<T> m_items;
+    bool m_closed = false;
+};
+
+#endif//BOUNDED_QUEUE_H_INCLUDED
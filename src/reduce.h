@@ -0,0 +1,357 @@
+#ifndef FEATURE_REDUCE_H_INCLUDED
+#define FEATURE_REDUCE_H_INCLUDED
+
+#include "data.h"
+#include "mapping.h"
+#include "matrix.h"
+#include "search.h"
+
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/flann/flann.hpp>
+
+// -- Dimensionality reduction --
+
+enum ReduceMethod
+{
+    reduce_none = 0,
+    reduce_pca = 1,
+    reduce_projection = 2,// sparse random projection
+};
+
+// Linear map of rows, reduced = (row - mean) * basis^T
+struct Reducer
+{
+    int method = reduce_none;
+    cv::Mat_<float> mean;// 1 x dim
+    cv::Mat_<float> basis;// k x dim
+
+    explicit operator bool() const { return method != reduce_none; }
+    int dim() const { return basis.cols; }
+    int k() const { return basis.rows; }
+
+    void apply(float const * row, float * reduced, float * centered) const
+    {
+        for(int j = 0; j < dim(); ++j)
+            centered[j] = row[j] - mean(0, j);
+        for(int i = 0; i < k(); ++i)
+        {
+            float const * b = basis[i];
+            float sum = 0;
+            for(int j = 0; j < dim(); ++j)
+                sum += centered[j]*b[j];
+            reduced[i] = sum;
+        }
+    }
+
+    // Reduces all rows of in on threads workers
+    cv::Mat_<float> apply(cv::Mat_<float> const & in, unsigned threads = 1) const
+    {
+        cv::Mat_<float> out(in.rows, k());
+        std::atomic<int> next{0};
+        auto const worker = [&]()
+        {
+            std::vector<float> centered(dim());
+            for(int begin; (begin = next.fetch_add(256)) < in.rows;)
+                for(int i = begin; i < std::min(in.rows, begin+256); ++i)
+                    apply(in[i], out[i], centered.data());
+        };
+        std::vector<std::thread> workers;
+        for(unsigned i = 1; i < threads; ++i)
+            workers.emplace_back(worker);
+        worker();
+        for(auto & w : workers)
+            w.join();
+        return out;
+    }
+};
+
+// Principal components of the training rows
+Reducer fit_pca(cv::Mat_<float> const & train, int k)
+{
+    cv::PCA const pca(train, cv::noArray(), cv::PCA::DATA_AS_ROW, k);
+    Reducer reducer;
+    reducer.method = reduce_pca;
+    reducer.mean = pca.mean;
+    reducer.basis = pca.eigenvectors;
+    return reducer;
+}
+
+// Sparse random projection (Achlioptas), entries sqrt(3/k) x {+1, 0, -1} with probabilities {1/6, 2/3, 1/6}
+Reducer random_projection(int dim, int k, uint64_t seed = 1)
+{
+    std::mt19937_64 random(seed);
+    std::uniform_int_distribution<int> die(0, 5);
+    float const scale = std::sqrt(3.0f/k);
+
+    Reducer reducer;
+    reducer.method = reduce_projection;
+    reducer.mean = cv::Mat_<float>::zeros(1, dim);
+    reducer.basis.create(k, dim);
+    for(int i = 0; i < k; ++i)
+    {
+        for(int j = 0; j < dim; ++j)
+        {
+            int const roll = die(random);
+            reducer.basis(i, j) = (roll == 0) ? scale : (roll == 1) ? -scale : 0.0f;
+        }
+    }
+    return reducer;
+}
+
+// -- Reducer sidecar --
+//
+// "<index>.reduce" next to a reduced index, native endian :
+//  header   : ReducerHeader
+//  mean     : dim x float, at a multiple of 64 bytes
+//  basis    : k x dim x float, at a multiple of 64 bytes
+//  features : rows x dim x float full precision training rows for reranking, at a multiple of 64 bytes
+// The index itself (and its bundle) holds the reduced training rows.
+
+char const reducer_magic[8] = {'F','L','A','N','N','R','E','D'};
+
+struct ReducerHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t method;
+    uint64_t dim;
+    uint64_t k;
+    uint64_t rows;
+    uint64_t mean;// section offsets
+    uint64_t basis;
+    uint64_t features;
+};
+
+inline std::string reducer_path(char const * index)
+{
+    return std::string(index) + ".reduce";
+}
+
+// Reducer with the mapped full precision training features
+struct Reduction
+{
+    Reducer reducer;
+    cv::Mat_<float> full;
+    std::shared_ptr<Mapping const> mapping;
+
+    explicit operator bool() const { return bool(reducer); }
+};
+
+void save_reduction(Reducer const & reducer, cv::Mat_<float> const & full, char const * filename)
+{
+    std::ofstream file(filename, std::ios::binary);
+    ReducerHeader header{};
+    memcpy(header.magic, reducer_magic, sizeof(reducer_magic));
+    header.version = 1;
+    header.method = reducer.method;
+    header.dim = reducer.dim();
+    header.k = reducer.k();
+    header.rows = full.rows;
+    header.mean = dataset_align(sizeof(header));
+    header.basis = dataset_align(header.mean + header.dim*sizeof(float));
+    header.features = dataset_align(header.basis + header.k*header.dim*sizeof(float));
+
+    auto const pad = [&file](uint64_t offset)
+    {
+        static char const zeros[64] = {};
+        file.write(zeros, offset - file.tellp());
+    };
+    auto const put = [&file](cv::Mat_<float> const & m)
+    {
+        for(int i = 0; i < m.rows; ++i)
+            file.write(reinterpret_cast<char const *>(m[i]), m.cols*sizeof(float));
+    };
+    file.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    pad(header.mean);
+    put(reducer.mean);
+    pad(header.basis);
+    put(reducer.basis);
+    pad(header.features);
+    put(full);
+    if(!file.flush())
+    {
+        std::cerr << "Can't write '" << filename << "'\n";
+        throw std::runtime_error("");
+    }
+}
+
+// Returns false if there is no sidecar
+bool load_reduction(char const * filename, Reduction & reduction)
+{
+    auto mapping = std::make_shared<Mapping const>(filename);
+    if(!*mapping)
+        return false;
+
+    ReducerHeader header{};
+    if(mapping->size() >= sizeof(header))
+        memcpy(&header, mapping->data(), sizeof(header));
+
+    // every section holds count floats within the mapping, at an aligned offset
+    uint64_t const available = mapping->size();
+    auto const fits = [available](uint64_t offset, uint64_t count)
+    {
+        return (offset % sizeof(float) == 0) && (offset <= available) && (count <= (available - offset)/sizeof(float));
+    };
+    // the sections are mapped as matrices of int rows and columns
+    bool const valid = (memcmp(header.magic, reducer_magic, sizeof(reducer_magic)) == 0) && (header.version == 1)
+        && (header.method != reduce_none) && (header.method <= reduce_projection)
+        && (header.dim > 0) && (header.dim <= INT_MAX) && (header.k > 0) && (header.k <= header.dim) && (header.rows <= INT_MAX)
+        && fits(header.mean, header.dim) && fits(header.basis, header.k*header.dim)
+        && fits(header.features, header.rows*header.dim);
+    if(!valid)
+    {
+        std::cerr << "Invalid reducer '" << filename << "'\n";
+        throw std::runtime_error("");
+    }
+
+    auto const section = [&mapping](uint64_t offset, int rows, int cols)
+    {
+        return cv::Mat_<float>(rows, cols, const_cast<float *>(reinterpret_cast<float const *>(mapping->data()+offset)));
+    };
+    reduction.reducer.method = header.method;
+    reduction.reducer.mean = section(header.mean, 1, header.dim);
+    reduction.reducer.basis = section(header.basis, header.k, header.dim);
+    reduction.full = section(header.features, header.rows, header.dim);
+    reduction.mapping = std::move(mapping);
+    return true;
+}
+
+// Features the index at path was built on
+// - train holds either the full precision or the already reduced rows
+// - reduction is filled from the sidecar of a reduced index
+cv::Mat_<float> index_features(Data const & train, char const * index, Reduction & reduction, unsigned threads)
+{
+    cv::Mat_<float> mat = dense(train);
+    if(!load_reduction(reducer_path(index).c_str(), reduction))
+        return mat;
+    if((mat.rows != reduction.full.rows) || ((mat.cols != reduction.reducer.dim()) && (mat.cols != reduction.reducer.k())))
+    {
+        std::cerr << "Reducer '" << reducer_path(index) << "' doesn't match the training data\n";
+        throw std::runtime_error("");
+    }
+    if(mat.cols == reduction.reducer.k())
+        return mat;
+    return reduction.reducer.apply(mat, threads);
+}
+
+// -- Reranking --
+
+inline bool rerank_supported(int distance)
+{
+    return (distance == 1) || (distance == 2) || (distance == 4);
+}
+
+// Distance as flann reports it, L2 is squared, returns false for unsupported distances
+inline bool full_distance(int distance, float const * a, float const * b, int dim, float & result)
+{
+    float sum = 0;
+    switch(distance)
+    {
+        case 1 :// L2
+            for(int j = 0; j < dim; ++j)
+                sum += (a[j]-b[j])*(a[j]-b[j]);
+            break;
+        case 2 :// L1
+            for(int j = 0; j < dim; ++j)
+                sum += std::abs(a[j]-b[j]);
+            break;
+        case 4 :// MAX
+            for(int j = 0; j < dim; ++j)
+                sum = std::max(sum, std::abs(a[j]-b[j]));
+            break;
+        default :
+            return false;
+    }
+    result = sum;
+    return true;
+}
+
+// Searches full precision queries in a reduced index
+// - the inner engine finds candidates per query, they are reranked by the full precision distance
+// - without candidates the reduced results are returned as they are
+class RerankEngine : public Engine
+{
+public:
+    RerankEngine(Engine & inner, Reduction const & reduction, int candidates, int distance)
+        : m_inner(inner)
+        , m_reduction(reduction)
+        , m_candidates(candidates)
+        , m_distance(distance)
+    {
+        if((candidates > 0) && !rerank_supported(distance))
+        {
+            std::cerr << "Reranking supports distances 1, 2 and 4 only\n";
+            throw std::runtime_error("");
+        }
+    }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        Reducer const & reducer = m_reduction.reducer;
+        cv::Mat_<float> reduced(queries.rows, reducer.k());
+        std::vector<float> centered(reducer.dim());
+        for(int i = 0; i < queries.rows; ++i)
+            reducer.apply(queries[i], reduced[i], centered.data());
+
+        if(m_candidates <= 0)
+        {
+            m_inner.search(reduced, indices, dists, query);
+            return;
+        }
+
+        Query candidates = query;
+        candidates.n = std::max(query.n, m_candidates);
+        candidates.radius = -1.0;
+        cv::Mat_<int> found(queries.rows, candidates.n);
+        cv::Mat_<float> found_dists(queries.rows, candidates.n);
+        m_inner.search(reduced, found, found_dists, candidates);
+
+        std::vector<std::pair<float, int>> ranked;
+        for(int i = 0; i < queries.rows; ++i)
+        {
+            ranked.clear();
+            for(int j = 0; j < candidates.n; ++j)
+            {
+                int const index = found(i, j);
+                if(index < 0)
+                    continue;
+                float d;
+                full_distance(m_distance, queries[i], m_reduction.full[index], reducer.dim(), d);
+                if((query.radius < 0) || (d <= query.radius))
+                    ranked.emplace_back(d, index);
+            }
+            size_t const count = std::min<size_t>(ranked.size(), query.n);
+            std::partial_sort(ranked.begin(), ranked.begin()+count, ranked.end());
+            for(int j = 0; j < query.n; ++j)
+            {
+                indices(i, j) = (size_t(j) < count) ? ranked[j].second : -1;
+                dists(i, j) = (size_t(j) < count) ? ranked[j].first : 0.0f;
+            }
+        }
+    }
+
+private:
+    Engine & m_inner;
+    Reduction const & m_reduction;
+    int const m_candidates;
+    int const m_distance;
+};
+
+#endif//FEATURE_REDUCE_H_INCLUDED
@@ -0,0 +1,354 @@
+#ifndef REMOTE_SHARDS_H_INCLUDED
+#define REMOTE_SHARDS_H_INCLUDED
+
+#include "data.h"
+#include "protocol.h"
+#include "search.h"
+#include "socket.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+#include <poll.h>
+
+// -- Remote shards --
+//
+// Scatter-gather search over flann-serve workers, every worker serves one shard of the training rows.
+// A batch of queries is sent to all workers at once and their replies are merged by distance.
+// The rows of a worker are numbered after the rows of the workers before it, list the workers in shard order.
+// A worker that doesn't reply before the deadline is left out of the batch, its connection is dropped
+// so a late reply isn't taken for the next one, and it is reconnected for the next batch.
+
+class RemoteEngine : public Engine
+{
+public:
+    // deadline in milliseconds per batch, 0 waits for every worker
+    // - all workers have to be up, they report their rows and the query dimension
+    RemoteEngine(std::vector<std::string> addresses, int deadline)
+        : m_addresses(std::move(addresses))
+        , m_deadline(deadline)
+    {
+        std::vector<int> fds(m_addresses.size(), -1);
+        RequestHeader header{};
+        header.magic = request_magic;
+        header.type = request_info;
+        std::vector<std::string> replies;
+        exchange(fds, {raw(header)}, replies, 0);
+
+        m_first.assign(1, 0);
+        for(size_t w = 0; w < m_addresses.size(); ++w)
+        {
+            ResponseHeader info;
+            if(!reply_header(replies[w], info))
+            {
+                std::cerr << "Worker '" << m_addresses[w] << "' doesn't reply\n";
+                throw std::runtime_error("");
+            }
+            if((w > 0) && (info.dim != m_dim))
+            {
+                std::cerr << "Worker '" << m_addresses[w] << "' has dimension " << info.dim << " instead of " << m_dim << '\n';
+                throw std::runtime_error("");
+            }
+            m_dim = info.dim;
+            m_first.push_back(m_first.back() + info.size);
+        }
+        m_pool.push_back(std::move(fds));
+    }
+
+    RemoteEngine(RemoteEngine const &) = delete;
+    RemoteEngine & operator=(RemoteEngine const &) = delete;
+
+    ~RemoteEngine()
+    {
+        for(auto const & fds : m_pool)
+            for(int fd : fds)
+                if(fd >= 0)
+                    close(fd);
+    }
+
+    size_t workers() const { return m_addresses.size(); }
+    size_t size() const { return m_first.back(); }
+    unsigned dim() const { return m_dim; }
+    // worker replies left out of a batch, late or failed
+    uint64_t missed() const { return m_missed; }
+
+    // Labels of all rows, without features
+    Data train()
+    {
+        size_t const chunk = 1 << 20;
+        Data data;
+        data.dim = m_dim;
+        data.labels.resize(size());
+        std::vector<int> fds = acquire();
+        std::vector<std::string> requests(workers());
+        std::vector<uint64_t> counts(workers());
+        std::vector<std::string> replies;
+        for(size_t offset = 0; ; offset += chunk)
+        {
+            bool more = false;
+            for(size_t w = 0; w < workers(); ++w)
+            {
+                size_t const rows = m_first[w+1] - m_first[w];
+                RequestHeader header{};
+                header.magic = request_magic;
+                header.type = request_labels;
+                header.nnz = std::min(offset, rows);
+                header.rows = std::min(offset + chunk, rows) - header.nnz;
+                counts[w] = header.rows;
+                requests[w] = raw(header);
+                more = more || (header.rows > 0);
+            }
+            if(!more)
+                break;
+            exchange(fds, requests, replies, 0);
+            for(size_t w = 0; w < workers(); ++w)
+            {
+                ResponseHeader header;
+                // the labels are copied to the rows that were asked for
+                if(!reply_header(replies[w], header) || (header.rows != counts[w]) || (header.n != 1))
+                {
+                    ++m_missed;
+                    std::cerr << "Worker '" << m_addresses[w] << "' doesn't send its labels\n";
+                    throw std::runtime_error("");
+                }
+                auto const labels = replies[w].data() + sizeof(header) + header.rows*(sizeof(int32_t)+sizeof(float));
+                memcpy(&data.labels[m_first[w] + offset], labels, header.rows*sizeof(double));
+            }
+        }
+        release(std::move(fds));
+        return data;
+    }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        RequestHeader header{};
+        header.magic = request_magic;
+        header.type = request_search;
+        header.id = ++m_id;
+        header.rows = queries.rows;
+        header.cols = queries.cols;
+        header.n = query.n;
+        header.checks = query.checks;
+        header.radius = query.radius;
+        std::string request = raw(header);
+        for(int i = 0; i < queries.rows; ++i)
+            request.append(reinterpret_cast<char const *>(queries[i]), queries.cols*sizeof(float));
+
+        std::vector<int> fds = acquire();
+        std::vector<std::string> replies;
+        exchange(fds, {request}, replies, m_deadline);
+        release(std::move(fds));
+
+        std::vector<std::vector<std::pair<float, int>>> merged(queries.rows);
+        for(size_t w = 0; w < workers(); ++w)
+        {
+            ResponseHeader reply;
+            // a shard smaller than n replies with fewer neighbors
+            if(!reply_header(replies[w], reply) || (reply.id != header.id) || (reply.rows != header.rows)
+                || (reply.n <= 0) || (reply.n > query.n))
+            {
+                ++m_missed;
+                continue;
+            }
+            int const n = reply.n;
+            auto const found = reinterpret_cast<int32_t const *>(replies[w].data() + sizeof(reply));
+            auto const found_dists = reinterpret_cast<float const *>(found + size_t(reply.rows)*n);
+            // neighbors are rows of the worker, -1 where there are fewer
+            int32_t const rows = m_first[w+1] - m_first[w];
+            if(std::any_of(found, found + size_t(reply.rows)*n, [rows](int32_t r) { return (r < -1) || (r >= rows); }))
+            {
+                ++m_missed;
+                continue;
+            }
+            int const first = m_first[w];
+            for(int i = 0; i < queries.rows; ++i)
+                for(int j = 0; j < n; ++j)
+                    if(found[i*n + j] >= 0)
+                        merged[i].emplace_back(found_dists[i*n + j], first + found[i*n + j]);
+        }
+        for(int i = 0; i < queries.rows; ++i)
+        {
+            auto & row = merged[i];
+            size_t const count = std::min<size_t>(row.size(), query.n);
+            std::partial_sort(row.begin(), row.begin()+count, row.end());
+            for(int j = 0; j < query.n; ++j)
+            {
+                indices(i, j) = (size_t(j) < count) ? row[j].second : -1;
+                dists(i, j) = (size_t(j) < count) ? row[j].first : 0.0f;
+            }
+        }
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static std::string raw(RequestHeader const & header)
+    {
+        return std::string(reinterpret_cast<char const *>(&header), sizeof(header));
+    }
+
+    // Returns false for a missing or failed reply
+    static bool reply_header(std::string const & reply, ResponseHeader & header)
+    {
+        if(reply.size() < sizeof(header))
+            return false;
+        memcpy(&header, reply.data(), sizeof(header));
+        return header.status == status_ok;
+    }
+
+    // Connections to every worker, one set per concurrent search
+    std::vector<int> acquire()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_pool.empty())
+            return std::vector<int>(workers(), -1);
+        std::vector<int> fds = std::move(m_pool.back());
+        m_pool.pop_back();
+        return fds;
+    }
+
+    void release(std::vector<int> fds)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pool.push_back(std::move(fds));
+    }
+
+    // Sends requests[w] (requests[0] to all if there is one) to every worker and receives the replies until the deadline
+    // - workers without a connection are connected first within the deadline, a missing reply is empty and its connection is closed
+    void exchange(std::vector<int> & fds, std::vector<std::string> const & requests, std::vector<std::string> & replies, int deadline)
+    {
+        auto const until = Clock::now() + std::chrono::milliseconds(deadline);
+        size_t const count = fds.size();
+        replies.assign(count, std::string());
+        std::vector<size_t> sent(count, 0);
+        std::vector<size_t> expected(count, sizeof(ResponseHeader));
+        std::vector<bool> done(count, false);
+        std::vector<bool> connecting(count, false);
+        size_t left = count;
+        for(size_t w = 0; w < count; ++w)
+        {
+            if(fds[w] < 0)
+            {
+                fds[w] = connect_address(m_addresses[w].c_str(), true);
+                connecting[w] = fds[w] >= 0;
+            }
+            if(fds[w] < 0)
+            {
+                done[w] = true;
+                --left;
+            }
+        }
+
+        auto const fail = [&](size_t w)
+        {
+            close(fds[w]);
+            fds[w] = -1;
+            replies[w].clear();
+            done[w] = true;
+            --left;
+        };
+
+        std::vector<pollfd> polls;
+        while(left > 0)
+        {
+            int timeout = -1;
+            if(deadline > 0)
+            {
+                auto const remaining = std::chrono::duration_cast<std::chrono::milliseconds>(until - Clock::now()).count();
+                if(remaining < 0)
+                    break;
+                timeout = remaining + 1;
+            }
+            polls.clear();
+            for(size_t w = 0; w < count; ++w)
+            {
+                std::string const & request = requests[(requests.size() == 1) ? 0 : w];
+                polls.push_back(pollfd{done[w] ? -1 : fds[w], short((sent[w] < request.size()) ? POLLOUT : POLLIN), 0});
+            }
+            if((poll(polls.data(), polls.size(), timeout) < 0) && (errno != EINTR))
+                break;
+
+            for(size_t w = 0; w < count; ++w)
+            {
+                if(done[w] || (polls[w].revents == 0))
+                    continue;
+                std::string const & request = requests[(requests.size() == 1) ? 0 : w];
+                if(connecting[w])
+                {
+                    int error = 0;
+                    socklen_t size = sizeof(error);
+                    if((getsockopt(fds[w], SOL_SOCKET, SO_ERROR, &error, &size) != 0) || (error != 0))
+                    {
+                        fail(w);
+                        continue;
+                    }
+                    connecting[w] = false;
+                }
+                if(sent[w] < request.size())
+                {
+                    ssize_t const sent_now = send(fds[w], request.data()+sent[w], request.size()-sent[w], MSG_NOSIGNAL);
+                    if(sent_now >= 0)
+                        sent[w] += sent_now;
+                    else if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+                        fail(w);
+                    continue;
+                }
+
+                char buffer[1 << 16];
+                std::string & reply = replies[w];
+                ssize_t const received = recv(fds[w], buffer, std::min(sizeof(buffer), expected[w]-reply.size()), 0);
+                if(received <= 0)
+                {
+                    if((received == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+                        fail(w);
+                    continue;
+                }
+                reply.append(buffer, received);
+                if((reply.size() == sizeof(ResponseHeader)) && (expected[w] == sizeof(ResponseHeader)))
+                {
+                    ResponseHeader header;
+                    memcpy(&header, reply.data(), sizeof(header));
+                    if(header.magic != response_magic)
+                    {
+                        fail(w);
+                        continue;
+                    }
+                    expected[w] += response_payload(header);
+                }
+                if(reply.size() == expected[w])
+                {
+                    done[w] = true;
+                    --left;
+                }
+            }
+        }
+
+        for(size_t w = 0; w < count; ++w)
+            if(!done[w])
+                fail(w);
+    }
+
+    std::vector<std::string> const m_addresses;
+    int const m_deadline;
+    unsigned m_dim = 0;
+    std::vector<size_t> m_first;// first row of every worker, then the row count
+    std::atomic<uint32_t> m_id{0};
+    std::atomic<uint64_t> m_missed{0};
+
+    std::mutex m_mutex;
+    std::vector<std::vector<int>> m_pool;
+};
+
+#endif//REMOTE_SHARDS_H_INCLUDED
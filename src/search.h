@@ -0,0 +1,132 @@
+#ifndef INDEX_SEARCH_H_INCLUDED
+#define INDEX_SEARCH_H_INCLUDED
+
+#include "metrics.h"
+
+#include <cstddef>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+// Search parameters shared by all engines
+struct Query
+{
+    int n;// neighbor count, result columns
+    double radius;// radius search when >= 0
+    int checks;
+};
+
+// Nearest neighbor search over a set of training rows
+// - search is called from several threads at once
+// - missing neighbors are reported as index -1
+class Engine
+{
+public:
+    virtual ~Engine() = default;
+
+    // Searches every row of queries, results go to the same rows of indices and dists (query.n columns)
+    virtual void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) = 0;
+};
+
+// Engine over a cv::flann::Index
+class FlannEngine : public Engine
+{
+public:
+    explicit FlannEngine(cv::flann::Index & index)
+        : m_index(index)
+    {
+    }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        cv::flann::SearchParams const params{query.checks};
+        indices.setTo(-1);
+        if(query.radius >= 0)
+        {
+            // flann does radius search one query at a time
+            for(int i = 0; i < queries.rows; ++i)
+            {
+                cv::Mat_<int> row_indices = indices.row(i);
+                cv::Mat_<float> row_dists = dists.row(i);
+                m_index.radiusSearch(queries.row(i), row_indices, row_dists, query.radius, query.n, params);
+            }
+        }
+        else
+        {
+            m_index.knnSearch(queries, indices, dists, query.n, params);
+        }
+    }
+
+private:
+    cv::flann::Index & m_index;
+};
+
+inline unsigned thread_count(int threads)
+{
+    return (threads > 0) ? threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Query rows per batch, keeps a dense batch around 64MB
+inline size_t batch_rows(size_t dim, unsigned threads)
+{
+    size_t const limit = (size_t(16) << 20) / std::max<size_t>(dim, 1);
+    return std::max<size_t>(threads, std::min<size_t>(limit, size_t(1024)*threads));
+}
+
+// Searches all rows of queries on threads workers
+// - workers take blocks of rows, every row has its own result slot so the results don't depend on scheduling
+// - indices and dists are reused when they have enough rows, results are in the first queries.rows rows
+// - with latencies, rows are searched one by one and timed, every query gets its own latency, the search
+//   then goes without the batching of blocks and the report says so
+void search(Engine & engine, cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists,
+    Query const & query, unsigned threads, LatencyHistogram * latencies = nullptr)
+{
+    if((indices.rows < queries.rows) || (indices.cols != query.n))
+        indices.create(queries.rows, query.n);
+    if((dists.rows < queries.rows) || (dists.cols != query.n))
+        dists.create(queries.rows, query.n);
+
+    int const block = std::max(1, std::min(64, queries.rows / int(4*threads)));
+    std::atomic<int> next{0};
+    auto const worker = [&]()
+    {
+        for(int begin; (begin = next.fetch_add(block)) < queries.rows;)
+        {
+            int const end = std::min(queries.rows, begin+block);
+            if(latencies)
+            {
+                for(int i = begin; i < end; ++i)
+                {
+                    cv::Mat_<int> row_indices = indices.rowRange(i, i+1);
+                    cv::Mat_<float> row_dists = dists.rowRange(i, i+1);
+                    auto const start = std::chrono::steady_clock::now();
+                    engine.search(queries.rowRange(i, i+1), row_indices, row_dists, query);
+                    latencies->add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+                }
+                continue;
+            }
+            cv::Mat_<int> block_indices = indices.rowRange(begin, end);
+            cv::Mat_<float> block_dists = dists.rowRange(begin, end);
+            engine.search(queries.rowRange(begin, end), block_indices, block_dists, query);
+        }
+    };
+
+    if(threads <= 1)
+    {
+        worker();
+        return;
+    }
+    std::vector<std::thread> workers;
+    for(unsigned i = 1; i < threads; ++i)
+        workers.emplace_back(worker);
+    worker();
+    for(auto & w : workers)
+        w.join();
+}
+
+#endif//INDEX_SEARCH_H_INCLUDED
@@ -0,0 +1,386 @@
+#ifndef INDEX_SHARDS_H_INCLUDED
+#define INDEX_SHARDS_H_INCLUDED
+
+#include "bundle.h"
+#include "data.h"
+#include "groundtruth.h"
+#include "matrix.h"
+#include "search.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+// -- Sharded index --
+//
+// The training rows split into contiguous shards, every shard is an index bundle of its own.
+// The index file is a text manifest :
+//  flann-shards 1
+//  distance <flann distance>
+//  dim <feature count>
+//  param <name>=<value>      build parameters, one line each
+//  shard <first row> <rows> <hash> <bundle>
+// Bundle names are relative to the manifest directory. The hash covers the shard rows and labels,
+// a rebuild keeps the bundles of shards with unchanged rows, parameters and distance.
+
+char const shards_magic[] = "flann-shards 1";
+
+inline bool is_manifest(char const * filename)
+{
+    std::ifstream file(filename);
+    std::string line;
+    return std::getline(file, line) && (line == shards_magic);
+}
+
+// Hash of the rows and labels of a shard
+inline uint64_t shard_hash(cv::Mat_<float> const & rows, double const * labels)
+{
+    uint64_t h = hash_seed;
+    for(int i = 0; i < rows.rows; ++i)
+    {
+        h = hash_floats(rows[i], rows.cols, h);
+        uint64_t bits;
+        memcpy(&bits, labels+i, sizeof(bits));
+        h = (h ^ (bits & 0xffffffff)) * 1099511628211ull;
+        h = (h ^ (bits >> 32)) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Calls f(i) for i in [0, count) on up to threads workers
+// - the first exception stops the workers and is rethrown once they are joined
+template<typename F>
+void for_each_shard(size_t count, unsigned threads, F const & f)
+{
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto const worker = [&]()
+    {
+        for(size_t i; (i = next.fetch_add(1)) < count;)
+        {
+            try
+            {
+                f(i);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if(!error)
+                    error = std::current_exception();
+                next = count;
+                return;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for(unsigned i = 1; i < std::min<size_t>(threads, count); ++i)
+        workers.emplace_back(worker);
+    worker();
+    for(auto & w : workers)
+        w.join();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+class ShardSet
+{
+public:
+    struct Shard
+    {
+        uint64_t first = 0;
+        uint64_t rows = 0;
+        uint64_t hash = 0;
+        std::string file;// bundle the shard was loaded from, empty if built
+        Data train;// mapped bundle data of a loaded shard
+        cv::Mat_<float> mat;
+        cv::flann::Index index;
+    };
+
+    size_t size() const { return m_shards.size(); }
+    Shard const & operator[](size_t i) const { return *m_shards[i]; }
+    int distance() const { return m_distance; }
+    unsigned dim() const { return m_dim; }
+    std::string const & params() const { return m_params; }
+    size_t built() const { return m_built; }
+
+    // Builds count shards of mat on threads workers
+    // - shards of the manifest at reuse with the same rows, parameters and distance are loaded instead
+    void build(cv::Mat_<float> const & mat, std::vector<double> const & labels, cv::flann::IndexParams const & params,
+        std::string const & params_text, int distance, size_t count, unsigned threads, char const * reuse = nullptr)
+    {
+        m_distance = distance;
+        m_dim = mat.cols;
+        m_params = params_text;
+        m_labels = labels;
+        m_shards.clear();
+        for(size_t s = 0; s < count; ++s)
+        {
+            auto shard = std::make_unique<Shard>();
+            shard->first = mat.rows*s/count;
+            shard->rows = mat.rows*(s+1)/count - shard->first;
+            shard->mat = mat.rowRange(shard->first, shard->first + shard->rows);
+            m_shards.push_back(std::move(shard));
+        }
+
+        Manifest old;
+        bool const reusable = reuse && read_manifest(reuse, old)
+            && (old.distance == distance) && (old.dim == m_dim) && (old.params == params_text);
+
+        std::atomic<size_t> built{0};
+        for_each_shard(count, threads, [&](size_t s)
+        {
+            Shard & shard = *m_shards[s];
+            shard.hash = shard_hash(shard.mat, labels.data() + shard.first);
+            if(reusable)
+            {
+                for(auto const & entry : old.shards)
+                {
+                    if((entry.first == shard.first) && (entry.rows == shard.rows) && (entry.hash == shard.hash)
+                        && shard.index.load(shard.mat, sibling(reuse, entry.file)))
+                    {
+                        shard.file = entry.file;
+                        return;
+                    }
+                }
+            }
+            shard.index.build(shard.mat, params, static_cast<cvflann::flann_distance_t>(distance));
+            ++built;
+        });
+        m_built = built;
+    }
+
+    // Writes the bundles of built shards as "<filename>.<shard>" and the manifest
+    void save(char const * filename, unsigned threads)
+    {
+        std::string const base = filename;
+        std::string const name = base.substr(base.find_last_of('/') + 1);
+        for_each_shard(m_shards.size(), threads, [&](size_t s)
+        {
+            Shard & shard = *m_shards[s];
+            std::string const file = name + '.' + std::to_string(s);
+            if(shard.file == file)
+                return;
+            std::vector<double> const labels(m_labels.begin() + shard.first, m_labels.begin() + shard.first + shard.rows);
+            save_bundle(shard.index, shard.mat, labels, m_params, sibling(filename, file).c_str());
+            shard.file = file;
+        });
+
+        std::ofstream out(filename);
+        out << shards_magic << "\ndistance " << m_distance << "\ndim " << m_dim << '\n';
+        std::istringstream params(m_params);
+        for(std::string line; std::getline(params, line);)
+            out << "param " << line << '\n';
+        for(auto const & shard : m_shards)
+            out << "shard " << shard->first << ' ' << shard->rows << ' ' << shard->hash << ' ' << shard->file << '\n';
+        if(!out.flush())
+        {
+            std::cerr << "Can't write '" << filename << "'\n";
+            throw std::runtime_error("");
+        }
+    }
+
+    // Loads all shard bundles of a manifest on threads workers
+    void load(char const * filename, unsigned threads)
+    {
+        Manifest manifest;
+        if(!read_manifest(filename, manifest))
+        {
+            std::cerr << "Invalid shard manifest '" << filename << "'\n";
+            throw std::runtime_error("");
+        }
+        m_distance = manifest.distance;
+        m_dim = manifest.dim;
+        m_params = manifest.params;
+        m_built = 0;
+        m_shards.clear();
+        for(auto const & entry : manifest.shards)
+        {
+            auto shard = std::make_unique<Shard>();
+            shard->first = entry.first;
+            shard->rows = entry.rows;
+            shard->hash = entry.hash;
+            shard->file = entry.file;
+            m_shards.push_back(std::move(shard));
+        }
+
+        std::atomic<bool> failed{false};
+        for_each_shard(m_shards.size(), threads, [&](size_t s)
+        {
+            Shard & shard = *m_shards[s];
+            std::string const path = sibling(filename, shard.file);
+            shard.train = load_bundle(path.c_str()).train;
+            shard.mat = dense(shard.train);
+            if((shard.train.size() != shard.rows) || (shard.train.dim != m_dim) || !shard.index.load(shard.mat, path))
+            {
+                std::cerr << "Shard '" << path << "' doesn't match the manifest\n";
+                failed = true;
+            }
+        });
+        if(failed)
+            throw std::runtime_error("");
+
+        m_labels.clear();
+        for(auto const & shard : m_shards)
+        {
+            if(shard->first != m_labels.size())
+            {
+                std::cerr << "Shards of '" << filename << "' are not contiguous\n";
+                throw std::runtime_error("");
+            }
+            m_labels.insert(m_labels.end(), shard->train.labels.begin(), shard->train.labels.end());
+        }
+    }
+
+    // Labels of all shards by global row, without features
+    Data train() const
+    {
+        Data data;
+        data.labels = m_labels;
+        data.dim = m_dim;
+        return data;
+    }
+
+    // Copy of all shard rows, for exact neighbors
+    cv::Mat_<float> features() const
+    {
+        cv::Mat_<float> mat(m_labels.size(), m_dim);
+        for(auto const & shard : m_shards)
+        {
+            cv::Mat_<float> rows = mat.rowRange(shard->first, shard->first + shard->rows);
+            shard->mat.copyTo(rows);
+        }
+        return mat;
+    }
+
+    cv::flann::Index & index(size_t i) { return m_shards[i]->index; }
+
+    // Bundle of shard i of a manifest, empty if there is no such shard
+    static std::string bundle(char const * filename, size_t i)
+    {
+        Manifest manifest;
+        if(!read_manifest(filename, manifest) || (i >= manifest.shards.size()))
+            return std::string();
+        return sibling(filename, manifest.shards[i].file);
+    }
+
+private:
+    struct Manifest
+    {
+        struct Entry
+        {
+            uint64_t first, rows, hash;
+            std::string file;
+        };
+        int distance = 0;
+        unsigned dim = 0;
+        std::string params;
+        std::vector<Entry> shards;
+    };
+
+    // Path of a file next to the manifest
+    static std::string sibling(char const * manifest, std::string const & file)
+    {
+        std::string const path = manifest;
+        size_t const slash = path.find_last_of('/');
+        return (slash == std::string::npos) ? file : path.substr(0, slash+1) + file;
+    }
+
+    static bool read_manifest(char const * filename, Manifest & manifest)
+    {
+        std::ifstream in(filename);
+        std::string line;
+        if(!std::getline(in, line) || (line != shards_magic))
+            return false;
+        while(std::getline(in, line))
+        {
+            std::istringstream fields(line);
+            std::string key;
+            fields >> key;
+            if(key == "distance")
+                fields >> manifest.distance;
+            else if(key == "dim")
+                fields >> manifest.dim;
+            else if(key == "param")
+                manifest.params += line.substr(6) + '\n';
+            else if(key == "shard")
+            {
+                Manifest::Entry entry;
+                if(!(fields >> entry.first >> entry.rows >> entry.hash >> entry.file))
+                    return false;
+                manifest.shards.push_back(entry);
+            }
+        }
+        return !manifest.shards.empty();
+    }
+
+    int m_distance = 0;
+    unsigned m_dim = 0;
+    std::string m_params;
+    std::vector<double> m_labels;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    size_t m_built = 0;
+};
+
+// Searches every shard and merges the results by distance, indices are global rows
+// - a skipped shard is left out, its rows are the held out queries of a cross-validation fold
+class ShardedEngine : public Engine
+{
+public:
+    explicit ShardedEngine(ShardSet & shards, size_t skip = size_t(-1))
+        : m_shards(shards)
+        , m_skip(skip)
+    {
+    }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        std::vector<std::vector<std::pair<float, int>>> merged(queries.rows);
+        cv::Mat_<int> shard_indices(queries.rows, query.n);
+        cv::Mat_<float> shard_dists(queries.rows, query.n);
+        for(size_t s = 0; s < m_shards.size(); ++s)
+        {
+            if(s == m_skip)
+                continue;
+            FlannEngine engine(m_shards.index(s));
+            engine.search(queries, shard_indices, shard_dists, query);
+            int const first = m_shards[s].first;
+            for(int i = 0; i < queries.rows; ++i)
+                for(int j = 0; j < query.n; ++j)
+                    if(shard_indices(i, j) >= 0)
+                        merged[i].emplace_back(shard_dists(i, j), first + shard_indices(i, j));
+        }
+        for(int i = 0; i < queries.rows; ++i)
+        {
+            auto & row = merged[i];
+            size_t const count = std::min<size_t>(row.size(), query.n);
+            std::partial_sort(row.begin(), row.begin()+count, row.end());
+            for(int j = 0; j < query.n; ++j)
+            {
+                indices(i, j) = (size_t(j) < count) ? row[j].second : -1;
+                dists(i, j) = (size_t(j) < count) ? row[j].first : 0.0f;
+            }
+        }
+    }
+
+private:
+    ShardSet & m_shards;
+    size_t const m_skip;
+};
+
+#endif//INDEX_SHARDS_H_INCLUDED
@@ -0,0 +1,205 @@
+#ifndef LOCAL_SOCKET_H_INCLUDED
+#define LOCAL_SOCKET_H_INCLUDED
+
+#include <cerrno>
+#include <cstring>
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Addresses are Unix domain socket paths or "host:port" for TCP, "*:port" listens on all interfaces
+
+inline sockaddr_un unix_address(char const * path)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path))
+    {
+        std::cerr << "Socket path '" << path << "' is too long\n";
+        throw std::runtime_error("");
+    }
+    strcpy(address.sun_path, path);
+    return address;
+}
+
+inline void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// connect() of a non-blocking socket that is still in progress, completion is signaled by POLLOUT and SO_ERROR
+inline bool connect_started(int fd, sockaddr const * address, socklen_t size, bool nonblocking)
+{
+    if(nonblocking)
+        set_nonblocking(fd);
+    return (connect(fd, address, size) == 0) || (nonblocking && (errno == EINPROGRESS));
+}
+
+// Listening Unix domain socket, a stale socket file is replaced
+inline int listen_unix(char const * path)
+{
+    auto const address = unix_address(path);
+    int const fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if((fd < 0) || (bind(fd, reinterpret_cast<sockaddr const *>(&address), sizeof(address)) != 0) || (listen(fd, 128) != 0))
+    {
+        std::cerr << "Can't listen on '" << path << "' : " << strerror(errno) << '\n';
+        throw std::runtime_error("");
+    }
+    return fd;
+}
+
+// Returns -1 on failure, a non-blocking socket may still be connecting
+inline int connect_unix(char const * path, bool nonblocking = false)
+{
+    auto const address = unix_address(path);
+    int const fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if((fd >= 0) && !connect_started(fd, reinterpret_cast<sockaddr const *>(&address), sizeof(address), nonblocking))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline bool is_tcp_address(char const * address)
+{
+    char const * const colon = strrchr(address, ':');
+    return colon && (colon[1] != '\0') && !strchr(address, '/') && (strspn(colon+1, "0123456789") == strlen(colon+1));
+}
+
+inline addrinfo * resolve_tcp(char const * address, bool passive)
+{
+    std::string const text = address;
+    size_t const colon = text.rfind(':');
+    std::string host = text.substr(0, colon);
+    std::string const port = text.substr(colon+1);
+    if(host == "*")
+        host.clear();
+    if((host.size() >= 2) && (host.front() == '[') && (host.back() == ']'))
+        host = host.substr(1, host.size()-2);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    addrinfo * result = nullptr;
+    int const error = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result);
+    if(error != 0)
+    {
+        std::cerr << "Can't resolve '" << address << "' : " << gai_strerror(error) << '\n';
+        throw std::runtime_error("");
+    }
+    return result;
+}
+
+// Small requests and replies are sent right away
+inline void set_nodelay(int fd)
+{
+    int const on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+inline int listen_tcp(char const * address)
+{
+    addrinfo * const addresses = resolve_tcp(address, true);
+    int fd = -1;
+    for(addrinfo * a = addresses; a && (fd < 0); a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        int const on = 1;
+        if((fd >= 0) && ((setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0)
+            || (bind(fd, a->ai_addr, a->ai_addrlen) != 0) || (listen(fd, 128) != 0)))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if(fd < 0)
+    {
+        std::cerr << "Can't listen on '" << address << "' : " << strerror(errno) << '\n';
+        throw std::runtime_error("");
+    }
+    return fd;
+}
+
+// Returns -1 on failure, a non-blocking socket may still be connecting
+inline int connect_tcp(char const * address, bool nonblocking = false)
+{
+    addrinfo * const addresses = resolve_tcp(address, false);
+    int fd = -1;
+    for(addrinfo * a = addresses; a && (fd < 0); a = a->ai_next)
+    {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if((fd >= 0) && !connect_started(fd, a->ai_addr, a->ai_addrlen, nonblocking))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if(fd >= 0)
+        set_nodelay(fd);
+    return fd;
+}
+
+inline int listen_address(char const * address)
+{
+    return is_tcp_address(address) ? listen_tcp(address) : listen_unix(address);
+}
+
+// Returns -1 on failure, a non-blocking socket may still be connecting
+inline int connect_address(char const * address, bool nonblocking = false)
+{
+    return is_tcp_address(address) ? connect_tcp(address, nonblocking) : connect_unix(address, nonblocking);
+}
+
+// Blocking send of the whole buffer
+inline bool write_all(int fd, void const * data, size_t size)
+{
+    auto p = static_cast<char const *>(data);
+    while(size > 0)
+    {
+        ssize_t const count = send(fd, p, size, MSG_NOSIGNAL);
+        if(count < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        p += count;
+        size -= count;
+    }
+    return true;
+}
+
+// Blocking receive of the whole buffer
+inline bool read_all(int fd, void * data, size_t size)
+{
+    auto p = static_cast<char *>(data);
+    while(size > 0)
+    {
+        ssize_t const count = recv(fd, p, size, 0);
+        if(count <= 0)
+        {
+            if((count < 0) && (errno == EINTR))
+                continue;
+            return false;
+        }
+        p += count;
+        size -= count;
+    }
+    return true;
+}
+
+#endif//LOCAL_SOCKET_H_INCLUDED
@@ -0,0 +1,485 @@
+#ifndef SPARSE_INDEX_H_INCLUDED
+#define SPARSE_INDEX_H_INCLUDED
+
+#include "data.h"
+#include "metrics.h"
+#include "search.h"
+
+#include <cmath>
+#include <cstdint>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+// -- Sparse inverted index --
+//
+// Posting lists of (row, value) per feature, built from the sparse rows without densifying them.
+// Search is exact, only the posting lists of the query features are read :
+//  L2     : |q|^2 + |x|^2 - 2 q.x, rows without a common feature are taken by ascending |x|
+//  dot    : -q.x with MaxScore pruning
+//  cosine : 1 - q.x / (|q| |x|), rows are normalized at build time, MaxScore pruning
+// Distances are reported as above, L2 is squared like flann's.
+
+enum SparseMetric
+{
+    sparse_l2 = 1,
+    sparse_dot = 2,
+    sparse_cosine = 3,
+};
+
+// Calls f(feature, value) for the nonzero features of row i, features are 0-based
+template<typename F>
+void for_nonzeros(Data const & data, size_t i, F const & f)
+{
+    if(data.dense)
+    {
+        float const * row = data.dense + i*data.dim;
+        for(unsigned j = 0; j < data.dim; ++j)
+            if(row[j] != 0)
+                f(j, row[j]);
+    }
+    else
+    {
+        // indices are 1-based, the loaders reject 0
+        for(size_t j = data.offsets[i]; j < data.offsets[i+1]; ++j)
+            if((data.values[j] != 0) && (data.indices[j] != 0))
+                f(data.indices[j]-1, data.values[j]);
+    }
+}
+
+class SparseIndex
+{
+public:
+    int metric() const { return m_metric; }
+    unsigned dim() const { return m_dim; }
+    size_t rows() const { return m_norms.size(); }
+    size_t postings() const { return m_ids.size(); }
+    size_t bytes() const
+    {
+        return m_offsets.size()*sizeof(size_t) + m_ids.size()*(sizeof(uint32_t) + sizeof(float))
+            + (m_max.size() + m_min.size() + m_norms.size())*sizeof(float) + m_by_norm.size()*sizeof(uint32_t);
+    }
+
+    // Posting list of a feature
+    size_t begin(unsigned feature) const { return m_offsets[feature]; }
+    size_t end(unsigned feature) const { return m_offsets[feature+1]; }
+    uint32_t const * ids() const { return m_ids.data(); }
+    float const * values() const { return m_values.data(); }
+    float max(unsigned feature) const { return m_max[feature]; }
+    float min(unsigned feature) const { return m_min[feature]; }
+
+    // Squared norm of a row, 1 or 0 for cosine
+    float norm(size_t row) const { return m_norms[row]; }
+    // Rows by ascending norm, L2 only
+    std::vector<uint32_t> const & by_norm() const { return m_by_norm; }
+
+    void build(Data const & data, int metric)
+    {
+        if((metric < sparse_l2) || (metric > sparse_cosine))
+        {
+            std::cerr << "Invalid sparse metric " << metric << '\n';
+            throw std::runtime_error("");
+        }
+        if(data.size() > std::numeric_limits<uint32_t>::max())
+        {
+            std::cerr << "Sparse index supports up to " << std::numeric_limits<uint32_t>::max() << " rows\n";
+            throw std::runtime_error("");
+        }
+        m_metric = metric;
+        m_dim = data.dim;
+
+        // rows go to the posting lists in order, the lists stay sorted by row
+        m_offsets.assign(size_t(m_dim)+1, 0);
+        m_norms.assign(data.size(), 0.0f);
+        for(size_t i = 0; i < data.size(); ++i)
+        {
+            double norm = 0;
+            for_nonzeros(data, i, [&](unsigned j, float v)
+            {
+                ++m_offsets[j+1];
+                norm += double(v)*v;
+            });
+            m_norms[i] = norm;
+        }
+        for(unsigned j = 0; j < m_dim; ++j)
+            m_offsets[j+1] += m_offsets[j];
+
+        m_ids.resize(m_offsets[m_dim]);
+        m_values.resize(m_offsets[m_dim]);
+        m_max.assign(m_dim, 0.0f);
+        m_min.assign(m_dim, 0.0f);
+        std::vector<size_t> next(m_offsets.begin(), m_offsets.end()-1);
+        for(size_t i = 0; i < data.size(); ++i)
+        {
+            float const scale = ((metric == sparse_cosine) && (m_norms[i] > 0)) ? 1/std::sqrt(m_norms[i]) : 1.0f;
+            for_nonzeros(data, i, [&](unsigned j, float v)
+            {
+                size_t const p = next[j]++;
+                m_ids[p] = i;
+                m_values[p] = v*scale;
+                m_max[j] = std::max(m_max[j], v*scale);
+                m_min[j] = std::min(m_min[j], v*scale);
+            });
+            if(metric == sparse_cosine)
+                m_norms[i] = (m_norms[i] > 0) ? 1.0f : 0.0f;
+        }
+
+        m_by_norm.clear();
+        if(metric == sparse_l2)
+        {
+            m_by_norm.resize(data.size());
+            for(size_t i = 0; i < data.size(); ++i)
+                m_by_norm[i] = i;
+            std::stable_sort(m_by_norm.begin(), m_by_norm.end(), [this](uint32_t a, uint32_t b)
+            {
+                return m_norms[a] < m_norms[b];
+            });
+        }
+    }
+
+private:
+    int m_metric = sparse_l2;
+    unsigned m_dim = 0;
+    std::vector<size_t> m_offsets;
+    std::vector<uint32_t> m_ids;
+    std::vector<float> m_values;
+    std::vector<float> m_max;// per feature value range
+    std::vector<float> m_min;
+    std::vector<float> m_norms;
+    std::vector<uint32_t> m_by_norm;
+};
+
+// Searches a sparse index, queries come as sparse rows or as dense rows whose zeros are skipped
+class SparseEngine : public Engine
+{
+public:
+    explicit SparseEngine(SparseIndex const & index)
+        : m_index(index)
+    {
+    }
+
+    void search(cv::Mat_<float> const & queries, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query) override
+    {
+        Scratch scratch = acquire();
+        for(int i = 0; i < queries.rows; ++i)
+        {
+            scratch.terms.clear();
+            double norm = 0;
+            for(int j = 0; j < queries.cols; ++j)
+            {
+                float const v = queries(i, j);
+                norm += double(v)*v;
+                if((v != 0) && (unsigned(j) < m_index.dim()))
+                    scratch.terms.emplace_back(j, v);
+            }
+            search_terms(scratch, norm, query, indices[i], dists[i]);
+        }
+        release(std::move(scratch));
+    }
+
+    // Searches rows [begin, end) of queries, results go to rows from 0
+    void search(Data const & queries, size_t begin, size_t end, cv::Mat_<int> & indices, cv::Mat_<float> & dists, Query const & query)
+    {
+        Scratch scratch = acquire();
+        for(size_t i = begin; i < end; ++i)
+        {
+            scratch.terms.clear();
+            double norm = 0;
+            for_nonzeros(queries, i, [&](unsigned j, float v)
+            {
+                // features the index doesn't have only add to the query norm
+                norm += double(v)*v;
+                if(j < m_index.dim())
+                    scratch.terms.emplace_back(j, v);
+            });
+            search_terms(scratch, norm, query, indices[i-begin], dists[i-begin]);
+        }
+        release(std::move(scratch));
+    }
+
+private:
+    typedef std::pair<float, int> Candidate;// distance, row
+
+    struct Cursor
+    {
+        uint32_t const * ids;
+        float const * values;
+        size_t size;
+        size_t pos;
+        float weight;// query value
+        float bound;// highest contribution to the score
+
+        uint32_t id() const { return (pos < size) ? ids[pos] : std::numeric_limits<uint32_t>::max(); }
+    };
+
+    struct Scratch
+    {
+        explicit Scratch(size_t rows)
+            : seen(rows, 0)
+        {
+        }
+
+        std::vector<std::pair<unsigned, float>> terms;
+        std::vector<Cursor> cursors;
+        std::vector<float> prefix;
+        std::vector<Candidate> heap;
+        std::vector<char> seen;
+        std::vector<float> dots;
+        std::vector<uint32_t> touched;
+    };
+
+    // Scratch buffers, one per concurrent search, kept between calls
+    Scratch acquire()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_pool.empty())
+            return Scratch(m_index.rows());
+        Scratch scratch = std::move(m_pool.back());
+        m_pool.pop_back();
+        return scratch;
+    }
+
+    void release(Scratch scratch)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pool.push_back(std::move(scratch));
+    }
+
+    // Keeps the n best candidates in a max heap
+    static void offer(std::vector<Candidate> & heap, size_t n, Candidate const & c)
+    {
+        if(heap.size() < n)
+        {
+            heap.push_back(c);
+            std::push_heap(heap.begin(), heap.end());
+        }
+        else if(c < heap.front())
+        {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = c;
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    void search_terms(Scratch & s, double norm, Query const & query, int * indices, float * dists) const
+    {
+        size_t const n = query.n;
+        s.heap.clear();
+        if(m_index.metric() == sparse_l2)
+            search_l2(s, norm, query);
+        else
+            search_maxscore(s, norm, query);
+
+        size_t const count = std::min(s.heap.size(), n);
+        std::sort_heap(s.heap.begin(), s.heap.end());
+        for(size_t j = 0; j < n; ++j)
+        {
+            indices[j] = (j < count) ? s.heap[j].second : -1;
+            dists[j] = (j < count) ? s.heap[j].first : 0.0f;
+        }
+    }
+
+    // Accumulates q.x of the rows sharing a feature with the query, the rest by ascending norm
+    void search_l2(Scratch & s, double norm, Query const & query) const
+    {
+        if(s.dots.size() != m_index.rows())
+            s.dots.assign(m_index.rows(), 0.0f);
+        s.touched.clear();
+        for(auto const & term : s.terms)
+        {
+            for(size_t p = m_index.begin(term.first); p < m_index.end(term.first); ++p)
+            {
+                uint32_t const id = m_index.ids()[p];
+                if(!s.seen[id])
+                {
+                    s.seen[id] = 1;
+                    s.touched.push_back(id);
+                }
+                s.dots[id] += term.second*m_index.values()[p];
+            }
+        }
+
+        bool const radius = query.radius >= 0;
+        for(auto id : s.touched)
+        {
+            float const d = std::max(0.0, norm + m_index.norm(id) - 2.0*s.dots[id]);
+            if(!radius || (d <= query.radius))
+                offer(s.heap, query.n, Candidate(d, id));
+        }
+        for(auto id : m_index.by_norm())
+        {
+            if(s.seen[id])
+                continue;
+            Candidate const c(norm + m_index.norm(id), id);
+            if((radius && (c.first > query.radius)) || ((s.heap.size() == size_t(query.n)) && !(c < s.heap.front())))
+                break;
+            offer(s.heap, query.n, c);
+        }
+
+        for(auto id : s.touched)
+        {
+            s.seen[id] = 0;
+            s.dots[id] = 0;
+        }
+    }
+
+    // Document at a time MaxScore over the query posting lists
+    // - lists are ordered by their score bound, a prefix of lists whose bounds sum below the
+    //   current n-th best score can't make a row enter the results on its own (non-essential),
+    //   rows are taken from the other lists and completed from the non-essential lists while they still can qualify
+    void search_maxscore(Scratch & s, double norm, Query const & query) const
+    {
+        bool const cosine = m_index.metric() == sparse_cosine;
+        float const scale = (cosine && (norm > 0)) ? 1/std::sqrt(norm) : 1.0f;
+        // distance = base - score
+        float const base = cosine ? 1.0f : 0.0f;
+        float const lowest = -std::numeric_limits<float>::infinity();
+        float const floor = (query.radius >= 0) ? base - query.radius : lowest;
+        size_t const n = query.n;
+
+        s.cursors.clear();
+        for(auto const & term : s.terms)
+        {
+            size_t const begin = m_index.begin(term.first);
+            size_t const size = m_index.end(term.first) - begin;
+            float const w = term.second*scale;
+            if(size > 0)
+                s.cursors.push_back(Cursor{m_index.ids() + begin, m_index.values() + begin, size, 0, w,
+                    std::max({0.0f, w*m_index.max(term.first), w*m_index.min(term.first)})});
+        }
+        std::sort(s.cursors.begin(), s.cursors.end(), [](Cursor const & a, Cursor const & b)
+        {
+            return a.bound < b.bound;
+        });
+        s.prefix.resize(s.cursors.size());
+        float sum = 0;
+        for(size_t i = 0; i < s.cursors.size(); ++i)
+            s.prefix[i] = sum += s.cursors[i].bound;
+
+        // score a row needs to enter the results, ties go to the lower row
+        auto const threshold = [&]()
+        {
+            return std::max(floor, (s.heap.size() < n) ? lowest : base - s.heap.front().first);
+        };
+        size_t essential = 0;
+        for(float t = threshold(); (essential < s.cursors.size()) && (s.prefix[essential] < t);)
+            ++essential;
+
+        while(essential < s.cursors.size())
+        {
+            uint32_t doc = std::numeric_limits<uint32_t>::max();
+            for(size_t i = essential; i < s.cursors.size(); ++i)
+                doc = std::min(doc, s.cursors[i].id());
+            if(doc == std::numeric_limits<uint32_t>::max())
+                break;
+
+            float score = 0;
+            for(size_t i = essential; i < s.cursors.size(); ++i)
+            {
+                Cursor & c = s.cursors[i];
+                if(c.id() == doc)
+                    score += c.weight*c.values[c.pos++];
+            }
+            float const t = threshold();
+            bool pruned = false;
+            for(size_t i = essential; i-- > 0;)
+            {
+                if(score + s.prefix[i] < t)
+                {
+                    pruned = true;
+                    break;
+                }
+                Cursor & c = s.cursors[i];
+                c.pos = std::lower_bound(c.ids + c.pos, c.ids + c.size, doc) - c.ids;
+                if(c.id() == doc)
+                    score += c.weight*c.values[c.pos];
+            }
+            if(pruned || (score < floor))
+                continue;
+
+            offer(s.heap, n, Candidate(base - score, doc));
+            for(float t = threshold(); (essential < s.cursors.size()) && (s.prefix[essential] < t);)
+                ++essential;
+        }
+
+        // rows without a common feature score 0, they beat negative scores
+        bool const zeros = (0 >= floor) && ((s.heap.size() < n) || (s.heap.front().first > base));
+        if(!zeros)
+            return;
+        for(auto const & c : s.cursors)
+            for(size_t p = 0; p < c.size; ++p)
+                s.seen[c.ids[p]] = 1;
+        for(size_t id = 0; id < m_index.rows(); ++id)
+        {
+            if(s.seen[id])
+                continue;
+            if((s.heap.size() == n) && !(Candidate(base, id) < s.heap.front()))
+                break;
+            offer(s.heap, n, Candidate(base, id));
+        }
+        for(auto const & c : s.cursors)
+            for(size_t p = 0; p < c.size; ++p)
+                s.seen[c.ids[p]] = 0;
+    }
+
+    SparseIndex const & m_index;
+
+    std::mutex m_mutex;
+    std::vector<Scratch> m_pool;
+};
+
+// Searches rows [begin, end) of queries on threads workers, like search() over dense rows
+// - with latencies, rows are searched one by one and timed
+void search(SparseEngine & engine, Data const & queries, size_t begin, size_t end, cv::Mat_<int> & indices, cv::Mat_<float> & dists,
+    Query const & query, unsigned threads, LatencyHistogram * latencies = nullptr)
+{
+    int const rows = end - begin;
+    if((indices.rows < rows) || (indices.cols != query.n))
+        indices.create(rows, query.n);
+    if((dists.rows < rows) || (dists.cols != query.n))
+        dists.create(rows, query.n);
+
+    int const block = std::max(1, std::min(64, rows / int(4*threads)));
+    std::atomic<int> next{0};
+    auto const worker = [&]()
+    {
+        for(int first; (first = next.fetch_add(block)) < rows;)
+        {
+            int const last = std::min(rows, first+block);
+            if(latencies)
+            {
+                for(int i = first; i < last; ++i)
+                {
+                    cv::Mat_<int> row_indices = indices.rowRange(i, i+1);
+                    cv::Mat_<float> row_dists = dists.rowRange(i, i+1);
+                    auto const start = std::chrono::steady_clock::now();
+                    engine.search(queries, begin+i, begin+i+1, row_indices, row_dists, query);
+                    latencies->add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+                }
+                continue;
+            }
+            cv::Mat_<int> block_indices = indices.rowRange(first, last);
+            cv::Mat_<float> block_dists = dists.rowRange(first, last);
+            engine.search(queries, begin+first, begin+last, block_indices, block_dists, query);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for(unsigned i = 1; i < threads; ++i)
+        workers.emplace_back(worker);
+    worker();
+    for(auto & w : workers)
+        w.join();
+}
+
+#endif//SPARSE_INDEX_H_INCLUDED
@@ -0,0 +1,167 @@
+#ifndef MATCH_STATISTICS_H_INCLUDED
+#define MATCH_STATISTICS_H_INCLUDED
+
+#include "data.h"
+
+#include <cmath>
+#include <cstddef>
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/accumulators/accumulators.hpp>
+#include <boost/accumulators/statistics/stats.hpp>
+#include <boost/accumulators/statistics/mean.hpp>
+#include <boost/accumulators/statistics/min.hpp>
+#include <boost/accumulators/statistics/max.hpp>
+#include <boost/accumulators/statistics/variance.hpp>
+#include <boost/dynamic_bitset.hpp>
+
+// Label matches between queries and their neighbors
+struct Statistics
+{
+    using ClassAccumulator = boost::accumulators::accumulator_set<double, boost::accumulators::stats<
+        boost::accumulators::tag::mean, boost::accumulators::tag::min, boost::accumulators::tag::max>>;
+
+    Statistics(int n, size_t classes)
+        : n(n)
+        , match_counts(n, 0)
+        , cumulative_match_counts(n, 0)
+        , match_hist(n+1, 0)
+        , class_matches(classes)
+    {
+    }
+
+    // Adds the neighbors of one query, missing neighbors (-1) never match
+    // - returns the number of matching neighbors
+    unsigned add(double label, int const * indices, Data const & train)
+    {
+        unsigned matching_neighbors = 0;
+        bool found = false;
+        for(int j = 0; j < n; ++j)
+        {
+            bool const ok = (indices[j] >= 0) && (std::abs(label - train.labels[indices[j]]) < 0.1);
+            if(ok)
+            {
+                ++matching_neighbors;
+                ++match_counts[j];
+            }
+            found = found || ok;
+            if(found)
+                ++cumulative_match_counts[j];
+        }
+        ++match_hist[matching_neighbors];
+
+        size_t const c = label;
+        if(c >= class_matches.size())
+            class_matches.resize(c+1);
+        class_matches[c](matching_neighbors);
+
+        ++count;
+        return matching_neighbors;
+    }
+
+    // Classes seen in the queries
+    boost::dynamic_bitset<> class_set() const
+    {
+        boost::dynamic_bitset<> classes(class_matches.size());
+        for(size_t i = 0; i < class_matches.size(); ++i)
+            classes[i] = boost::accumulators::count(class_matches[i]) > 0;
+        return classes;
+    }
+
+    int n;
+    size_t count = 0;
+    std::vector<size_t> match_counts;
+    std::vector<size_t> cumulative_match_counts;
+    std::vector<size_t> match_hist;
+    std::vector<ClassAccumulator> class_matches;
+};
+
+// Mean and variance of the match rates of cross-validation folds
+struct FoldStatistics
+{
+    using RateAccumulator = boost::accumulators::accumulator_set<double, boost::accumulators::stats<
+        boost::accumulators::tag::mean, boost::accumulators::tag::variance>>;
+
+    explicit FoldStatistics(int n)
+        : n(n)
+        , match_rates(n)
+        , cumulative_match_rates(n)
+        , hist_rates(n+1)
+    {
+    }
+
+    // Adds the statistics of one fold, folds without queries are skipped
+    void add(Statistics const & fold)
+    {
+        if(fold.count == 0)
+            return;
+        for(int j = 0; j < n; ++j)
+        {
+            match_rates[j](double(fold.match_counts[j])/fold.count);
+            cumulative_match_rates[j](double(fold.cumulative_match_counts[j])/fold.count);
+        }
+        for(int j = 0; j <= n; ++j)
+            hist_rates[j](double(fold.match_hist[j])/fold.count);
+        if(class_matches.size() < fold.class_matches.size())
+            class_matches.resize(fold.class_matches.size());
+        for(size_t c = 0; c < fold.class_matches.size(); ++c)
+            if(boost::accumulators::count(fold.class_matches[c]) > 0)
+                class_matches[c](boost::accumulators::mean(fold.class_matches[c]));
+        ++folds;
+    }
+
+    int n;
+    size_t folds = 0;
+    std::vector<RateAccumulator> match_rates;
+    std::vector<RateAccumulator> cumulative_match_rates;
+    std::vector<RateAccumulator> hist_rates;
+    std::vector<RateAccumulator> class_matches;// mean matching neighbors per class
+};
+
+// Statistics of every check level and neighbor count of a sweep
+// - every check level is one search at the largest neighbor count, smaller counts take the first neighbors
+struct StatisticsSweep
+{
+    StatisticsSweep(std::vector<int> const & checks, std::vector<int> const & counts, size_t classes)
+        : checks(checks)
+        , counts(counts)
+        , recalls(checks.size()*counts.size(), 0.0)
+    {
+        for(size_t level = 0; level < checks.size(); ++level)
+        {
+            for(int n : counts)
+            {
+                tables.emplace_back(n, classes);
+                folds.emplace_back(n);
+            }
+        }
+    }
+
+    size_t size() const { return tables.size(); }
+    int max_count() const { return *std::max_element(counts.begin(), counts.end()); }
+    Statistics & table(size_t level, size_t i) { return tables[level*counts.size() + i]; }
+
+    // Adds the neighbors of one query to the tables of a check level
+    // - returns the number of matching neighbors at the largest count
+    unsigned add(size_t level, double label, int const * indices, Data const & train)
+    {
+        unsigned matching_neighbors = 0;
+        for(size_t i = 0; i < counts.size(); ++i)
+        {
+            unsigned const m = table(level, i).add(label, indices, train);
+            if(counts[i] == max_count())
+                matching_neighbors = m;
+        }
+        return matching_neighbors;
+    }
+
+    std::vector<int> checks;
+    std::vector<int> counts;
+    std::vector<Statistics> tables;// checks x counts
+    std::vector<FoldStatistics> folds;// checks x counts
+    std::vector<double> recalls;// summed recall@n, checks x counts
+};
+
+#endif//MATCH_STATISTICS_H_INCLUDED
@@ -0,0 +1,230 @@
+#ifndef INDEX_TUNE_H_INCLUDED
+#define INDEX_TUNE_H_INCLUDED
+
+#include "bench.h"
+#include "groundtruth.h"
+#include "params.h"
+#include "search.h"
+
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <opencv2/flann/flann.hpp>
+
+// -- Index tuner --
+//
+// Sweeps index types and search checks on a sample of the training rows, the held out rows are the queries.
+// The fastest configuration that reaches the target recall@k within the latency and memory budgets wins.
+// Latency and memory are measured on the sample index, a full index is larger and a bit slower.
+
+struct TuneTarget
+{
+    int k = 10;
+    double recall = 0.9;
+    double latency = 0;// p99 seconds per query, 0 = any
+    uint64_t memory = 0;// index bytes, 0 = any
+};
+
+struct TuneResult
+{
+    IndexConfig config;
+    int checks = 32;
+    double recall = 0;
+    double qps = 0;
+    double p99 = 0;
+    uint64_t index_bytes = 0;
+    bool met = false;// false if no configuration met the target, the result has the best recall then
+};
+
+// Index configurations the tuner tries, cheapest first
+std::vector<IndexConfig> tune_candidates()
+{
+    std::vector<IndexConfig> candidates;
+    for(int trees : {1, 4, 8, 16})
+    {
+        IndexConfig config;
+        config.type = 1;
+        config.kd_tree_count = trees;
+        candidates.push_back(config);
+    }
+    for(int branching : {16, 32, 64})
+    {
+        IndexConfig config;
+        config.type = 2;
+        config.km_branching = branching;
+        config.km_iterations = 5;
+        candidates.push_back(config);
+    }
+    IndexConfig composite;
+    composite.type = 3;
+    candidates.push_back(composite);
+    IndexConfig linear;
+    linear.type = 0;
+    candidates.push_back(linear);
+    return candidates;
+}
+
+TuneResult tune(cv::Mat_<float> const & mat, int distance, TuneTarget const & target,
+    size_t sample_rows, size_t sample_queries, unsigned threads, std::ostream & log)
+{
+    // held out queries first, then the training sample
+    std::vector<int> order(mat.rows);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(1));
+    sample_queries = std::min<size_t>(sample_queries, mat.rows/2);
+    sample_rows = std::min<size_t>(sample_rows, mat.rows - sample_queries);
+    cv::Mat_<float> queries(sample_queries, mat.cols);
+    cv::Mat_<float> train(sample_rows, mat.cols);
+    for(size_t i = 0; i < sample_queries; ++i)
+        std::copy(mat[order[i]], mat[order[i]] + mat.cols, queries[i]);
+    for(size_t i = 0; i < sample_rows; ++i)
+        std::copy(mat[order[sample_queries+i]], mat[order[sample_queries+i]] + mat.cols, train[i]);
+
+    GroundTruth truth(nullptr, train, target.k, distance, threads);
+    truth.add(queries, cv::Mat_<int>());
+    cv::Mat_<int> const exact = truth.exact();
+
+    TuneResult best;
+    bool found = false;
+    cv::Mat_<int> indices;
+    cv::Mat_<float> dists;
+    std::vector<double> latencies;
+    for(auto const & config : tune_candidates())
+    {
+        auto const params = make_params(config);
+        cv::flann::Index index(train, *params, static_cast<cvflann::flann_distance_t>(distance));
+        uint64_t const bytes = index_bytes(index);
+        if((target.memory > 0) && (bytes > target.memory))
+        {
+            log << '\t' << to_string(config) << " : " << bytes << " bytes over budget\n";
+            continue;
+        }
+
+        FlannEngine engine(index);
+        for(int checks : {16, 32, 64, 128, 256, 512, 1024})
+        {
+            double const seconds = timed_search(engine, queries, indices, dists, Query{target.k, -1.0, checks}, threads, latencies);
+
+            TuneResult result;
+            result.config = config;
+            result.checks = checks;
+            result.recall = recall(indices, exact, queries.rows);
+            result.qps = (seconds > 0) ? queries.rows/seconds : 0;
+            result.p99 = percentile(latencies, 0.99);
+            result.index_bytes = bytes;
+            bool const in_time = (target.latency <= 0) || (result.p99 <= target.latency);
+            result.met = (result.recall >= target.recall) && in_time;
+
+            log << '\t' << to_string(config) << " checks " << checks << " : recall@" << target.k << ' ' << result.recall
+                << ", " << result.qps << " qps, p99 " << (result.p99*1e6) << " us" << (result.met ? " *" : "") << '\n';
+
+            if(!found || (result.met && (!best.met || (result.qps > best.qps)))
+                || (!best.met && !result.met && (result.recall > best.recall)))
+            {
+                best = result;
+                found = true;
+            }
+            // more checks only cost time, linear search doesn't use them
+            if(result.met || !in_time || (config.type == 0))
+                break;
+        }
+    }
+    return best;
+}
+
+// -- Tuning sidecar --
+//
+// "name=value" lines, the tuned configuration is reused for data of the same dimension and distance,
+// within a factor of 2 in rows, and the same target.
+
+char const tune_magic[] = "flann-tune 1";
+
+void save_tuning(char const * filename, TuneResult const & result, TuneTarget const & target, cv::Mat_<float> const & mat, int distance)
+{
+    std::ofstream out(filename);
+    out.precision(17);
+    out << tune_magic << "\n"
+        "dim=" << mat.cols << "\n"
+        "rows=" << mat.rows << "\n"
+        "distance=" << distance << "\n"
+        "k=" << target.k << "\n"
+        "target_recall=" << target.recall << "\n"
+        "latency_budget=" << target.latency << "\n"
+        "memory_budget=" << target.memory << "\n"
+        "config=" << to_string(result.config) << "\n"
+        "checks=" << result.checks << "\n"
+        "recall=" << result.recall << "\n"
+        "qps=" << result.qps << "\n"
+        "p99_seconds=" << result.p99 << "\n"
+        "index_bytes=" << result.index_bytes << "\n"
+        "met=" << (result.met ? 1 : 0) << '\n';
+    if(!out.flush())
+    {
+        std::cerr << "Can't write '" << filename << "'\n";
+        throw std::runtime_error("");
+    }
+}
+
+// Returns false if there is no sidecar or it doesn't fit the data and the target
+bool load_tuning(char const * filename, TuneTarget const & target, cv::Mat_<float> const & mat, int distance, TuneResult & result)
+{
+    std::ifstream in(filename);
+    std::string line;
+    if(!std::getline(in, line) || (line != tune_magic))
+        return false;
+
+    std::string config;
+    double dim = -1, rows = -1, dist = -1, k = -1, recall = -1, latency = -1, memory = -1;
+    while(std::getline(in, line))
+    {
+        auto const eq = line.find('=');
+        if(eq == std::string::npos)
+            continue;
+        std::string const name = line.substr(0, eq);
+        std::string const value = line.substr(eq+1);
+        double const number = strtod(value.c_str(), nullptr);
+        if(name == "config")
+            config = value;
+        else if(name == "dim")
+            dim = number;
+        else if(name == "rows")
+            rows = number;
+        else if(name == "distance")
+            dist = number;
+        else if(name == "k")
+            k = number;
+        else if(name == "target_recall")
+            recall = number;
+        else if(name == "latency_budget")
+            latency = number;
+        else if(name == "memory_budget")
+            memory = number;
+        else if(name == "checks")
+            result.checks = number;
+        else if(name == "recall")
+            result.recall = number;
+        else if(name == "qps")
+            result.qps = number;
+        else if(name == "p99_seconds")
+            result.p99 = number;
+        else if(name == "index_bytes")
+            result.index_bytes = number;
+        else if(name == "met")
+            result.met = (number != 0);
+    }
+    if((dim != mat.cols) || (dist != distance) || (rows*2 < mat.rows) || (rows > 2.0*mat.rows)
+        || (k != target.k) || (recall != target.recall) || (latency != target.latency) || (memory != target.memory))
+        return false;
+    result.config = IndexConfig();
+    return parse_config(config, result.config);
+}
+
+#endif//INDEX_TUNE_H_INCLUDED
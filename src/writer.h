@@ -0,0 +1,118 @@
+#ifndef RESULT_WRITER_H_INCLUDED
+#define RESULT_WRITER_H_INCLUDED
+
+#include <cstdio>
+
+#include <charconv>
+#include <memory>
+#include <stdexcept>
+#include <iostream>
+
+// Buffered text output formatted with to_chars
+// - the buffer is written only when full or on flush
+// - a failed write of a full buffer throws, flush and close return false on errors
+class Writer
+{
+public:
+    static size_t const buffer_size = 1 << 20;
+
+    Writer() = default;
+
+    Writer(Writer const &) = delete;
+    Writer & operator=(Writer const &) = delete;
+
+    // Call close first to see write errors
+    ~Writer()
+    {
+        if(m_file)
+        {
+            write();
+            fclose(m_file);
+        }
+    }
+
+    bool open(char const * filename)
+    {
+        m_file = fopen(filename, "w");
+        if(!m_file)
+            return false;
+        m_buffer = std::make_unique<char[]>(buffer_size);
+        m_size = 0;
+        return true;
+    }
+
+    explicit operator bool() const { return m_file != nullptr; }
+
+    Writer & operator<<(char c)
+    {
+        reserve(1);
+        m_buffer[m_size++] = c;
+        return *this;
+    }
+
+    // Same text as std::ostream with default precision
+    Writer & operator<<(double value)
+    {
+        return put(value, std::chars_format::general, 6);
+    }
+
+    Writer & operator<<(int value) { return put(value); }
+    Writer & operator<<(unsigned value) { return put(value); }
+    Writer & operator<<(long value) { return put(value); }
+    Writer & operator<<(unsigned long value) { return put(value); }
+
+    // Writes the buffer, returns false if the file has seen an error
+    bool flush()
+    {
+        if(!m_file)
+            return true;
+        bool const written = write();
+        return (fflush(m_file) == 0) && written && !ferror(m_file);
+    }
+
+    // Flushes and closes the file, returns false if it has seen an error
+    bool close()
+    {
+        if(!m_file)
+            return true;
+        bool const flushed = flush();
+        bool const closed = fclose(m_file) == 0;
+        m_file = nullptr;
+        m_buffer.reset();
+        return flushed && closed;
+    }
+
+private:
+    static size_t const max_field = 64;
+
+    template<typename T, typename ... Format>
+    Writer & put(T value, Format ... format)
+    {
+        reserve(max_field);
+        char * const p = m_buffer.get() + m_size;
+        m_size = std::to_chars(p, p+max_field, value, format...).ptr - m_buffer.get();
+        return *this;
+    }
+
+    void reserve(size_t size)
+    {
+        if((m_size + size > buffer_size) && !write())
+        {
+            std::cerr << "Can't write output\n";
+            throw std::runtime_error("");
+        }
+    }
+
+    bool write()
+    {
+        bool const written = (m_size == 0) || (fwrite(m_buffer.get(), 1, m_size, m_file) == m_size);
+        m_size = 0;
+        return written;
+    }
+
+    FILE * m_file = nullptr;
+    std::unique_ptr<char[]> m_buffer;
+    size_t m_size = 0;
+};
+
+#endif//RESULT_WRITER_H_INCLUDED